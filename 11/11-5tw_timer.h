@@ -5,6 +5,13 @@
 #include <netinet/in.h>
 #include <stdio.h>
 
+//演示用的打印，放进服务器里用时先定义 TW_TIMER_QUIET 关掉
+#ifdef TW_TIMER_QUIET
+#define TW_TIMER_LOG( ... )
+#else
+#define TW_TIMER_LOG( ... ) printf( __VA_ARGS__ )
+#endif
+
 #define BUFFER_SIZE 64
 class tw_timer;
 //绑定socket和定时器
@@ -60,31 +67,8 @@ public:
         {
             return NULL;
         }
-        int ticks = 0;
-        if( timeout < TI )
-        {
-            ticks = 1;
-        }
-        else
-        {
-            ticks = timeout / TI;
-        }
-        int rotation = ticks / N;
-        //也可以写成
-        //int ts = ( cur_slot + ticks ) % N;
-        int ts = ( cur_slot + ( ticks % N ) ) % N;
-        tw_timer* timer = new tw_timer( rotation, ts );
-        if( !slots[ts] )
-        {
-            printf( "add timer, rotation is %d, ts is %d, cur_slot is %d\n", rotation, ts, cur_slot );
-            slots[ts] = timer;
-        }
-        else
-        {
-            timer->next = slots[ts];
-            slots[ts]->prev = timer;
-            slots[ts] = timer;
-        }
+        tw_timer* timer = new tw_timer( 0, 0 );
+        link( timer, timeout );
         return timer;
     }
     void del_timer( tw_timer* timer )
@@ -93,33 +77,26 @@ public:
         {
             return;
         }
-        int ts = timer->time_slot;
-        if( timer == slots[ts] )
-        {
-            slots[ts] = slots[ts]->next;
-            if( slots[ts] )
-            {
-                slots[ts]->prev = NULL;
-            }
-            delete timer;
-        }
-        else
+        unlink( timer );
+        delete timer;
+    }
+    //把已有的定时器挪到 timeout 秒以后，不重新分配，O(1)；连接上有活动时用它续期
+    void adjust_timer( tw_timer* timer, int timeout )
+    {
+        if( !timer || timeout < 0 )
         {
-            timer->prev->next = timer->next;
-            if( timer->next )
-            {
-                timer->next->prev = timer->prev;
-            }
-            delete timer;
+            return;
         }
+        unlink( timer );
+        link( timer, timeout );
     }
     void tick()
     {
         tw_timer* tmp = slots[cur_slot];
-        printf( "current slot is %d\n", cur_slot );
+        TW_TIMER_LOG( "current slot is %d\n", cur_slot );
         while( tmp )
         {
-            printf( "tick the timer once\n" );
+            TW_TIMER_LOG( "tick the timer once\n" );
             if( tmp->rotation > 0 )
             {
                 tmp->rotation--;
@@ -130,7 +107,7 @@ public:
                 tmp->cb_func( tmp->user_data );
                 if( tmp == slots[cur_slot] )
                 {
-                    printf( "delete header in cur_slot\n" );
+                    TW_TIMER_LOG( "delete header in cur_slot\n" );
                     slots[cur_slot] = tmp->next;
                     delete tmp;
                     if( slots[cur_slot] )
@@ -152,7 +129,61 @@ public:
                 }
             }
         }
-        cur_slot = ++cur_slot % N;
+        cur_slot = ( cur_slot + 1 ) % N;
+    }
+
+private:
+    //按 timeout 算出圈数和槽，插到槽的链表头
+    void link( tw_timer* timer, int timeout )
+    {
+        int ticks = 0;
+        if( timeout < TI )
+        {
+            ticks = 1;
+        }
+        else
+        {
+            ticks = timeout / TI;
+        }
+        int rotation = ticks / N;
+        //也可以写成
+        //int ts = ( cur_slot + ticks ) % N;
+        int ts = ( cur_slot + ( ticks % N ) ) % N;
+        timer->rotation = rotation;
+        timer->time_slot = ts;
+        timer->prev = NULL;
+        timer->next = slots[ts];
+        if( !slots[ts] )
+        {
+            TW_TIMER_LOG( "add timer, rotation is %d, ts is %d, cur_slot is %d\n", rotation, ts, cur_slot );
+        }
+        else
+        {
+            slots[ts]->prev = timer;
+        }
+        slots[ts] = timer;
+    }
+    void unlink( tw_timer* timer )
+    {
+        int ts = timer->time_slot;
+        if( timer == slots[ts] )
+        {
+            slots[ts] = slots[ts]->next;
+            if( slots[ts] )
+            {
+                slots[ts]->prev = NULL;
+            }
+        }
+        else
+        {
+            timer->prev->next = timer->next;
+            if( timer->next )
+            {
+                timer->next->prev = timer->prev;
+            }
+        }
+        timer->next = NULL;
+        timer->prev = NULL;
     }
 
 private:
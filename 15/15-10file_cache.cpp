@@ -0,0 +1,450 @@
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "15-10file_cache.h"
+
+//默认缓存 64MB
+static const size_t DEFAULT_BUDGET = 64 * 1024 * 1024;
+//IN_CREATE 是为了新出现的预压缩副本，见 sidecar_base
+static const unsigned int WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                       | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+static std::string dir_of( const std::string& path )
+{
+    size_t pos = path.rfind( '/' );
+    return ( pos == std::string::npos ) ? std::string( "." ) : path.substr( 0, pos );
+}
+
+//带 //、/./、/../ 的路径和规范路径指向同一个文件，但 inotify 对同一个目录只给一个 wd，这类路径不进缓存
+static bool clean_path( const char* path )
+{
+    for( const char* p = strchr( path, '/' ); p; p = strchr( p + 1, '/' ) )
+    {
+        if( p[1] == '/' || ( p[1] == '.' && ( p[2] == '/' || p[2] == '\0' || ( p[2] == '.' && ( p[3] == '/' || p[3] == '\0' ) ) ) ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//name 是预压缩副本时返回原文件名，否则返回空串
+static std::string sidecar_base( const char* name )
+{
+    size_t len = strlen( name );
+    for( int i = 0; i < SIDECAR_COUNT; ++i )
+    {
+        size_t suffix_len = strlen( SIDECAR_SUFFIXES[i] );
+        if( len > suffix_len && strcmp( name + len - suffix_len, SIDECAR_SUFFIXES[i] ) == 0 )
+        {
+            return std::string( name, len - suffix_len );
+        }
+    }
+    return std::string();
+}
+
+//按纳秒比较，原文件在生成副本的同一秒里又被改过也能看出来
+static bool older( const struct stat& a, const struct stat& b )
+{
+    return a.st_mtim.tv_sec < b.st_mtim.tv_sec
+           || ( a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec );
+}
+
+file_cache* file_cache::instance()
+{
+    //故意不释放：监视线程一直阻塞在 inotify 上，进程退出时一起结束
+    static file_cache* cache = new file_cache;
+    return cache;
+}
+
+file_cache::file_cache() : m_budget( DEFAULT_BUDGET ), m_bytes( 0 ), m_inotify_fd( -1 ), m_generation( 0 )
+{
+    m_inotify_fd = inotify_init1( IN_CLOEXEC );
+    if( m_inotify_fd < 0 )
+    {
+        //没有 inotify 就没法知道文件变了，只能每次都从磁盘读
+        printf( "inotify_init failure errno %d, file cache disabled\n", errno );
+        return;
+    }
+    if( pthread_create( &m_watcher, NULL, watcher, this ) != 0 || pthread_detach( m_watcher ) != 0 )
+    {
+        close( m_inotify_fd );
+        m_inotify_fd = -1;
+    }
+}
+
+void file_cache::set_budget( size_t bytes )
+{
+    m_locker.lock();
+    m_budget = bytes;
+    evict();
+    m_locker.unlock();
+}
+
+int file_cache::acquire( const char* path, file_entry** entry )
+{
+    m_locker.lock();
+    std::unordered_map< std::string, file_entry* >::iterator it = m_entries.find( path );
+    if( it != m_entries.end() )
+    {
+        file_entry* hit = it->second;
+        hit->m_refs++;
+        m_lru.splice( m_lru.begin(), m_lru, hit->m_lru_pos );
+        m_locker.unlock();
+        *entry = hit;
+        return 0;
+    }
+    //先盯住目录再读文件，这样读的过程中文件被改也能收到通知
+    std::string dir = dir_of( path );
+    bool watched = clean_path( path ) && watch_dir( dir );
+    unsigned long generation = m_generation;
+    m_locker.unlock();
+
+    //磁盘操作不持锁
+    file_entry* loaded = NULL;
+    int ret = load( path, &loaded );
+
+    m_locker.lock();
+    if( ret != 0 )
+    {
+        if( watched )
+        {
+            unwatch_dir( dir );
+        }
+        m_locker.unlock();
+        return ret;
+    }
+    it = m_entries.find( path );
+    if( it != m_entries.end() )
+    {
+        //别的线程抢先放进去了，用它的
+        destroy( loaded );
+        loaded = it->second;
+        loaded->m_refs++;
+        m_lru.splice( m_lru.begin(), m_lru, loaded->m_lru_pos );
+        if( watched )
+        {
+            unwatch_dir( dir );
+        }
+    }
+    else if( watched && generation == m_generation
+             && ( size_t )loaded->m_stat.st_size <= m_budget / MAX_OBJECT_SHARE )
+    {
+        //条目接手这次对目录的引用
+        loaded->m_cached = true;
+        m_lru.push_front( loaded );
+        loaded->m_lru_pos = m_lru.begin();
+        m_entries[ loaded->m_path ] = loaded;
+        m_bytes += loaded->m_stat.st_size;
+        evict();
+    }
+    else if( watched )
+    {
+        //太大或者加载期间有文件变了，这个 fd 只给这一个请求用
+        unwatch_dir( dir );
+    }
+    m_locker.unlock();
+    *entry = loaded;
+    return 0;
+}
+
+int file_cache::acquire_sidecar( file_entry* base, int type, file_entry** entry )
+{
+    m_locker.lock();
+    bool absent = base->m_no_sidecar[type];
+    m_locker.unlock();
+    if( absent )
+    {
+        return ENOENT;
+    }
+    std::string path = base->m_path + SIDECAR_SUFFIXES[type];
+    file_entry* sidecar = NULL;
+    int ret = acquire( path.c_str(), &sidecar );
+    if( ret == 0 && older( sidecar->m_stat, base->m_stat ) )
+    {
+        //原文件改过以后副本还没重新生成，内容对不上
+        release( sidecar );
+        ret = ENOENT;
+    }
+    if( ret != 0 )
+    {
+        //这期间副本被创建出来的话，base 已经被监视线程作废了，记在它上面也没关系
+        m_locker.lock();
+        base->m_no_sidecar[type] = true;
+        m_locker.unlock();
+        return ret;
+    }
+    *entry = sidecar;
+    return 0;
+}
+
+bool file_cache::has_sidecar( file_entry* base )
+{
+    for( int type = 0; type < SIDECAR_COUNT; ++type )
+    {
+        file_entry* sidecar = NULL;
+        if( acquire_sidecar( base, type, &sidecar ) == 0 )
+        {
+            release( sidecar );
+            return true;
+        }
+    }
+    return false;
+}
+
+void file_cache::release( file_entry* entry )
+{
+    m_locker.lock();
+    if( --entry->m_refs == 0 )
+    {
+        if( !entry->m_cached )
+        {
+            destroy( entry );
+        }
+        else if( m_bytes > m_budget )
+        {
+            evict();
+        }
+    }
+    m_locker.unlock();
+}
+
+int file_cache::load( const char* path, file_entry** entry )
+{
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return ( errno == EACCES ) ? EACCES : ENOENT;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) < 0 )
+    {
+        close( fd );
+        return ENOENT;
+    }
+    if( !( st.st_mode & S_IROTH ) )
+    {
+        close( fd );
+        return EACCES;
+    }
+    if( S_ISDIR( st.st_mode ) )
+    {
+        close( fd );
+        return EISDIR;
+    }
+    //小文件读进内存后 fd 就用不着了，一次读不全的（比如正在被写）留着 fd 走 sendfile
+    char* data = NULL;
+    if( st.st_size <= SMALL_FILE )
+    {
+        data = new char[ st.st_size > 0 ? st.st_size : 1 ];
+        if( pread( fd, data, st.st_size, 0 ) == st.st_size )
+        {
+            close( fd );
+            fd = -1;
+        }
+        else
+        {
+            delete [] data;
+            data = NULL;
+        }
+    }
+
+    file_entry* loaded = new file_entry;
+    loaded->m_path = path;
+    loaded->m_fd = fd;
+    loaded->m_data = data;
+    loaded->m_stat = st;
+    loaded->m_etag_len = snprintf( loaded->m_etag, sizeof( loaded->m_etag ), "\"%llx-%llx\"",
+                                   ( unsigned long long )st.st_mtime, ( unsigned long long )st.st_size );
+    format_http_date( loaded->m_last_modified, st.st_mtime );
+    memset( loaded->m_no_sidecar, 0, sizeof( loaded->m_no_sidecar ) );
+    loaded->m_refs = 1;
+    loaded->m_cached = false;
+    *entry = loaded;
+    return 0;
+}
+
+void file_cache::destroy( file_entry* entry )
+{
+    if( entry->m_fd >= 0 )
+    {
+        close( entry->m_fd );
+    }
+    delete [] entry->m_data;
+    delete entry;
+}
+
+//从缓存表里拿掉，还有人在用的等 release 时再释放
+void file_cache::drop( file_entry* entry )
+{
+    m_entries.erase( entry->m_path );
+    m_lru.erase( entry->m_lru_pos );
+    m_bytes -= entry->m_stat.st_size;
+    entry->m_cached = false;
+    unwatch_dir( dir_of( entry->m_path ) );
+    if( entry->m_refs == 0 )
+    {
+        destroy( entry );
+    }
+}
+
+//从最久没用的开始淘汰，正在发送的跳过
+void file_cache::evict()
+{
+    std::list< file_entry* >::iterator it = m_lru.end();
+    while( m_bytes > m_budget && it != m_lru.begin() )
+    {
+        --it;
+        file_entry* victim = *it;
+        if( victim->m_refs > 0 )
+        {
+            continue;
+        }
+        it = m_lru.erase( it );
+        m_entries.erase( victim->m_path );
+        m_bytes -= victim->m_stat.st_size;
+        unwatch_dir( dir_of( victim->m_path ) );
+        destroy( victim );
+    }
+}
+
+bool file_cache::watch_dir( const std::string& dir )
+{
+    if( m_inotify_fd < 0 )
+    {
+        return false;
+    }
+    std::unordered_map< std::string, dir_watch >::iterator it = m_dirs.find( dir );
+    if( it != m_dirs.end() && it->second.m_wd >= 0 )
+    {
+        it->second.m_users++;
+        return true;
+    }
+    int wd = inotify_add_watch( m_inotify_fd, dir.c_str(), WATCH_MASK );
+    if( wd < 0 )
+    {
+        return false;
+    }
+    dir_watch& watch = m_dirs[ dir ];
+    if( it == m_dirs.end() )
+    {
+        watch.m_users = 0;
+    }
+    watch.m_wd = wd;
+    watch.m_users++;
+    m_wds[ wd ] = dir;
+    return true;
+}
+
+void file_cache::unwatch_dir( const std::string& dir )
+{
+    std::unordered_map< std::string, dir_watch >::iterator it = m_dirs.find( dir );
+    if( it == m_dirs.end() || --it->second.m_users > 0 )
+    {
+        return;
+    }
+    if( it->second.m_wd >= 0 )
+    {
+        inotify_rm_watch( m_inotify_fd, it->second.m_wd );
+        m_wds.erase( it->second.m_wd );
+    }
+    m_dirs.erase( it );
+}
+
+void file_cache::invalidate( const std::string& path )
+{
+    m_generation++;
+    std::unordered_map< std::string, file_entry* >::iterator it = m_entries.find( path );
+    if( it != m_entries.end() )
+    {
+        drop( it->second );
+    }
+}
+
+void file_cache::invalidate_dir( const std::string& dir )
+{
+    m_generation++;
+    std::list< file_entry* >::iterator it = m_lru.begin();
+    while( it != m_lru.end() )
+    {
+        file_entry* entry = *it++;
+        if( dir_of( entry->m_path ) == dir )
+        {
+            drop( entry );
+        }
+    }
+}
+
+void* file_cache::watcher( void* arg )
+{
+    ( ( file_cache* )arg )->run_watcher();
+    return NULL;
+}
+
+void file_cache::run_watcher()
+{
+    char buf[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true )
+    {
+        ssize_t len = read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len <= 0 )
+        {
+            if( len < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            printf( "inotify read failure errno %d\n", errno );
+            break;
+        }
+        m_locker.lock();
+        for( char* ptr = buf; ptr < buf + len; ptr += sizeof( struct inotify_event ) + ( ( struct inotify_event* )ptr )->len )
+        {
+            struct inotify_event* event = ( struct inotify_event* )ptr;
+            if( event->mask & IN_Q_OVERFLOW )
+            {
+                //事件丢了，不知道哪些文件变了，全部作废
+                m_generation++;
+                while( !m_lru.empty() )
+                {
+                    drop( m_lru.front() );
+                }
+                continue;
+            }
+            std::unordered_map< int, std::string >::iterator it = m_wds.find( event->wd );
+            if( it == m_wds.end() )
+            {
+                continue;
+            }
+            std::string dir = it->second;
+            if( event->len > 0 )
+            {
+                invalidate( dir + "/" + event->name );
+                //副本出现、变化或者消失时，原文件条目上记的“没有副本”也要作废
+                std::string base = sidecar_base( event->name );
+                if( !base.empty() )
+                {
+                    invalidate( dir + "/" + base );
+                }
+            }
+            if( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) )
+            {
+                //目录本身没了或者挪走了，下面的条目全部作废
+                invalidate_dir( dir );
+            }
+            if( event->mask & IN_IGNORED )
+            {
+                //内核已经撤掉了这个监视，还在加载的请求不会再放进缓存，之后的请求重新加监视
+                m_wds.erase( event->wd );
+                std::unordered_map< std::string, dir_watch >::iterator dit = m_dirs.find( dir );
+                if( dit != m_dirs.end() )
+                {
+                    dit->second.m_wd = -1;
+                }
+            }
+        }
+        m_locker.unlock();
+    }
+}
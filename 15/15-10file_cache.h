@@ -0,0 +1,99 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include "14-2locker.h"
+#include "15-14http_format.h"
+
+//预压缩副本的种类，按优先顺序排列；副本就是原文件名加上后缀，和原文件放在同一个目录，由 15-15precompress 离线生成
+enum SIDECAR { SIDECAR_BR = 0, SIDECAR_GZIP, SIDECAR_COUNT };
+//Accept-Encoding 和 Content-Encoding 里用的名字
+static const char* const SIDECAR_CODINGS[ SIDECAR_COUNT ] = { "br", "gzip" };
+static const char* const SIDECAR_SUFFIXES[ SIDECAR_COUNT ] = { ".br", ".gz" };
+
+//一个被缓存的静态文件，用引用计数管理：小文件整个读进 m_data，和头部一起用 writev 发；大文件保持打开的 fd 给 sendfile 用
+//http_conn 在 do_request 里 acquire，写完响应后 release，期间即使文件被改了内容和 fd 也不会被释放
+struct file_entry
+{
+    std::string m_path;
+    //小文件为 -1
+    int m_fd;
+    //大文件为 NULL
+    char* m_data;
+    struct stat m_stat;
+    //条件请求用的校验值，加载时按 stat 生成好，命中缓存时比较它们不用任何系统调用
+    //带引号的强 ETag，由修改时间和大小生成
+    char m_etag[48];
+    int m_etag_len;
+    //HTTP 日期格式的修改时间，不带 '\0'
+    char m_last_modified[ HTTP_DATE_LEN ];
+    //已经查过没有（或者比原文件旧）的预压缩副本，之后不再去文件系统找；副本出现时整个条目会被作废
+    bool m_no_sidecar[ SIDECAR_COUNT ];
+    int m_refs;
+    //还在缓存表里；被淘汰或者文件变了以后为 false，最后一个引用释放时才真正 close
+    bool m_cached;
+    std::list< file_entry* >::iterator m_lru_pos;
+};
+
+//进程内所有线程共用的打开文件缓存，按完整路径索引
+//命中时不做任何文件系统调用；总字节数超过预算时按 LRU 淘汰没人在用的条目；
+//后台线程用 inotify 盯着缓存文件所在的目录，文件被改、删、改名时把对应条目作废
+class file_cache
+{
+public:
+    static file_cache* instance();
+    void set_budget( size_t bytes );
+    //成功返回 0 并通过 entry 带回条目；失败返回 ENOENT、EACCES（其他人不可读）或 EISDIR
+    int acquire( const char* path, file_entry** entry );
+    void release( file_entry* entry );
+    //取 base 的预压缩副本，和 acquire 一样用完要 release；没有副本、副本比原文件旧时返回 ENOENT，
+    //结果记在 base 上，base 还在缓存里时下次直接返回
+    int acquire_sidecar( file_entry* base, int type, file_entry** entry );
+    //base 有没有可用的预压缩副本；有的话同一个 URL 会按 Accept-Encoding 给出不同的内容
+    bool has_sidecar( file_entry* base );
+
+private:
+    file_cache();
+    int load( const char* path, file_entry** entry );
+    void destroy( file_entry* entry );
+    void drop( file_entry* entry );
+    void evict();
+    bool watch_dir( const std::string& dir );
+    void unwatch_dir( const std::string& dir );
+    void invalidate( const std::string& path );
+    void invalidate_dir( const std::string& dir );
+    static void* watcher( void* arg );
+    void run_watcher();
+
+private:
+    //单个文件超过预算的这个比例就不进缓存，每次单独打开
+    static const int MAX_OBJECT_SHARE = 4;
+    //不超过这个大小的文件读进内存
+    static const off_t SMALL_FILE = 16 * 1024;
+    struct dir_watch
+    {
+        int m_wd;
+        //缓存里这个目录下的条目数加上正在加载的请求数，为 0 时撤掉监视；内核撤掉监视后 m_wd 为 -1
+        int m_users;
+    };
+
+    locker m_locker;
+    size_t m_budget;
+    size_t m_bytes;
+    std::unordered_map< std::string, file_entry* > m_entries;
+    //头部是最近用过的
+    std::list< file_entry* > m_lru;
+    int m_inotify_fd;
+    pthread_t m_watcher;
+    std::unordered_map< std::string, dir_watch > m_dirs;
+    std::unordered_map< int, std::string > m_wds;
+    //每作废一次加 1，加载期间变过说明读到的可能是旧文件，不放进缓存
+    unsigned long m_generation;
+};
+
+#endif
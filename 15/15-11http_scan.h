@@ -0,0 +1,87 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+//在 [p, end) 里找第一个等于 a 或 b 的字节，找不到返回 end
+//http_conn::parse_line 用它找 \r\n，解析请求行和头部时用它找空格、\t、冒号
+//x86-64 上 SSE2 一定有，一次看 16 个字节；运行时检测到 AVX2 时一次看 32 个字节。只做不越过 end 的非对齐读，不会读出缓冲区
+
+//逐字节的版本，也用来收尾
+inline const char* scan2_scalar( const char* p, const char* end, char a, char b )
+{
+    for( ; p < end; ++p )
+    {
+        if( *p == a || *p == b )
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef HTTP_SCAN_X86
+inline const char* scan2_sse2( const char* p, const char* end, char a, char b )
+{
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    for( ; p + 16 <= end; p += 16 )
+    {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )p );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, va ), _mm_cmpeq_epi8( v, vb ) ) );
+        if( mask )
+        {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return scan2_scalar( p, end, a, b );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+inline const char* scan2_avx2( const char* p, const char* end, char a, char b )
+{
+    const __m256i va = _mm256_set1_epi8( a );
+    const __m256i vb = _mm256_set1_epi8( b );
+    for( ; p + 32 <= end; p += 32 )
+    {
+        __m256i v = _mm256_loadu_si256( ( const __m256i* )p );
+        unsigned int mask = _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( v, va ), _mm256_cmpeq_epi8( v, vb ) ) );
+        if( mask )
+        {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    //不到 32 个字节的尾巴交给 SSE2
+    return scan2_sse2( p, end, a, b );
+}
+#endif
+
+typedef const char* ( *scan2_fn )( const char*, const char*, char, char );
+
+//进程里第一次调用时选一次实现
+inline scan2_fn scan2_pick()
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" ) ? scan2_avx2 : scan2_sse2;
+#else
+    return scan2_scalar;
+#endif
+}
+
+inline const char* scan2( const char* p, const char* end, char a, char b )
+{
+    static const scan2_fn fn = scan2_pick();
+    return fn( p, end, a, b );
+}
+
+inline char* scan2( char* p, char* end, char a, char b )
+{
+    return const_cast< char* >( scan2( ( const char* )p, ( const char* )end, a, b ) );
+}
+
+#endif
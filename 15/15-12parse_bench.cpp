@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <string>
+#include "15-11http_scan.h"
+#include "15-13header_hash.h"
+
+//http_conn 请求解析的微基准：用浏览器真实发出的请求头，比较
+//原来的逐字节找 \r\n + 每个头部一串 strncasecmp，和 SIMD 扫描找 \r\n、冒号以后按名字长度筛过再比较、或者查完美哈希
+//缓冲区里连着放几十个请求（相当于流水线），只找位置不改缓冲区，各个版本看到的数据完全一样
+//不开优化时 intrinsic 不会内联，结果没有意义，用 -DCMAKE_BUILD_TYPE=Release 构建再跑
+
+static const char* g_requests[] = {
+    "GET /static/js/app.3f9c2a.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/products/list?page=2&sort=price\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=9f8e7d6c5b4a39281706f5e4d3c2b1a0; theme=dark; _gid=GA1.1.987654321.1700000000\r\n"
+    "If-None-Match: \"65f1c2a3-1b2c3\"\r\n"
+    "If-Modified-Since: Wed, 13 Mar 2024 08:15:31 GMT\r\n"
+    "\r\n",
+
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Priority: u=1\r\n"
+    "\r\n",
+
+    "GET /media/video.mp4 HTTP/1.1\r\n"
+    "Host: cdn.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: identity;q=1, *;q=0\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Safari/605.1.15\r\n"
+    "Accept: */*\r\n"
+    "Referer: https://www.example.com/watch/42\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Range: bytes=1048576-\r\n"
+    "If-Range: \"65f1c2a3-9f00000\"\r\n"
+    "\r\n",
+};
+
+static const int REQUESTS_PER_BUFFER = 48;
+
+typedef const char* ( *scan_fn )( const char*, const char*, char, char );
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//原来的 parse_line：逐字节找 \r 或 \n
+static const char* find_crlf_bytewise( const char* p, const char* end, char, char )
+{
+    for( ; p < end; ++p )
+    {
+        if( *p == '\r' || *p == '\n' )
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+//原来的 parse_headers：不知道名字多长，挨个 strncasecmp 带冒号的名字，浏览器发的大部分头部要比完全部 5 个
+static long dispatch_chain( const char* line )
+{
+    if( strncasecmp( line, "Connection:", 11 ) == 0 ) return 1;
+    if( strncasecmp( line, "Content-Length:", 15 ) == 0 ) return 2;
+    if( strncasecmp( line, "Host:", 5 ) == 0 ) return 3;
+    if( strncasecmp( line, "Range:", 6 ) == 0 ) return 4;
+    if( strncasecmp( line, "If-Range:", 9 ) == 0 ) return 5;
+    return 0;
+}
+
+//按名字长度筛：先扫到冒号，名字长度对上了才比较
+static long dispatch_by_length( const char* line, const char* end, scan_fn scan )
+{
+    const char* colon = scan( line, end, ':', ':' );
+    if( colon == end )
+    {
+        return -1;
+    }
+    switch( colon - line )
+    {
+        case 10: return strncasecmp( line, "Connection", 10 ) == 0 ? 1 : 0;
+        case 14: return strncasecmp( line, "Content-Length", 14 ) == 0 ? 2 : 0;
+        case 4: return strncasecmp( line, "Host", 4 ) == 0 ? 3 : 0;
+        case 5: return strncasecmp( line, "Range", 5 ) == 0 ? 4 : 0;
+        case 8: return strncasecmp( line, "If-Range", 8 ) == 0 ? 5 : 0;
+    }
+    return 0;
+}
+
+//现在的 parse_headers：扫到冒号以后查编译期生成的完美哈希
+struct dispatcher
+{
+    void on_header( char* ) {}
+};
+
+static constexpr header_def< dispatcher > g_known_headers[] = {
+    { "Connection", &dispatcher::on_header },
+    { "Content-Length", &dispatcher::on_header },
+    { "Host", &dispatcher::on_header },
+    { "Range", &dispatcher::on_header },
+    { "If-Range", &dispatcher::on_header },
+};
+static constexpr auto g_header_table = make_header_index( g_known_headers );
+
+static long dispatch_by_hash( const char* line, const char* end, scan_fn scan )
+{
+    const char* colon = scan( line, end, ':', ':' );
+    if( colon == end )
+    {
+        return -1;
+    }
+    return g_header_table.find( line, colon - line ) + 1;
+}
+
+enum DISPATCH { DISPATCH_CHAIN, DISPATCH_LENGTH, DISPATCH_HASH };
+
+//把整个缓冲区切成行，请求行之后的每一行分派一次，返回校验和防止被优化掉
+static long parse_buffer( const char* buf, const char* end, scan_fn scan, DISPATCH dispatch )
+{
+    long sum = 0;
+    bool request_line = true;
+    const char* line = buf;
+    while( line < end )
+    {
+        const char* eol = scan( line, end, '\r', '\n' );
+        if( eol + 1 >= end || eol[1] != '\n' )
+        {
+            break;
+        }
+        if( eol == line )
+        {
+            //空行，下一个请求开始
+            request_line = true;
+        }
+        else if( request_line )
+        {
+            sum += scan( line, eol, ' ', '\t' ) - line;
+            request_line = false;
+        }
+        else
+        {
+            switch( dispatch )
+            {
+                case DISPATCH_CHAIN: sum += dispatch_chain( line ); break;
+                case DISPATCH_LENGTH: sum += dispatch_by_length( line, eol, scan ); break;
+                case DISPATCH_HASH: sum += dispatch_by_hash( line, eol, scan ); break;
+            }
+        }
+        sum += eol - line;
+        line = eol + 2;
+    }
+    return sum;
+}
+
+static double run( const std::string& buf, int iterations, scan_fn scan, DISPATCH dispatch, long* sum )
+{
+    const char* begin = buf.data();
+    const char* end = begin + buf.size();
+    double start = now();
+    for( int i = 0; i < iterations; ++i )
+    {
+        *sum += parse_buffer( begin, end, scan, dispatch );
+    }
+    return ( now() - start ) * 1e9 / ( ( double )iterations * REQUESTS_PER_BUFFER );
+}
+
+int main( int argc, char* argv[] )
+{
+    int iterations = ( argc > 1 ) ? atoi( argv[1] ) : 20000;
+    std::string buf;
+    for( int i = 0; i < REQUESTS_PER_BUFFER; ++i )
+    {
+        buf += g_requests[ i % ( sizeof( g_requests ) / sizeof( g_requests[0] ) ) ];
+    }
+
+    struct variant
+    {
+        const char* name;
+        scan_fn scan;
+        DISPATCH dispatch;
+    };
+    variant variants[] = {
+        { "bytewise + strncasecmp chain (old)", find_crlf_bytewise, DISPATCH_CHAIN },
+        { "bytewise + length dispatch", scan2_scalar, DISPATCH_LENGTH },
+        { "bytewise + perfect hash", scan2_scalar, DISPATCH_HASH },
+#ifdef HTTP_SCAN_X86
+        { "sse2 + perfect hash", scan2_sse2, DISPATCH_HASH },
+        { "avx2 + perfect hash", scan2_avx2, DISPATCH_HASH },
+#endif
+    };
+    int count = sizeof( variants ) / sizeof( variants[0] );
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if( !__builtin_cpu_supports( "avx2" ) )
+    {
+        printf( "avx2 not supported on this cpu, skipped\n" );
+        --count;
+    }
+#endif
+
+#ifndef __OPTIMIZE__
+    printf( "warning: built without optimization, numbers are not meaningful\n" );
+#endif
+    printf( "%d requests per buffer, %.0f bytes per request on average, %d iterations\n",
+            REQUESTS_PER_BUFFER, ( double )buf.size() / REQUESTS_PER_BUFFER, iterations );
+    printf( "%-36s %12s %10s %8s\n", "variant", "ns/request", "GB/s", "speedup" );
+    long sum = 0;
+    double baseline = 0;
+    for( int i = 0; i < count; ++i )
+    {
+        //先热身一轮
+        run( buf, iterations / 10 + 1, variants[i].scan, variants[i].dispatch, &sum );
+        double ns = run( buf, iterations, variants[i].scan, variants[i].dispatch, &sum );
+        if( i == 0 )
+        {
+            baseline = ns;
+        }
+        printf( "%-36s %12.1f %10.2f %7.2fx\n", variants[i].name, ns,
+                buf.size() / ( double )REQUESTS_PER_BUFFER / ns, baseline / ns );
+    }
+    printf( "checksum %ld\n", sum );
+    return 0;
+}
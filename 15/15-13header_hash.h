@@ -0,0 +1,131 @@
+#ifndef HEADER_HASH_H
+#define HEADER_HASH_H
+
+#include <strings.h>
+
+//请求头部名字到处理函数的完美哈希，表在编译期生成
+//哈希只看名字长度和首、中、尾三个字节（不分大小写），所以每个头部的开销是固定的，和认识多少个头部无关；
+//命中槽位后再比一次长度和全名，不认识的头部落到空槽或者比较失败，直接跳过
+
+//一个认识的头部：名字和处理函数，处理函数拿到的是冒号后面去掉前导空白的值
+template< typename T >
+struct header_def
+{
+    const char* m_name;
+    void ( T::*m_handler )( char* value );
+};
+
+constexpr int header_name_len( const char* name )
+{
+    int len = 0;
+    while( name[len] )
+    {
+        ++len;
+    }
+    return len;
+}
+
+//槽位数取不小于 2N 的 2 的幂，空槽多一些容易找到没有冲突的种子
+constexpr int header_table_bits( int n )
+{
+    int bits = 1;
+    while( ( 1 << bits ) < 2 * n )
+    {
+        ++bits;
+    }
+    return bits;
+}
+
+constexpr unsigned header_hash( const char* name, int len, unsigned seed, int bits )
+{
+    //| 0x20 把大写字母变成小写，其他字符在已知名字和请求里变法一样，不影响正确性
+    unsigned h = ( unsigned )len
+                 | ( unsigned )( unsigned char )( name[0] | 0x20 ) << 8
+                 | ( unsigned )( unsigned char )( name[len / 2] | 0x20 ) << 16
+                 | ( unsigned )( unsigned char )( name[len - 1] | 0x20 ) << 24;
+    h ^= h >> 15;
+    h *= seed;
+    return h >> ( 32 - bits );
+}
+
+template< int N, int BITS = header_table_bits( N ) >
+class header_index
+{
+public:
+    static const int SIZE = 1 << BITS;
+    //最多试这么多个种子，都有冲突时 ok() 为 false，用 static_assert 挡在编译期
+    static const unsigned MAX_SEED_TRIES = 4096;
+
+    template< typename T >
+    constexpr header_index( const header_def< T > ( &defs )[N] )
+    {
+        for( int i = 0; i < N; ++i )
+        {
+            m_names[i] = defs[i].m_name;
+            m_lens[i] = header_name_len( defs[i].m_name );
+        }
+        for( unsigned tries = 0; tries < MAX_SEED_TRIES; ++tries )
+        {
+            //乘数取奇数
+            unsigned seed = 0x9E3779B1u + 2 * tries;
+            if( try_seed( seed ) )
+            {
+                m_seed = seed;
+                return;
+            }
+        }
+    }
+
+    constexpr bool ok() const
+    {
+        return m_seed != 0;
+    }
+
+    //name 不以 '\0' 结尾，长度由调用者给出；返回 defs 里的下标，不认识返回 -1
+    int find( const char* name, int len ) const
+    {
+        if( len <= 0 )
+        {
+            return -1;
+        }
+        int i = m_slots[ header_hash( name, len, m_seed, BITS ) ];
+        if( i < 0 || m_lens[i] != len || strncasecmp( name, m_names[i], len ) != 0 )
+        {
+            return -1;
+        }
+        return i;
+    }
+
+private:
+    constexpr bool try_seed( unsigned seed )
+    {
+        for( int s = 0; s < SIZE; ++s )
+        {
+            m_slots[s] = -1;
+        }
+        for( int i = 0; i < N; ++i )
+        {
+            unsigned slot = header_hash( m_names[i], m_lens[i], seed, BITS );
+            if( m_slots[slot] >= 0 )
+            {
+                return false;
+            }
+            m_slots[slot] = i;
+        }
+        return true;
+    }
+
+private:
+    unsigned m_seed = 0;
+    signed char m_slots[SIZE] = {};
+    const char* m_names[N] = {};
+    int m_lens[N] = {};
+};
+
+template< typename T, int N >
+constexpr header_index< N > make_header_index( const header_def< T > ( &defs )[N] )
+{
+    return header_index< N >( defs );
+}
+
+#endif
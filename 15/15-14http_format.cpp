@@ -0,0 +1,89 @@
+#include <string.h>
+#include "15-14http_format.h"
+
+//00 到 99 的两位数字，一次转两位
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int format_uint( char* buf, unsigned long long value )
+{
+    //从低位往高位写到临时区的末尾，最后整体拷过去
+    char temp[20];
+    char* p = temp + sizeof( temp );
+    while( value >= 100 )
+    {
+        const char* pair = DIGIT_PAIRS + ( value % 100 ) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if( value >= 10 )
+    {
+        const char* pair = DIGIT_PAIRS + value * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else
+    {
+        *--p = ( char )( '0' + value );
+    }
+    int len = temp + sizeof( temp ) - p;
+    memcpy( buf, p, len );
+    return len;
+}
+
+static void put2( char* buf, int value )
+{
+    buf[0] = DIGIT_PAIRS[ value * 2 ];
+    buf[1] = DIGIT_PAIRS[ value * 2 + 1 ];
+}
+
+//不用 strftime：它要看 locale，而 HTTP 日期只能是英文的星期和月份
+void format_http_date( char* buf, time_t t )
+{
+    static const char DAYS[] = "SunMonTueWedThuFriSat";
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    memcpy( buf, DAYS + tm.tm_wday * 3, 3 );
+    buf[3] = ',';
+    buf[4] = ' ';
+    put2( buf + 5, tm.tm_mday );
+    buf[7] = ' ';
+    memcpy( buf + 8, MONTHS + tm.tm_mon * 3, 3 );
+    buf[11] = ' ';
+    int year = tm.tm_year + 1900;
+    put2( buf + 12, year / 100 % 100 );
+    put2( buf + 14, year % 100 );
+    buf[16] = ' ';
+    put2( buf + 17, tm.tm_hour );
+    buf[19] = ':';
+    put2( buf + 20, tm.tm_min );
+    buf[22] = ':';
+    put2( buf + 23, tm.tm_sec );
+    memcpy( buf + 25, " GMT", 4 );
+}
+
+const char* cached_date_header()
+{
+    static thread_local time_t cached_second = -1;
+    static thread_local char header[ DATE_HEADER_LEN ];
+    time_t now = time( NULL );
+    if( now != cached_second )
+    {
+        memcpy( header, "Date: ", 6 );
+        format_http_date( header + 6, now );
+        memcpy( header + 6 + HTTP_DATE_LEN, "\r\n", 2 );
+        cached_second = now;
+    }
+    return header;
+}
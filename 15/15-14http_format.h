@@ -0,0 +1,28 @@
+#ifndef HTTP_FORMAT_H
+#define HTTP_FORMAT_H
+
+#include <time.h>
+
+//拼 HTTP 应答用到的几个格式化函数，都不走 printf 一族
+
+//编译期就拼好的一段应答文本，比如状态行
+struct prerendered
+{
+    const char* m_data;
+    int m_len;
+};
+#define PRERENDERED( text ) { text, sizeof( text ) - 1 }
+
+//无符号整数转十进制，不写 '\0'，返回写了几个字节；buf 至少要 20 个字节
+int format_uint( char* buf, unsigned long long value );
+
+//"Sun, 06 Nov 1994 08:49:37 GMT" 这种格式，固定 HTTP_DATE_LEN 个字节，不写 '\0'
+static const int HTTP_DATE_LEN = 29;
+void format_http_date( char* buf, time_t t );
+
+//"Date: <当前时间>\r\n"，固定 DATE_HEADER_LEN 个字节
+//每个线程缓存一份，秒数变了才重新格式化；返回的内容下一秒会被改掉，要拷贝走再用
+static const int DATE_HEADER_LEN = 6 + HTTP_DATE_LEN + 2;
+const char* cached_date_header();
+
+#endif
@@ -0,0 +1,221 @@
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+//离线给 doc_root 下的文本文件生成预压缩副本 file.gz 和 file.br，http_conn 按 Accept-Encoding 直接发副本
+//副本已经存在且不比原文件旧时跳过；压缩后省不到 10% 的不生成，并删掉以前留下的副本
+//先写临时文件再 rename，服务器不会读到写了一半的副本，rename 产生的 inotify 事件会让 file_cache 重新查找副本
+
+//不超过这个大小的文件压缩了也省不出一个包
+static const off_t MIN_SIZE = 256;
+
+static const char* COMPRESSIBLE[] = {
+    ".html", ".htm", ".css", ".js", ".mjs", ".json", ".svg", ".txt", ".xml", ".csv", ".md", ".map", ".wasm",
+};
+
+static bool g_force = false;
+static int g_level = 9;
+static int g_written = 0;
+
+static bool compressible( const char* path )
+{
+    const char* dot = strrchr( path, '.' );
+    if( !dot || strchr( dot, '/' ) )
+    {
+        return false;
+    }
+    for( unsigned int i = 0; i < sizeof( COMPRESSIBLE ) / sizeof( COMPRESSIBLE[0] ); ++i )
+    {
+        if( strcasecmp( dot, COMPRESSIBLE[i] ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_file( const char* path, off_t size, std::vector< unsigned char >* data )
+{
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    data->resize( size );
+    off_t done = 0;
+    while( done < size )
+    {
+        ssize_t n = read( fd, data->data() + done, size - done );
+        if( n <= 0 )
+        {
+            break;
+        }
+        done += n;
+    }
+    close( fd );
+    data->resize( done );
+    return done == size;
+}
+
+static bool gzip( const std::vector< unsigned char >& in, std::vector< unsigned char >* out )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    //窗口 15 位再加 16 表示写 gzip 头和尾，不是 zlib 格式
+    if( deflateInit2( &zs, g_level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK )
+    {
+        return false;
+    }
+    out->resize( deflateBound( &zs, in.size() ) );
+    zs.next_in = const_cast< unsigned char* >( in.data() );
+    zs.avail_in = in.size();
+    zs.next_out = out->data();
+    zs.avail_out = out->size();
+    int ret = deflate( &zs, Z_FINISH );
+    out->resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END;
+}
+
+#ifdef HAVE_BROTLI
+static bool brotli( const std::vector< unsigned char >& in, std::vector< unsigned char >* out )
+{
+    size_t size = BrotliEncoderMaxCompressedSize( in.size() );
+    out->resize( size ? size : 64 );
+    size = out->size();
+    //离线做，质量直接开到最高
+    if( !BrotliEncoderCompress( BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                in.size(), in.data(), &size, out->data() ) )
+    {
+        return false;
+    }
+    out->resize( size );
+    return true;
+}
+#endif
+
+static bool up_to_date( const std::string& sidecar, const struct stat* source )
+{
+    struct stat st;
+    //和 file_cache 一样按纳秒比较
+    return !g_force && stat( sidecar.c_str(), &st ) == 0
+           && ( st.st_mtim.tv_sec > source->st_mtim.tv_sec
+                || ( st.st_mtim.tv_sec == source->st_mtim.tv_sec && st.st_mtim.tv_nsec >= source->st_mtim.tv_nsec ) );
+}
+
+static void write_sidecar( const std::string& sidecar, const std::vector< unsigned char >& data, off_t original )
+{
+    //省不到 10% 的不要，发原文件还能用上 sendfile 和小文件缓存
+    if( ( off_t )data.size() * 10 > original * 9 )
+    {
+        if( unlink( sidecar.c_str() ) == 0 )
+        {
+            printf( "  removed %s, not worth it\n", sidecar.c_str() );
+        }
+        return;
+    }
+    std::string temp = sidecar + ".tmp";
+    int fd = open( temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if( fd < 0 )
+    {
+        perror( temp.c_str() );
+        return;
+    }
+    bool ok = write( fd, data.data(), data.size() ) == ( ssize_t )data.size();
+    ok = ( close( fd ) == 0 ) && ok;
+    if( !ok || rename( temp.c_str(), sidecar.c_str() ) != 0 )
+    {
+        perror( sidecar.c_str() );
+        unlink( temp.c_str() );
+        return;
+    }
+    printf( "  %s %lld -> %zu\n", sidecar.c_str(), ( long long )original, data.size() );
+    g_written++;
+}
+
+static int visit( const char* path, const struct stat* st, int type, struct FTW* )
+{
+    if( type != FTW_F || !S_ISREG( st->st_mode ) || st->st_size < MIN_SIZE || !compressible( path ) )
+    {
+        return 0;
+    }
+    std::string gz = std::string( path ) + ".gz";
+#ifdef HAVE_BROTLI
+    std::string br = std::string( path ) + ".br";
+    bool need_br = !up_to_date( br, st );
+#else
+    bool need_br = false;
+#endif
+    bool need_gz = !up_to_date( gz, st );
+    if( !need_gz && !need_br )
+    {
+        return 0;
+    }
+    std::vector< unsigned char > data;
+    if( !read_file( path, st->st_size, &data ) )
+    {
+        printf( "%s: read failure\n", path );
+        return 0;
+    }
+    printf( "%s\n", path );
+    std::vector< unsigned char > out;
+    if( need_gz && gzip( data, &out ) )
+    {
+        write_sidecar( gz, out, st->st_size );
+    }
+#ifdef HAVE_BROTLI
+    if( need_br && brotli( data, &out ) )
+    {
+        write_sidecar( br, out, st->st_size );
+    }
+#endif
+    return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+    int opt;
+    while( ( opt = getopt( argc, argv, "fl:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'f':
+                g_force = true;
+                break;
+            case 'l':
+                g_level = atoi( optarg );
+                break;
+            default:
+                printf( "usage: %s [-f] [-l gzip_level] doc_root\n", argv[0] );
+                return 1;
+        }
+    }
+    if( argc - optind < 1 )
+    {
+        printf( "usage: %s [-f] [-l gzip_level] doc_root\n", argv[0] );
+        return 1;
+    }
+#ifndef HAVE_BROTLI
+    printf( "built without brotli, only .gz sidecars are generated\n" );
+#endif
+    //不跟符号链接，和服务器看到的是同一批文件
+    if( nftw( argv[optind], visit, 16, FTW_PHYS ) != 0 )
+    {
+        perror( argv[optind] );
+        return 1;
+    }
+    printf( "%d sidecars written\n", g_written );
+    return 0;
+}
@@ -0,0 +1,259 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include <atomic>
+#include <type_traits>
+#include "14-2locker.h"
+
+//连接对象和收发缓冲区的内存池，代替按 fd 上限预先分配的大数组：
+//连接状态在 accept 时从 slab_pool 取，确认关闭后还回去；读写缓冲区只在有请求要处理时从 buffer_pool 取，空闲了就还，
+//常驻内存跟着同时在处理的请求数走，而不是跟着 fd 上限走
+
+//固定大小对象的池：一次向系统要一整块（slab）切成 SLAB_OBJECTS 个槽，空槽串成链表
+//对象在 alloc 时默认构造、free 时析构；slab 不还给系统，连接数回落以后空槽留给下一波连接
+template< typename T, int SLAB_OBJECTS = 64 >
+class slab_pool
+{
+public:
+    slab_pool() : m_free( NULL ), m_in_use( 0 ), m_capacity( 0 ) {}
+    ~slab_pool()
+    {
+        for( size_t i = 0; i < m_slabs.size(); ++i )
+        {
+            delete[] m_slabs[i];
+        }
+    }
+
+    //内存不够时抛 std::bad_alloc
+    T* alloc()
+    {
+        m_locker.lock();
+        while( !m_free )
+        {
+            //向系统要内存时不拿着锁，抛异常也不会把锁带走
+            m_locker.unlock();
+            node* slab = new node[ SLAB_OBJECTS ];
+            m_locker.lock();
+            for( int i = 0; i < SLAB_OBJECTS; ++i )
+            {
+                slab[i].m_next = i + 1 < SLAB_OBJECTS ? slab + i + 1 : m_free;
+            }
+            m_free = slab;
+            m_slabs.push_back( slab );
+            m_capacity += SLAB_OBJECTS;
+        }
+        node* n = m_free;
+        m_free = n->m_next;
+        m_in_use++;
+        m_locker.unlock();
+        return new( &n->m_storage ) T;
+    }
+
+    void free( T* obj )
+    {
+        obj->~T();
+        node* n = reinterpret_cast< node* >( obj );
+        m_locker.lock();
+        n->m_next = m_free;
+        m_free = n;
+        m_in_use--;
+        m_locker.unlock();
+    }
+
+    int in_use() const { return m_in_use; }
+    int capacity() const { return m_capacity; }
+
+private:
+    union node
+    {
+        node* m_next;
+        typename std::aligned_storage< sizeof( T ), alignof( T ) >::type m_storage;
+    };
+
+    locker m_locker;
+    node* m_free;
+    std::vector< node* > m_slabs;
+    std::atomic< int > m_in_use;
+    std::atomic< int > m_capacity;
+};
+
+//按 2 的幂分级的缓冲区池，从 1KB 到 64KB；每级一个空闲链表、一把锁，不同大小的缓冲区互不争锁
+//要的大小向上取到所在的级别，还的时候给出同样的大小；小的级别一次要 CHUNK_SIZE 切开用，内存不还给系统
+class buffer_pool
+{
+public:
+    static const int MIN_SHIFT = 10;
+    static const int CLASS_COUNT = 7;
+    static const int MAX_SIZE = 1 << ( MIN_SHIFT + CLASS_COUNT - 1 );
+    static const int CHUNK_SIZE = MAX_SIZE;
+
+    static buffer_pool* instance()
+    {
+        static buffer_pool pool;
+        return &pool;
+    }
+
+    ~buffer_pool()
+    {
+        for( size_t i = 0; i < m_chunks.size(); ++i )
+        {
+            delete[] m_chunks[i];
+        }
+    }
+
+    //size 不能超过 MAX_SIZE；内存不够时抛 std::bad_alloc
+    char* get( int size )
+    {
+        int c = size_class( size );
+        free_list& list = m_lists[c];
+        list.m_locker.lock();
+        if( !list.m_head )
+        {
+            list.m_locker.unlock();
+            char* chunk = new char[ CHUNK_SIZE ];
+            int block_size = 1 << ( MIN_SHIFT + c );
+            list.m_locker.lock();
+            for( int offset = 0; offset < CHUNK_SIZE; offset += block_size )
+            {
+                block* b = reinterpret_cast< block* >( chunk + offset );
+                b->m_next = list.m_head;
+                list.m_head = b;
+            }
+            m_chunks_locker.lock();
+            m_chunks.push_back( chunk );
+            m_chunks_locker.unlock();
+            m_reserved += CHUNK_SIZE;
+        }
+        block* b = list.m_head;
+        list.m_head = b->m_next;
+        list.m_locker.unlock();
+        m_in_use += 1 << ( MIN_SHIFT + c );
+        return reinterpret_cast< char* >( b );
+    }
+
+    void put( char* buf, int size )
+    {
+        int c = size_class( size );
+        free_list& list = m_lists[c];
+        block* b = reinterpret_cast< block* >( buf );
+        list.m_locker.lock();
+        b->m_next = list.m_head;
+        list.m_head = b;
+        list.m_locker.unlock();
+        m_in_use -= 1 << ( MIN_SHIFT + c );
+    }
+
+    //借出去的和向系统要的总字节数
+    long in_use() const { return m_in_use; }
+    long reserved() const { return m_reserved; }
+
+private:
+    buffer_pool() : m_in_use( 0 ), m_reserved( 0 ) {}
+
+    static int size_class( int size )
+    {
+        int c = 0;
+        while( ( 1 << ( MIN_SHIFT + c ) ) < size )
+        {
+            ++c;
+        }
+        return c;
+    }
+
+    struct block
+    {
+        block* m_next;
+    };
+    struct free_list
+    {
+        free_list() : m_head( NULL ) {}
+        locker m_locker;
+        block* m_head;
+    };
+
+    free_list m_lists[ CLASS_COUNT ];
+    locker m_chunks_locker;
+    std::vector< char* > m_chunks;
+    std::atomic< long > m_in_use;
+    std::atomic< long > m_reserved;
+};
+
+//按 fd 找对象的表，两级：第一级固定 MAX_CHUNKS 个指针，第二级每块 CHUNK 个槽，用到哪块才分配哪块
+//fd 可以超过 65536，一直到 MAX_FDS（Linux 默认的 nr_open）；块分配以后不再释放，查表不加锁
+//多个 reactor 线程共用一张表：fd 在进程内唯一，一个槽同一时刻只有一个线程在用；
+//fd 刚关掉就被别的线程 accept 重用时，新对象已经占了槽，clear 只在槽里还是自己那个对象时才清
+template< typename T >
+class fd_table
+{
+public:
+    static const int CHUNK_SHIFT = 12;
+    static const int CHUNK = 1 << CHUNK_SHIFT;
+    static const int MAX_FDS = 1 << 20;
+    static const int MAX_CHUNKS = MAX_FDS / CHUNK;
+
+    fd_table()
+    {
+        for( int i = 0; i < MAX_CHUNKS; ++i )
+        {
+            m_chunks[i] = NULL;
+        }
+    }
+    ~fd_table()
+    {
+        for( int i = 0; i < MAX_CHUNKS; ++i )
+        {
+            delete[] m_chunks[i].load();
+        }
+    }
+
+    T* get( int fd ) const
+    {
+        if( fd < 0 || fd >= MAX_FDS )
+        {
+            return NULL;
+        }
+        slot* chunk = m_chunks[ fd >> CHUNK_SHIFT ].load( std::memory_order_acquire );
+        return chunk ? chunk[ fd & ( CHUNK - 1 ) ].load( std::memory_order_acquire ) : NULL;
+    }
+
+    //把 fd 的槽换成 obj，返回槽里原来的对象；fd 必须小于 MAX_FDS，内存不够时抛 std::bad_alloc
+    T* exchange( int fd, T* obj )
+    {
+        std::atomic< slot* >& entry = m_chunks[ fd >> CHUNK_SHIFT ];
+        slot* chunk = entry.load( std::memory_order_acquire );
+        if( !chunk )
+        {
+            //两个线程同时分配同一块时，装不上的那个把自己的删掉用别人的
+            slot* fresh = new slot[ CHUNK ]();
+            if( entry.compare_exchange_strong( chunk, fresh, std::memory_order_acq_rel ) )
+            {
+                chunk = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+        return chunk[ fd & ( CHUNK - 1 ) ].exchange( obj, std::memory_order_acq_rel );
+    }
+
+    //槽里还是 obj 时清空，返回是否清了
+    bool clear( int fd, T* obj )
+    {
+        if( fd < 0 || fd >= MAX_FDS )
+        {
+            return false;
+        }
+        slot* chunk = m_chunks[ fd >> CHUNK_SHIFT ].load( std::memory_order_acquire );
+        return chunk && chunk[ fd & ( CHUNK - 1 ) ].compare_exchange_strong( obj, NULL, std::memory_order_acq_rel );
+    }
+
+private:
+    typedef std::atomic< T* > slot;
+    std::atomic< slot* > m_chunks[ MAX_CHUNKS ];
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "15-17body_sink.h"
+
+//中转管道一次最多搬这么多，不超过管道的默认容量，写文件那一头总能一次清空
+static const size_t PIPE_CHUNK = 64 * 1024;
+
+discard_sink* discard_sink::instance()
+{
+    static discard_sink sink;
+    return &sink;
+}
+
+fd_sink::fd_sink( int fd ) : m_fd( fd )
+{
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+fd_sink::~fd_sink()
+{
+    if( m_fd >= 0 )
+    {
+        close( m_fd );
+    }
+    if( m_pipe[0] >= 0 )
+    {
+        close( m_pipe[0] );
+        close( m_pipe[1] );
+    }
+}
+
+bool fd_sink::on_data( const char* data, int len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = write( m_fd, data, len );
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+ssize_t fd_sink::splice_from( int sockfd, size_t len )
+{
+    if( m_pipe[0] < 0 && pipe2( m_pipe, O_NONBLOCK | O_CLOEXEC ) != 0 )
+    {
+        return -1;
+    }
+    if( len > PIPE_CHUNK )
+    {
+        len = PIPE_CHUNK;
+    }
+    ssize_t moved = splice( sockfd, NULL, m_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    //搬进管道的全部写进文件再返回，管道每次都是空的，EAGAIN 只可能是 socket 没数据了
+    for( ssize_t left = moved; left > 0; )
+    {
+        ssize_t n = splice( m_pipe[0], NULL, m_fd, NULL, left, SPLICE_F_MOVE );
+        if( n <= 0 )
+        {
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            if( n == 0 )
+            {
+                errno = EIO;
+            }
+            return -1;
+        }
+        left -= n;
+    }
+    return moved;
+}
+
+bool fd_sink::on_end()
+{
+    int fd = m_fd;
+    m_fd = -1;
+    return close( fd ) == 0;
+}
+
+upload_sink::upload_sink( int fd, const std::string& path, const std::string& temp )
+    : fd_sink( fd ), m_path( path ), m_temp( temp ), m_committed( false )
+{
+}
+
+upload_sink* upload_sink::create( const char* path, bool* existed )
+{
+    struct stat st;
+    *existed = stat( path, &st ) == 0;
+    if( *existed && !S_ISREG( st.st_mode ) )
+    {
+        errno = EISDIR;
+        return NULL;
+    }
+    //临时文件和目标在同一个目录里，rename 才是原子的
+    std::string temp = std::string( path ) + ".XXXXXX";
+    int fd = mkostemp( &temp[0], O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+    fchmod( fd, 0644 );
+    return new upload_sink( fd, path, temp );
+}
+
+upload_sink::~upload_sink()
+{
+    if( !m_committed )
+    {
+        unlink( m_temp.c_str() );
+    }
+}
+
+bool upload_sink::on_end()
+{
+    if( !fd_sink::on_end() || rename( m_temp.c_str(), m_path.c_str() ) != 0 )
+    {
+        return false;
+    }
+    m_committed = true;
+    return true;
+}
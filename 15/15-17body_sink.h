@@ -0,0 +1,65 @@
+#ifndef BODY_SINK_H
+#define BODY_SINK_H
+
+#include <sys/types.h>
+#include <string>
+
+//请求体的去处。http_conn 边收边交：读缓冲区里的数据一片一片交给 on_data，
+//能 splice 的去处（文件）在读缓冲区空了以后直接从 socket 搬，所以请求体多大都只占一个读缓冲区
+class body_sink
+{
+public:
+    virtual ~body_sink() {}
+    //交一片请求体，data 在读缓冲区里，返回以后就会被覆盖；返回 false 表示出错
+    virtual bool on_data( const char* data, int len ) = 0;
+    //能不能用 splice_from
+    virtual bool can_splice() const { return false; }
+    //从非阻塞的 sockfd 直接搬最多 len 字节过来，返回值和 splice 一样：0 是对方关了，-1 看 errno，EAGAIN 是暂时没数据
+    virtual ssize_t splice_from( int /* sockfd */, size_t /* len */ ) { return -1; }
+    //请求体收完了；返回 false 表示出错
+    virtual bool on_end() { return true; }
+};
+
+//不要的请求体（比如 GET 带的、出错的请求带的）收下就扔，连接还能接着用
+class discard_sink : public body_sink
+{
+public:
+    static discard_sink* instance();
+    bool on_data( const char* /* data */, int /* len */ ) { return true; }
+};
+
+//写到一个文件里，fd 归 fd_sink 所有
+//splice 两头必须有一头是管道，文件要经过一个自己的管道中转
+class fd_sink : public body_sink
+{
+public:
+    explicit fd_sink( int fd );
+    ~fd_sink();
+    bool on_data( const char* data, int len );
+    bool can_splice() const { return true; }
+    ssize_t splice_from( int sockfd, size_t len );
+    bool on_end();
+
+protected:
+    int m_fd;
+    //文件中转用的管道，第一次 splice 时才建
+    int m_pipe[2];
+};
+
+//PUT 上传：先写 path.XXXXXX 临时文件，收完再 rename 成 path，中途断开的上传不会留下半个文件
+class upload_sink : public fd_sink
+{
+public:
+    //打不开临时文件时返回 NULL，原因在 errno 里；existed 告诉调用者 path 原来有没有
+    static upload_sink* create( const char* path, bool* existed );
+    ~upload_sink();
+    bool on_end();
+
+private:
+    upload_sink( int fd, const std::string& path, const std::string& temp );
+    std::string m_path;
+    std::string m_temp;
+    bool m_committed;
+};
+
+#endif
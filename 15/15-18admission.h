@@ -0,0 +1,96 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <climits>
+
+//线程池前面的准入控制，按 CoDel 的思路：不看队列有多长，看请求在队列里等了多久
+//工作线程取到任务时报一次排队时间，每过一个 interval 看这段时间里最短的排队时间：
+//最短的都超过 target，说明队列这一整段时间都没排空过，是积压不是突发，接下来一个 interval 里的新请求直接拒掉；
+//队列一排空马上恢复。突发进来的请求排队时间有长有短，最短的不会超过 target，不会被误拒
+//admit/enqueue/queue_full 只能由一个线程调用（线程池模式下的主线程），dequeued 在工作线程里调用
+class codel_admission
+{
+public:
+    codel_admission() : m_target( 20000 ), m_interval( 200000 ), m_window_end( 0 ), m_queued_at_window_start( 0 ),
+            m_overloaded( false ), m_min_sojourn( LLONG_MAX ), m_queued( 0 ), m_admitted( 0 ), m_shed_delay( 0 ),
+            m_shed_full( 0 ) {}
+
+    //单位微秒；target 为 0 时不按排队时间拒，只有队列满了才拒
+    void configure( long long target_us, long long interval_us )
+    {
+        m_target = target_us;
+        m_interval = interval_us > 0 ? interval_us : 1;
+    }
+
+    //连接上来了一个新请求，返回 false 表示要拒掉；返回 true 时算进了队列，之后要有一次 dequeued 或者 queue_full
+    bool admit( long long now_us )
+    {
+        if( now_us >= m_window_end )
+        {
+            roll( now_us );
+        }
+        if( m_queued == 0 )
+        {
+            m_overloaded = false;
+        }
+        if( m_overloaded )
+        {
+            m_shed_delay++;
+            return false;
+        }
+        m_admitted++;
+        enqueue();
+        return true;
+    }
+
+    //读了一半的请求接着处理，不管过不过载都要进队列
+    void enqueue() { m_queued++; }
+
+    //算进了队列的任务没能放进线程池
+    void queue_full()
+    {
+        m_queued--;
+        m_shed_full++;
+    }
+
+    //工作线程取到任务，sojourn_us 是它在队列里等的时间
+    void dequeued( long long sojourn_us )
+    {
+        m_queued--;
+        long long min = m_min_sojourn.load( std::memory_order_relaxed );
+        while( sojourn_us < min && !m_min_sojourn.compare_exchange_weak( min, sojourn_us, std::memory_order_relaxed ) )
+        {
+        }
+    }
+
+    bool overloaded() const { return m_overloaded; }
+    long admitted() const { return m_admitted; }
+    long shed_delay() const { return m_shed_delay; }
+    long shed_full() const { return m_shed_full; }
+
+private:
+    //一个 interval 到了，按这段时间里最短的排队时间决定下一段过不过载
+    void roll( long long now_us )
+    {
+        long long min = m_min_sojourn.exchange( LLONG_MAX );
+        //一整段时间一个任务都没取走，开始时却就有任务在等：工作线程全卡住了，等的时间已经超过 interval
+        bool stalled = min == LLONG_MAX && m_queued_at_window_start > 0;
+        m_overloaded = m_target > 0 && ( stalled || ( min != LLONG_MAX && min > m_target ) );
+        m_queued_at_window_start = m_queued;
+        m_window_end = now_us + m_interval;
+    }
+
+    long long m_target;
+    long long m_interval;
+    long long m_window_end;
+    int m_queued_at_window_start;
+    bool m_overloaded;
+    std::atomic< long long > m_min_sojourn;
+    std::atomic< int > m_queued;
+    std::atomic< long > m_admitted;
+    std::atomic< long > m_shed_delay;
+    std::atomic< long > m_shed_full;
+};
+
+#endif
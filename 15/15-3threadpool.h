@@ -1,37 +1,86 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
-#include "14-2locker.h"
+#include <atomic>
+#include "15-7mpmc_queue.h"
 
+//默认的取任务策略：所有工作线程共用一个有界无锁队列
 template< typename T >
+class shared_queue
+{
+public:
+    shared_queue( int /* thread_number */, int max_requests ) : m_workqueue( max_requests ) {}
+    //第二个参数是任务想去的工作线程，共用队列时用不上
+    bool submit( T* request, int /* hint */ ) { return m_workqueue.push( request ); }
+    bool push_local( int /* idx */, T* request ) { return m_workqueue.push( request ); }
+    T* take( int /* idx */ )
+    {
+        T* request = NULL;
+        return m_workqueue.pop( request ) ? request : NULL;
+    }
+
+private:
+    //有界无锁队列，append 不加锁也不分配内存
+    mpmc_queue< T* > m_workqueue;
+};
+
+//P 是任务队列策略，见上面的 shared_queue 和 15-9work_stealing.h 里的 work_stealing
+template< typename T, template< typename > class P = shared_queue >
 class threadpool
 {
 public:
     threadpool( int thread_number = 8, int max_requests = 10000 );
+    //等所有工作线程退出才返回，没处理的任务直接丢掉；不能在工作线程里调用
     ~threadpool();
+    //工作线程里调用时任务放进自己的队列，其他线程调用时由策略分派
+    //排着的任务已经有 max_requests 个时返回 false（队列的容量会向上取到 2 的幂，上限按 max_requests 算）
     bool append( T* request );
+    //同一个 key 总是投给同一个工作线程（策略支持时）
+    bool append( T* request, unsigned int key );
 
 private:
+    struct worker_arg
+    {
+        threadpool* m_pool;
+        int m_idx;
+    };
     static void* worker( void* arg );
-    void run();
+    void run( int idx );
+    //排队计数，超过 m_max_requests 时返回 false
+    bool reserve();
+    //让前 count 个工作线程退出并等它们结束
+    void stop_workers( int count );
 
 private:
+    //取不到任务时先自旋这么多次，再去 futex 上睡
+    static const int SPIN_COUNT = 64;
     int m_thread_number;
     int m_max_requests;
     pthread_t* m_threads;
-    std::list< T* > m_workqueue;
-    locker m_queuelocker;
-    sem m_queuestat;
-    bool m_stop;
+    worker_arg* m_args;
+    P< T > m_queue;
+    futex_parker m_parker;
+    //已经 append 还没被取走的任务数
+    std::atomic< int > m_queued;
+    std::atomic< bool > m_stop;
+    //当前线程所属的线程池和编号，不是工作线程时为 NULL
+    static thread_local threadpool* t_pool;
+    static thread_local int t_idx;
 };
 
-template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+template< typename T, template< typename > class P >
+thread_local threadpool< T, P >* threadpool< T, P >::t_pool = NULL;
+template< typename T, template< typename > class P >
+thread_local int threadpool< T, P >::t_idx = -1;
+
+template< typename T, template< typename > class P >
+threadpool< T, P >::threadpool( int thread_number, int max_requests ) :
+        m_thread_number( thread_number ), m_max_requests( max_requests ), m_threads( NULL ), m_args( NULL ),
+        m_queue( thread_number > 0 ? thread_number : 1, max_requests > 0 ? max_requests : 1 ), m_queued( 0 ),
+        m_stop( false )
 {
     if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
     {
@@ -39,77 +88,129 @@ threadpool< T >::threadpool( int thread_number, int max_requests ) :
     }
 
     m_threads = new pthread_t[ m_thread_number ];
-    if( ! m_threads )
-    {
-        throw std::exception();
-    }
+    m_args = new worker_arg[ m_thread_number ];
 
+    //工作线程不再 detach，析构时要等它们都不再碰 m_queue 和 m_parker
     for ( int i = 0; i < thread_number; ++i )
     {
         printf( "create the %dth thread\n", i );
-        if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
-        {
-            delete [] m_threads;
-            throw std::exception();
-        }
-        if( pthread_detach( m_threads[i] ) )
+        m_args[i].m_pool = this;
+        m_args[i].m_idx = i;
+        if( pthread_create( m_threads + i, NULL, worker, m_args + i ) != 0 )
         {
-            delete [] m_threads;
+            stop_workers( i );
             throw std::exception();
         }
     }
 }
 
-template< typename T >
-threadpool< T >::~threadpool()
+template< typename T, template< typename > class P >
+threadpool< T, P >::~threadpool()
+{
+    stop_workers( m_thread_number );
+}
+
+template< typename T, template< typename > class P >
+void threadpool< T, P >::stop_workers( int count )
 {
-    delete [] m_threads;
     m_stop = true;
+    m_parker.notify_all();
+    for ( int i = 0; i < count; ++i )
+    {
+        pthread_join( m_threads[i], NULL );
+    }
+    delete [] m_threads;
+    delete [] m_args;
+    m_threads = NULL;
+    m_args = NULL;
 }
 
-template< typename T >
-bool threadpool< T >::append( T* request )
+template< typename T, template< typename > class P >
+bool threadpool< T, P >::reserve()
 {
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests )
+    if ( m_queued.fetch_add( 1, std::memory_order_relaxed ) >= m_max_requests )
     {
-        m_queuelocker.unlock();
+        m_queued.fetch_sub( 1, std::memory_order_relaxed );
         return false;
     }
-    m_workqueue.push_back( request );
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    return true;
+}
+
+template< typename T, template< typename > class P >
+bool threadpool< T, P >::append( T* request )
+{
+    if ( ! reserve() )
+    {
+        return false;
+    }
+    bool ret = ( t_pool == this ) ? m_queue.push_local( t_idx, request ) : m_queue.submit( request, -1 );
+    if ( ! ret )
+    {
+        m_queued.fetch_sub( 1, std::memory_order_relaxed );
+        return false;
+    }
+    m_parker.notify_one();
+    return true;
+}
+
+template< typename T, template< typename > class P >
+bool threadpool< T, P >::append( T* request, unsigned int key )
+{
+    if ( ! reserve() )
+    {
+        return false;
+    }
+    if ( ! m_queue.submit( request, key % m_thread_number ) )
+    {
+        m_queued.fetch_sub( 1, std::memory_order_relaxed );
+        return false;
+    }
+    m_parker.notify_one();
     return true;
 }
 //一个worker就是一个线程
-template< typename T >
-void* threadpool< T >::worker( void* arg )
+template< typename T, template< typename > class P >
+void* threadpool< T, P >::worker( void* arg )
 {
-    threadpool* pool = ( threadpool* )arg;
-    pool->run();
+    worker_arg* warg = ( worker_arg* )arg;
+    threadpool* pool = warg->m_pool;
+    t_pool = pool;
+    t_idx = warg->m_idx;
+    pool->run( warg->m_idx );
     return pool;
 }
 //每个线程调用此函数，从队列里取任务
-template< typename T >
-void threadpool< T >::run()
+template< typename T, template< typename > class P >
+void threadpool< T, P >::run( int idx )
 {
+    int idle = 0;
     while ( ! m_stop )
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if ( m_workqueue.empty() )
-        {
-            m_queuelocker.unlock();
-            continue;
-        }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        T* request = m_queue.take( idx );
         if ( ! request )
         {
-            continue;
+            if ( ++idle < SPIN_COUNT )
+            {
+                continue;
+            }
+            //登记要睡之后再看一次队列，避免和 append 错过；m_stop 也要再看一次，避免和析构错过
+            int seq = m_parker.prepare();
+            if ( m_stop )
+            {
+                m_parker.cancel();
+                break;
+            }
+            request = m_queue.take( idx );
+            if ( ! request )
+            {
+                m_parker.wait( seq );
+                idle = 0;
+                continue;
+            }
+            m_parker.cancel();
         }
-        printf("thread id is %d\n", pthread_self());
+        idle = 0;
+        m_queued.fetch_sub( 1, std::memory_order_relaxed );
         request->process();
     }
 }
@@ -19,7 +19,15 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
-#include "14-2locker.h"
+#include <sys/sendfile.h>
+#include <ctype.h>
+#include <time.h>
+#include <atomic>
+#include "15-10file_cache.h"
+#include "15-13header_hash.h"
+#include "15-14http_format.h"
+#include "15-16slab_pool.h"
+#include "15-17body_sink.h"
 
 class http_conn{
 public:
@@ -28,15 +36,34 @@ public:
     // 读缓冲区的大小
     static const int READ_BUFFER_SIZE = 2048;
     // 写缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;
-    // HTTP请求方法，仅支持GET
+    static const int WRITE_BUFFER_SIZE = 2048;
+    // 写缓冲区剩下不到这么多时不再解析下一个流水线请求，等前面的应答发完
+    static const int RESPONSE_RESERVE = 512;
+    // 一批最多排队多少个流水线请求的应答
+    static const int MAX_PIPELINE = 16;
+    // 一个Range请求最多接受的区间数，再多就当没有Range，整个文件发回去
+    static const int MAX_RANGES = 8;
+    // 一个响应最多由几段组成：头部，每个区间的分段头和文件内容，结尾的分隔符
+    static const int MAX_RESPONSE_SEGMENTS = 2 * MAX_RANGES + 2;
+    // 一批应答最多由几段组成，普通应答两段（头部和文件内容）
+    static const int MAX_SEGMENTS = 2 * MAX_PIPELINE + MAX_RESPONSE_SEGMENTS;
+    // 请求体一次直接splice最多这么多字节
+    static const int SPLICE_CHUNK = 64 * 1024;
+    // HTTP请求方法，支持GET，配置了上传目录时支持PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE,
         TRACE, OPTIONS, CONNECT, PATCH};
     // 解析客户请求时，主状态机所处的状态
     enum CHECK_STATE {
         CHECK_STATE_REQUESTLINE = 0,    // 当前正在分析请求行
         CHECK_STATE_HEADER,             // 当前正在分析头部字段
-        CHECK_STATE_CONTENT
+        CHECK_STATE_CONTENT             // 当前正在收消息体
+    };
+    // 分块编码的消息体收到了哪一步
+    enum CHUNK_STATE {
+        CHUNK_SIZE = 0,         // 等一块的长度行
+        CHUNK_DATA,             // 收一块的数据
+        CHUNK_DATA_END,         // 等一块数据后面的\r\n
+        CHUNK_TRAILER           // 长度为0的最后一块之后，等尾部头部和结束的空行
     };
     // 从状态机的三种可能状态，即行的读取状态
     enum LINE_STATUS {
@@ -52,29 +79,58 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,      // 客户对资源没有足够的访问权限
         FILE_REQUEST,
+        NOT_MODIFIED,           // 条件请求的校验值和文件一致，回304不带内容
+        RANGE_NOT_SATISFIABLE,  // Range里的区间全都在文件外面
+        UPLOAD_CREATED,         // PUT上传了一个新文件
+        UPLOAD_REPLACED,        // PUT替换了已有的文件
+        PAYLOAD_TOO_LARGE,      // 消息体超过m_max_body
         INTERNAL_ERROR,         // 服务器内部错误
         CLOSE_CONNECTION        // 客户端已经关闭连接
     };
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    // 缓冲区都是用到时才从buffer_pool取的，刚构造出来什么都不占
+    http_conn() : m_sockfd(-1), m_read_buf(NULL), m_read_idx(0), m_write_buf(NULL), m_sink(NULL), m_file(NULL),
+        m_file_count(0), m_segments(NULL), m_segment_count(0) {}
+    ~http_conn(){ m_read_idx = 0; m_segment_count = 0; release_idle_buffers(); release_sink(); }
 
 public:
-    // 初始化新接受的连接
-    void init(int sockfd, const sockaddr_in& addr);
+    // 初始化新接受的连接，注册到接受它的那个epoll上；sockfd要已经是非阻塞的
+    // one_shot为true时用EPOLLONESHOT，每次事件以后由处理它的线程rearm
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, bool one_shot = false);
     // 关闭连接
     void close_conn(bool real_close = true);
-    // 处理客户请求
-    void process();
+    // 线程池过载时由主线程调用：回503然后关闭连接
+    void reject_overloaded();
+    // 处理客户请求，in_loop为true时由连接所属的reactor线程直接调用，处理完当场写回；否则由工作线程调用，应答交给主线程写
+    void process(bool in_loop = false);
     // 非阻塞读操作
     bool read();
     // 非阻塞写操作
     bool write();
+    // 给超时管理用的状态：连接已经关了；读缓冲区里有读了一半的请求；还有应答没发完
+    bool closed() const { return m_sockfd == -1; }
+    // 收消息体时不算：消息体可能很大，用每次有进展就续期的空闲超时
+    bool partial_request() const { return m_check_state != CHECK_STATE_CONTENT && m_read_idx > m_request_start; }
+    bool sending() const { return m_segment_count > 0; }
+    // 两个请求之间：没有解析到一半的请求，没在收消息体，也没有应答要发。准入控制只拒这时候来的新请求
+    bool between_requests() const { return m_check_state != CHECK_STATE_CONTENT && m_checked_idx == m_request_start && m_segment_count == 0; }
+    // 线程池模式下一批应答发完了，读缓冲区里还有没处理的请求或者socket里还有没读的数据，要由主线程重新交给线程池
+    bool needs_processing() const { return m_segment_count == 0 && (m_read_blocked || m_unprocessed); }
 
 private:
     // 初始化连接
     void init();
+    // 把fd重新挂回epoll，等ev事件
+    void rearm(int ev);
+    // 一个请求处理完，清掉请求相关的状态，准备解析下一个
+    void init_request();
+    // 把读缓冲区里所有完整的请求解析完，应答按顺序排进发送队列
+    bool process_requests();
+    // process_requests，读缓冲区满过的话腾出地方以后接着读socket，直到读空或者排出了应答
+    bool process_buffered();
+    // 把已经处理完的请求从读缓冲区里挪掉
+    void compact_read_buf();
     // 解析HTTP请求
     HTTP_CODE process_read();
     // 填充HTTP应答
@@ -83,41 +139,91 @@ private:
     // 被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line(char* text);
     HTTP_CODE parse_headers(char* text);
-    HTTP_CODE parse_content(char* text);
+    // 认识的头部各自的处理函数，value是去掉前导空白的值
+    void on_connection(char* value);
+    void on_content_length(char* value);
+    void on_host(char* value);
+    void on_range(char* value);
+    void on_if_range(char* value);
+    void on_if_none_match(char* value);
+    void on_if_modified_since(char* value);
+    void on_accept_encoding(char* value);
+    void on_transfer_encoding(char* value);
+    // 头部收完：分派请求，有消息体时准备边收边交给m_sink
+    HTTP_CODE begin_body();
+    HTTP_CODE begin_upload();
+    HTTP_CODE parse_content();
+    HTTP_CODE parse_chunk_line(char* text);
+    HTTP_CODE finish_body(HTTP_CODE ret);
+    void release_sink();
     HTTP_CODE do_request();
+    HTTP_CODE parse_range();
+    bool if_range_matches();
+    bool not_modified();
+    void negotiate_encoding();
     char* get_line() { return m_read_buf+m_start_line; }
     LINE_STATUS parse_line();
+    char* find_in_line(char* text, char a, char b);
 
     // 被process_write调用以填充HTTP应答
-    void unmap();
-    bool add_response(const char* format, ... );
+    void release_files();
+    // 一批应答开始排队前取写缓冲区和发送队列；连接空闲时把缓冲区还给buffer_pool
+    void acquire_send_buffer();
+    void release_idle_buffers();
+    bool add_bytes(const char* data, int len);
+    template<int N>
+    bool add_literal(const char (&text)[N]) { return add_bytes(text, N - 1); }
+    bool add_number(long long value);
     bool add_content(const char* content);
-    bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_status_line(const prerendered& status);
+    bool add_headers(off_t content_length);
+    bool add_content_length(off_t content_length);
+    bool add_date();
+    bool add_byte_range(off_t first, off_t last, off_t size);
+    bool add_validators();
+    bool add_file_headers();
+    bool add_vary();
+    bool add_ranges();
+    bool add_canned(HTTP_CODE ret);
+    void add_segment(const char* base, off_t offset, off_t end);
+    void add_file_segment(off_t offset, off_t end);
     bool add_linger();
     bool add_blank_line();
 
 public:
-    // 所有socket上的事件都被注册到同一个epoll内核事件中
-    static int m_epollfd;
-    // 统计用户数量
-    static int m_user_count;
+    // 统计用户数量，多个reactor线程同时增减
+    static std::atomic<int> m_user_count;
+    // 回了404的请求数，打在运行统计里
+    static std::atomic<long> m_not_found;
+    // PUT上传的根目录，为空时不接受PUT
+    static const char* m_upload_root;
+    // 消息体的上限，Content-Length超过的直接回413，分块编码的收到超过时回413并关闭连接
+    static long long m_max_body;
 
 private:
+    // 连接所属的epoll，多reactor时每个线程一个
+    int m_epollfd;
     // 该HTTP连接的socket和对方的socket地址
     int m_sockfd;
+    // 注册时用了EPOLLONESHOT，线程池模式下才用
+    bool m_one_shot;
     sockaddr_in m_address;
-    // 读缓冲区
-    char m_read_buf[READ_BUFFER_SIZE];
+    // 读缓冲区，第一次读数据时才从buffer_pool取，读进来的请求都处理完就还回去
+    char* m_read_buf;
     // 标识都缓冲住已经读入客户端数据的最后一个字节的下一个位置
     int m_read_idx;
     // 当前正在分析的字符在都缓冲区的位置
     int m_checked_idx;
     // 当前正在解析的行的起始位置
     int m_start_line;
-    // 写缓冲区
-    char m_write_buf[WRITE_BUFFER_SIZE];
+    // 当前请求的起始位置，前面的都是已经处理完的请求
+    int m_request_start;
+    // 读缓冲区满了但还有应答没发完，先不读，发完再接着读
+    bool m_read_blocked;
+    // 发送队列满了停下来时，读缓冲区里还有没解析过的请求，发完再接着处理
+    bool m_unprocessed;
+    // 写缓冲区，和发送队列在buffer_pool的同一块里，排应答时才取，一批应答发完就还回去
+    char* m_write_buf;
     // 写缓冲区中待发送的字节数
     int m_write_idx;
 
@@ -126,29 +232,71 @@ private:
     // 请求方法
     METHOD m_method;
 
-    // 客户请求的目标文件的完整路径
-    char m_real_file[FILENAME_LEN];
     // 客户请求的目标文件的文件名
     char* m_url;
     // HTTP协议版本号，仅支持HTTP/1.1
     char* m_version;
     // 主机名
     char* m_host;
-    // HTTP请求的消息体长度
-    int m_content_length;
+    // Range和If-Range头部的值，没有时为0
+    char* m_range;
+    char* m_if_range;
+    // If-None-Match和If-Modified-Since头部的值，没有时为0
+    char* m_if_none_match;
+    char* m_if_modified_since;
+    // Accept-Encoding头部的值，没有时为0
+    char* m_accept_encoding;
+    // 发的是哪种预压缩副本（SIDECAR_BR等），发原文件时为-1
+    int m_encoding;
+    // 这个应答是按Accept-Encoding选出来的，要带Vary
+    bool m_vary;
+    // HTTP请求的消息体长度，格式不对时为-1
+    long long m_content_length;
+    // Transfer-Encoding是chunked；是别的编码时m_bad_framing为true，不认识的编码没法确定消息体在哪结束
+    bool m_chunked;
+    bool m_bad_framing;
+    // 消息体当前这一段还剩多少字节：Content-Length的剩余，或者分块编码里当前这一块的剩余
+    long long m_body_left;
+    // 分块编码已经收了多少字节，和m_max_body比
+    long long m_body_size;
+    CHUNK_STATE m_chunk_state;
+    // 消息体交给谁，收完以后回什么应答
+    body_sink* m_sink;
+    HTTP_CODE m_body_ret;
     // HTTP请求是否保持连接
     bool m_linger;
 
-    // 客户请求的目标文件被mmap到内存中的起始位置
-    char* m_file_address;
+    // 当前请求从file_cache取到的目标文件
+    file_entry* m_file;
+    // 排队中的应答用到的文件，整批发完后归还
+    file_entry* m_files[MAX_PIPELINE];
+    int m_file_count;
     // 目标文件的状态
     struct stat m_file_stat;
-    // 采用writev执行写操作
-    struct iovec m_iv[2];
-    // 被写内存块的数量
-    int m_iv_count;
-    //保证同一时刻只有一个线程访问同一个http_conn类
-    locker data_locker;
+    // 请求的字节区间，闭区间，m_range_count为0时发整个文件
+    struct byte_range
+    {
+        off_t m_first;
+        off_t m_last;
+    };
+    byte_range m_ranges[MAX_RANGES];
+    int m_range_count;
+    // 待发送的应答按顺序分成若干段：m_base不为空的是内存段（写缓冲区里的头部，或者读进内存的小文件），
+    // 为空的是m_file里的一段，用sendfile发
+    // m_offset是下一个要发的字节，发出去多少就推进多少，m_offset到了m_end这段就发完了
+    struct segment
+    {
+        const char* m_base;
+        file_entry* m_file;
+        off_t m_offset;
+        off_t m_end;
+    };
+    segment* m_segments;
+    int m_segment_count;
+    // 当前正在发的段
+    int m_segment_idx;
+    // 排队的应答里有要求关闭连接的，发完就关，后面的请求不再处理
+    bool m_close_after;
 };
 
 #endif // !HTTPCONNECTION_H
@@ -1,15 +1,33 @@
 #include "15-4http_conn.h"
+#include "15-11http_scan.h"
+#include "15-14http_format.h"
 
-/*定义http响应的一些状态信息*/
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
+/*定义http响应的一些状态信息，状态行预先拼好，发送时直接拷贝*/
+const prerendered ok_200_status = PRERENDERED("HTTP/1.1 200 OK\r\n");
+const prerendered partial_206_status = PRERENDERED("HTTP/1.1 206 Partial Content\r\n");
+const prerendered not_modified_304_status = PRERENDERED("HTTP/1.1 304 Not Modified\r\n");
+const prerendered error_400_status = PRERENDERED("HTTP/1.1 400 Bad Request\r\n");
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
+const prerendered error_403_status = PRERENDERED("HTTP/1.1 403 Forbidden\r\n");
 const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
+const prerendered error_404_status = PRERENDERED("HTTP/1.1 404 Not Found\r\n");
 const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
+const prerendered created_201_status = PRERENDERED("HTTP/1.1 201 Created\r\n");
+const char* created_201_form = "The file was uploaded.\n";
+const char* replaced_200_form = "The file was replaced.\n";
+const prerendered error_413_status = PRERENDERED("HTTP/1.1 413 Content Too Large\r\n");
+const char* error_413_form = "The request body is larger than this server accepts.\n";
+const prerendered error_416_status = PRERENDERED("HTTP/1.1 416 Range Not Satisfiable\r\n");
+const char* error_416_form = "None of the requested ranges overlap the file.\n";
+const prerendered error_500_status = PRERENDERED("HTTP/1.1 500 Internal Error\r\n");
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+/*过载时由主线程直接发的503，连Content-Length一起是固定的；不带Date，5xx应答可以不带*/
+const prerendered overloaded_503_response = PRERENDERED("HTTP/1.1 503 Service Unavailable\r\n"
+                                                        "Retry-After: 1\r\n"
+                                                        "Content-Length: 63\r\n"
+                                                        "Connection: close\r\n"
+                                                        "\r\n"
+                                                        "The server is too busy to handle the request, try again later.\n");
 
 /*网站根目录*/
 const char* doc_root = "/home/jiang/net_program/codes/15";
@@ -22,6 +40,7 @@ int setnonblocking(int fd)
     return oldopt;
 }
 
+/*fd要已经是非阻塞的：连接socket由accept4带SOCK_NONBLOCK直接拿到，不用每个连接再两次fcntl*/
 void addfd(int epollfd, int fd, bool one_shot = false)
 {
     epoll_event event;
@@ -32,7 +51,6 @@ void addfd(int epollfd, int fd, bool one_shot = false)
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
 }
 
 void removefd(int epollfd, int fd)
@@ -41,39 +59,58 @@ void removefd(int epollfd, int fd)
     close(fd);
 }
 
-void modfd(int epollfd, int fd, int ev)
+void modfd(int epollfd, int fd, int ev, bool one_shot = false)
 {
     epoll_event event;
     event.data.fd = fd;
     //这里是不是应该把epollin去掉?
     event.events = ev | EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if (one_shot)
+    {
+        event.events |= EPOLLONESHOT;
+    }
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
 //类外初始化静态成员
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<long> http_conn::m_not_found(0);
+const char* http_conn::m_upload_root = NULL;
+long long http_conn::m_max_body = 1024 * 1024;
 
 void http_conn::close_conn(bool real_close)
 {
     if (real_close && m_sockfd != -1)
     {
+        //响应没发完连接就断了，文件也要还回去；缓冲区等对象析构时再还，线程池里可能还有任务在用
+        release_files();
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
     }
 }
 
+/*过载时拒掉新请求：不取缓冲区、不排队，整段503非阻塞地发一次，发不完也不等，读进来的请求都丢掉，然后关连接*/
+void http_conn::reject_overloaded()
+{
+    send(m_sockfd, overloaded_503_response.m_data, overloaded_503_response.m_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close_conn();
+}
+
 /*public成员 接收到新连接时调用*/
-void http_conn::init(int sockfd, const sockaddr_in& addr)
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, bool one_shot)
 {
+    m_epollfd = epollfd;
     m_sockfd = sockfd;
+    m_one_shot = one_shot;
+    m_file = NULL;
+    m_file_count = 0;
     m_address = addr;
     /*下面两行是为了避免TIME_WAIT状态，仅用于调试，实际使用时应该去掉*/
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     //添加到epoll中进行监听
-    addfd(m_epollfd, m_sockfd);
+    addfd(m_epollfd, m_sockfd, m_one_shot);
     m_user_count++;
 
     init();
@@ -81,6 +118,29 @@ void http_conn::init(int sockfd, const sockaddr_in& addr)
 
 /*private成员 由public的init调用*/
 void http_conn::init()
+{
+    init_request();
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_request_start = 0;
+    m_read_blocked = false;
+    m_unprocessed = false;
+    m_write_idx = 0;
+    m_segment_count = 0;
+    m_segment_idx = 0;
+    m_close_after = false;
+}
+
+/*把fd重新挂回epoll。EPOLLONESHOT的连接每次事件以后都要重新挂，挂上以后下一个事件可能马上交给别的线程处理，
+所以rearm是这次处理的最后一步，之后不能再碰这个连接*/
+void http_conn::rearm(int ev)
+{
+    modfd(m_epollfd, m_sockfd, ev, m_one_shot);
+}
+
+/*一个请求的应答排好队以后调用；读写缓冲区和发送队列不动，流水线上的下一个请求可能已经在读缓冲区里了*/
+void http_conn::init_request()
 {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
@@ -89,14 +149,30 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_accept_encoding = 0;
+    m_encoding = -1;
+    m_vary = false;
+    m_range_count = 0;
+    m_chunked = false;
+    m_bad_framing = false;
+    m_body_left = 0;
+    m_body_size = 0;
+    m_chunk_state = CHUNK_SIZE;
+    release_sink();
+}
 
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+/*请求处理完或者连接对象析构时调用，上传到一半的临时文件由upload_sink的析构删掉*/
+void http_conn::release_sink()
+{
+    if (m_sink && m_sink != discard_sink::instance())
+    {
+        delete m_sink;
+    }
+    m_sink = NULL;
 }
 
 /*从状态机
@@ -108,6 +184,12 @@ http_conn::LINE_STATUS http_conn::parse_line()
     char temp;
     for (; m_checked_idx < m_read_idx; ++m_checked_idx)
     {
+        /*既不是\r也不是\n的字节用SIMD一次跳过16或32个*/
+        m_checked_idx = scan2(m_read_buf + m_checked_idx, m_read_buf + m_read_idx, '\r', '\n') - m_read_buf;
+        if (m_checked_idx == m_read_idx)
+        {
+            break;
+        }
         temp = m_read_buf[m_checked_idx];
         if (temp == '\r')
         {
@@ -129,6 +211,8 @@ http_conn::LINE_STATUS http_conn::parse_line()
             /*这种情况对应第一个if中LINE_OPEN的情况*/
             if (m_checked_idx > 1 && m_read_buf[m_checked_idx - 1] == '\r')
             {
+                m_read_buf[m_checked_idx - 1] = '\0';
+                m_read_buf[m_checked_idx++] = '\0';
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -141,14 +225,20 @@ http_conn::LINE_STATUS http_conn::parse_line()
 /*循环读取数据，直到无数据可读或对方关闭连接*/
 bool http_conn::read()
 {
-    if (m_read_idx >= READ_BUFFER_SIZE)
-    {
-        return false;
-    }
-
     int bytes_read = 0;
     while (1)
     {
+        if (!m_read_buf)
+        {
+            m_read_buf = buffer_pool::instance()->get(READ_BUFFER_SIZE);
+        }
+        if (m_read_idx >= READ_BUFFER_SIZE)
+        {
+            /*缓冲区满了，剩下的数据还在socket里，等前面的请求处理掉腾出地方，应答发完后再读；
+            处理不掉（一个请求就比缓冲区长）时由process_requests关闭连接*/
+            m_read_blocked = true;
+            break;
+        }
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         if (bytes_read == -1)
         {
@@ -170,14 +260,22 @@ bool http_conn::read()
     return true;
 }
 
+/*在刚解析出的这一行里找第一个等于a或b的字符，找不到返回0。作用和strpbrk一样，但用SIMD扫描
+parse_line已经把行尾的\r\n换成了\0\0，这一行在m_checked_idx之前结束*/
+char* http_conn::find_in_line(char* text, char a, char b)
+{
+    char* end = m_read_buf + m_checked_idx;
+    char* p = scan2(text, end, a, b);
+    return p < end ? p : 0;
+}
+
 /*解析http请求行 获得请求方法、目标URL,以及http版本号
 一个正常的http请求行示例："GET http://www.xxx.xx/xx HTTP/1.1"*/
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
 {
-    /*c库函数 strpbrk 检索temp中第一个出现" \t"中字符的字符，
-    返回指向检索到的哪个字符的指针本例中是检索temp中第一次出现空格或者'\t'的位置
-    如temp为"abc def",返回的url将指向c后面的空格*/
-    m_url = strpbrk(text, " \t");
+    /*检索text中第一次出现空格或者'\t'的位置，原来用的是c库函数strpbrk(text, " \t")
+    如text为"abc def",返回的url将指向c后面的空格*/
+    m_url = find_in_line(text, ' ', '\t');
     if (!m_url)
     {
         return BAD_REQUEST;
@@ -187,15 +285,22 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
 //    printf("thread %d sleep\n", pthread_self());
 //    sleep(20);
     /*strcasecmp忽略大小写比较字符串*/
-    if (strcasecmp(method, "GET") != 0)
+    if (strcasecmp(method, "GET") == 0)
+    {
+        m_method = GET;
+    }
+    else if (strcasecmp(method, "PUT") == 0)
+    {
+        m_method = PUT;
+    }
+    else
     {
         return BAD_REQUEST;
     }
-    m_method = GET;
     /*C 库函数 size_t strspn(const char *str1, const char *str2) 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
     这一步过滤多余的空格和'\t'，确保url指向'h'*/
     m_url += strspn(m_url, " \t");
-    m_version = strpbrk(m_url, " \t");
+    m_version = find_in_line(m_url, ' ', '\t');
     if (!m_version)
     {
         return BAD_REQUEST;
@@ -230,57 +335,328 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
     /*遇到空行，表示头部字段解析完毕*/
     if (text[0] == '\0')
     {
-        /*如果请求有消息体，则还需要读取m_content_length字节的消息体，状态机转移到CHECK_STATE_CONTENT状态*/
-        if (m_content_length != 0)
-        {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
-        }
-        /*否则说明已经得到了一个完整的http请求*/
-        return GET_REQUEST;
+        return begin_body();
     }
 
-    /*处理connection头部字段*/
-    if (strncasecmp(text, "Connection:", 11) == 0)
+    /*认识的头部和它们的处理函数，编译期生成完美哈希，要支持新的头部在这里加一项就行*/
+    static constexpr header_def<http_conn> known_headers[] = {
+        {"Connection", &http_conn::on_connection},
+        {"Content-Length", &http_conn::on_content_length},
+        {"Host", &http_conn::on_host},
+        {"Range", &http_conn::on_range},
+        {"If-Range", &http_conn::on_if_range},
+        {"If-None-Match", &http_conn::on_if_none_match},
+        {"If-Modified-Since", &http_conn::on_if_modified_since},
+        {"Accept-Encoding", &http_conn::on_accept_encoding},
+        {"Transfer-Encoding", &http_conn::on_transfer_encoding},
+    };
+    static constexpr auto header_table = make_header_index(known_headers);
+    static_assert(header_table.ok(), "no collision-free seed for known_headers");
+
+    /*先找到冒号，没有冒号的行和不认识的头部直接跳过*/
+    char* colon = find_in_line(text, ':', ':');
+    if (!colon)
     {
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0)
-        {
-            /*长连接*/
-            m_linger = true;
-        }
+        return NO_REQUEST;
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0)
+    int i = header_table.find(text, colon - text);
+    if (i >= 0)
     {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+        char* value = colon + 1;
+        value += strspn(value, " \t");
+        (this->*known_headers[i].m_handler)(value);
     }
-    else if (strncasecmp(text, "Host:", 5) == 0)
+    return NO_REQUEST;
+}
+
+void http_conn::on_connection(char* value)
+{
+    if (strcasecmp(value, "keep-alive") == 0)
     {
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+        /*长连接*/
+        m_linger = true;
+    }
+}
+
+void http_conn::on_content_length(char* value)
+{
+    /*只接受一串数字，两个不一样的Content-Length也当格式错误*/
+    char* end = NULL;
+    errno = 0;
+    long long length = strtoll(value, &end, 10);
+    if (!isdigit((unsigned char)value[0]) || *end != '\0' || errno == ERANGE
+        || (m_content_length != 0 && m_content_length != length))
+    {
+        length = -1;
+    }
+    m_content_length = length;
+}
+
+void http_conn::on_host(char* value)
+{
+    m_host = value;
+}
+
+void http_conn::on_range(char* value)
+{
+    m_range = value;
+}
+
+void http_conn::on_if_range(char* value)
+{
+    m_if_range = value;
+}
+
+void http_conn::on_if_none_match(char* value)
+{
+    m_if_none_match = value;
+}
+
+void http_conn::on_if_modified_since(char* value)
+{
+    m_if_modified_since = value;
+}
+
+void http_conn::on_accept_encoding(char* value)
+{
+    m_accept_encoding = value;
+}
+
+void http_conn::on_transfer_encoding(char* value)
+{
+    if (strcasecmp(value, "chunked") == 0)
+    {
+        m_chunked = true;
     }
     else
     {
-        printf("oop! unknow header %s\n", text);
+        m_bad_framing = true;
     }
-    return NO_REQUEST;
 }
 
-/*我们没有真正解析http请求的消息体，只是判断它是否被完整读入了*/
-http_conn::HTTP_CODE http_conn::parse_content(char* text)
+/*头部收完了，先把请求分派出去：GET从file_cache取文件，PUT打开上传的临时文件。Range、条件请求这些头部到这里就都用完了，
+有消息体的话头部不用再留在读缓冲区里，转到CHECK_STATE_CONTENT，消息体边收边交给m_sink，收完再回这里定下的应答
+出错的请求（404之类）消息体也照样收下扔掉，连接可以接着用；只有消息体的边界定不下来或者太大时才回完应答就关*/
+http_conn::HTTP_CODE http_conn::begin_body()
 {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
+    if (m_bad_framing || m_content_length < 0 || (m_chunked && m_content_length > 0))
+    {
+        return BAD_REQUEST;
+    }
+    bool has_body = m_chunked || m_content_length > 0;
+    if (m_content_length > m_max_body)
+    {
+        m_linger = false;
+        return PAYLOAD_TOO_LARGE;
+    }
+    HTTP_CODE ret = m_method == PUT ? begin_upload() : do_request();
+    if (!m_sink)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        m_sink = discard_sink::instance();
     }
+    if (!has_body)
+    {
+        return finish_body(ret);
+    }
+    m_body_ret = ret;
+    m_body_left = m_chunked ? 0 : m_content_length;
+    m_chunk_state = CHUNK_SIZE;
+    char** pointers[] = {&m_url, &m_version, &m_host, &m_range, &m_if_range, &m_if_none_match, &m_if_modified_since,
+                         &m_accept_encoding};
+    for (unsigned int i = 0; i < sizeof(pointers) / sizeof(pointers[0]); ++i)
+    {
+        *pointers[i] = 0;
+    }
+    m_request_start = m_checked_idx;
+    m_check_state = CHECK_STATE_CONTENT;
     return NO_REQUEST;
 }
 
+/*PUT：写到上传目录下同名的文件里，不许用..跳出上传目录*/
+http_conn::HTTP_CODE http_conn::begin_upload()
+{
+    if (!m_upload_root)
+    {
+        return FORBIDDEN_REQUEST;
+    }
+    int root_len = strlen(m_upload_root);
+    int url_len = strlen(m_url);
+    if (strstr(m_url, "/..") || m_url[url_len - 1] == '/' || root_len + url_len >= FILENAME_LEN)
+    {
+        return BAD_REQUEST;
+    }
+    char path[FILENAME_LEN];
+    memcpy(path, m_upload_root, root_len);
+    memcpy(path + root_len, m_url, url_len + 1);
+    bool existed = false;
+    m_sink = upload_sink::create(path, &existed);
+    if (!m_sink)
+    {
+        switch (errno)
+        {
+            case ENOENT:
+                return NO_RESOURCE;
+            case EACCES:
+            case EISDIR:
+                return FORBIDDEN_REQUEST;
+            default:
+                return INTERNAL_ERROR;
+        }
+    }
+    return existed ? UPLOAD_REPLACED : UPLOAD_CREATED;
+}
+
+/*消息体收完，m_sink收尾失败（比如rename失败）时回500*/
+http_conn::HTTP_CODE http_conn::finish_body(HTTP_CODE ret)
+{
+    if (!m_sink->on_end())
+    {
+        return INTERNAL_ERROR;
+    }
+    return ret;
+}
+
+/*分块编码里的一行：块长度行（可以带;扩展），块数据后面的空行，或者最后一块之后的尾部头部*/
+http_conn::HTTP_CODE http_conn::parse_chunk_line(char* text)
+{
+    switch (m_chunk_state)
+    {
+        case CHUNK_SIZE:
+        {
+            char* end = NULL;
+            errno = 0;
+            long long size = strtoll(text, &end, 16);
+            if (!isxdigit((unsigned char)text[0]) || errno == ERANGE || (*end != '\0' && *end != ';'
+                                                                          && *end != ' ' && *end != '\t'))
+            {
+                return BAD_REQUEST;
+            }
+            if (size == 0)
+            {
+                m_chunk_state = CHUNK_TRAILER;
+                return NO_REQUEST;
+            }
+            /*先比再加，size可以大到LLONG_MAX，加起来会溢出*/
+            if (size > m_max_body - m_body_size)
+            {
+                return PAYLOAD_TOO_LARGE;
+            }
+            m_body_size += size;
+            m_body_left = size;
+            m_chunk_state = CHUNK_DATA;
+            return NO_REQUEST;
+        }
+        case CHUNK_DATA_END:
+            if (text[0] != '\0')
+            {
+                return BAD_REQUEST;
+            }
+            m_chunk_state = CHUNK_SIZE;
+            return NO_REQUEST;
+        case CHUNK_TRAILER:
+            /*尾部头部不用，空行表示消息体结束*/
+            return text[0] == '\0' ? GET_REQUEST : NO_REQUEST;
+        default:
+            return INTERNAL_ERROR;
+    }
+}
+
+/*收消息体：读缓冲区里有多少交多少，交过的马上从读缓冲区里挪掉，所以消息体多大都只占一个读缓冲区；
+读缓冲区空了而m_sink能splice时，直接从socket搬到文件或管道，不经过用户态
+返回NO_REQUEST表示还没收完；中途出错时消息体的边界已经乱了，回完应答就关*/
+http_conn::HTTP_CODE http_conn::parse_content()
+{
+    HTTP_CODE ret = NO_REQUEST;
+    while (ret == NO_REQUEST)
+    {
+        if (m_body_left > 0)
+        {
+            int available = m_read_idx - m_checked_idx;
+            if (available > 0)
+            {
+                int n = available < m_body_left ? available : (int)m_body_left;
+                if (!m_sink->on_data(m_read_buf + m_checked_idx, n))
+                {
+                    ret = INTERNAL_ERROR;
+                    break;
+                }
+                m_checked_idx += n;
+                m_start_line = m_checked_idx;
+                m_body_left -= n;
+            }
+            else if (m_sink->can_splice())
+            {
+                ssize_t n = m_sink->splice_from(m_sockfd, m_body_left < SPLICE_CHUNK ? m_body_left : SPLICE_CHUNK);
+                if (n > 0)
+                {
+                    m_body_left -= n;
+                    if (m_body_left == 0)
+                    {
+                        /*这一段搬完了socket里可能还有数据（下一块的长度行、流水线上的下一个请求），
+                        边沿触发下不会再报EPOLLIN，要接着读*/
+                        m_read_blocked = true;
+                    }
+                }
+                else if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                else
+                {
+                    ret = n == 0 ? CLOSE_CONNECTION : INTERNAL_ERROR;
+                    break;
+                }
+            }
+            else
+            {
+                break;
+            }
+            if (m_body_left > 0)
+            {
+                continue;
+            }
+            if (m_chunked)
+            {
+                m_chunk_state = CHUNK_DATA_END;
+            }
+        }
+        if (!m_chunked)
+        {
+            ret = m_body_left == 0 ? GET_REQUEST : NO_REQUEST;
+            break;
+        }
+        LINE_STATUS line_status = parse_line();
+        if (line_status == LINE_OPEN)
+        {
+            break;
+        }
+        if (line_status == LINE_BAD)
+        {
+            ret = BAD_REQUEST;
+            break;
+        }
+        char* text = get_line();
+        m_start_line = m_checked_idx;
+        ret = parse_chunk_line(text);
+    }
+    /*交过的数据可以挪掉了，没解析完的块长度行留着*/
+    m_request_start = m_start_line;
+    if (ret == GET_REQUEST)
+    {
+        m_start_line = m_checked_idx;
+        return finish_body(m_body_ret);
+    }
+    if (ret != NO_REQUEST)
+    {
+        m_linger = false;
+    }
+    return ret;
+}
+
 /*主状态机
 从buffer中读出所有的完整的行*/
 http_conn::HTTP_CODE http_conn::process_read()
@@ -294,7 +670,6 @@ http_conn::HTTP_CODE http_conn::process_read()
     {
         text = get_line();
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
 
         switch (m_check_state)
         {
@@ -315,19 +690,19 @@ http_conn::HTTP_CODE http_conn::process_read()
                 {
                     return BAD_REQUEST;
                 }
-                if (ret == GET_REQUEST)
+                if (ret != NO_REQUEST)
                 {
-                    return do_request();
+                    return ret;
                 }
                 break;
             }
                 break;
             case http_conn::CHECK_STATE_CONTENT:
             {
-                ret = parse_content(text);
-                if (ret == GET_REQUEST)
+                ret = parse_content();
+                if (ret != NO_REQUEST)
                 {
-                    return do_request();
+                    return ret;
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -341,224 +716,756 @@ http_conn::HTTP_CODE http_conn::process_read()
 }
 
 /*当得到一个完整、正确的http请求时就分析目标文件的属性。如果目标文件存在、对所有用户可读，且不是目录，
-则使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功*/
+则从进程共享的file_cache里取它（没缓存过时由file_cache打开：小文件用pread整个读进内存，大文件留着fd给sendfile），并告诉调用者获取文件成功*/
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    strcpy(m_real_file, doc_root);
+    //客户请求的目标文件的完整路径，只在这里用，放栈上
+    char real_file[FILENAME_LEN];
+    strcpy(real_file, doc_root);
     int len = strlen(doc_root);
-    //文件路径加文件名
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    if (stat(m_real_file, &m_file_stat) < 0)
+    //文件路径加文件名，url太长时截断
+    strncpy(real_file + len, m_url, FILENAME_LEN - len - 1);
+    real_file[FILENAME_LEN - 1] = '\0';
+    switch (file_cache::instance()->acquire(real_file, &m_file))
     {
-        printf("real file:%s\n", m_real_file);
-        return NO_RESOURCE;
+        case 0:
+            break;
+        case EACCES:
+            return FORBIDDEN_REQUEST;
+        case EISDIR:
+            /*请求的是个目录*/
+            return BAD_REQUEST;
+        default:
+            m_not_found++;
+            return NO_RESOURCE;
     }
-    /*S_IRUSR：用户读权限
-    S_IWUSR：用户写权限
-    S_IRGRP：用户组读权限
-    S_IWGRP：用户组写权限
-    S_IROTH：其他组读权限
-    S_IWOTH：其他组写权限*/
-    if (!(m_file_stat.st_mode & S_IROTH))
+    if (m_accept_encoding)
     {
-        return FORBIDDEN_REQUEST;
+        negotiate_encoding();
+    }
+    else
+    {
+        /*没带Accept-Encoding也要带Vary：有预压缩副本的文件，别的请求拿到的可能是压缩过的，
+        共享缓存不知道应答随Accept-Encoding变，会把这个不压缩的版本给所有人*/
+        m_vary = file_cache::instance()->has_sidecar(m_file);
+    }
+    m_file_stat = m_file->m_stat;
+    if (not_modified())
+    {
+        return NOT_MODIFIED;
     }
+    if (m_range && m_file_stat.st_size > 0 && if_range_matches())
+    {
+        return parse_range();
+    }
+    return FILE_REQUEST;
+}
 
-    if (S_ISDIR(m_file_stat.st_mode))
+/*Accept-Encoding里某种编码的q值，比如"gzip, deflate, br;q=0.9, *;q=0"；没提到时取"*"的，都没有就是0*/
+static double accept_q(const char* list, const char* coding)
+{
+    int len = strlen(coding);
+    double star = 0;
+    while (1)
     {
-        /*请求的是个目录*/
-        return BAD_REQUEST;
+        list += strspn(list, " \t,");
+        if (*list == '\0')
+        {
+            return star;
+        }
+        int name_len = strcspn(list, " \t;,");
+        const char* end = list + strcspn(list, ",");
+        double q = 1;
+        for (const char* param = list + name_len; param < end; param += strcspn(param, ";,"))
+        {
+            param += strspn(param, " \t;");
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+            {
+                q = atof(param + 2);
+                break;
+            }
+        }
+        if (name_len == len && strncasecmp(list, coding, len) == 0)
+        {
+            return q;
+        }
+        if (name_len == 1 && list[0] == '*')
+        {
+            star = q;
+        }
+        list = end;
     }
+}
 
-    int fd = open(m_real_file, O_RDONLY);
-    /*mmap看这里：https://blog.csdn.net/qq_20363225/article/details/121653263?spm=1001.2014.3001.5501*/
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    return FILE_REQUEST;
+/*客户端接受的预压缩副本里挑q值最高的（一样高时按SIDECAR的顺序，br优先），有就把m_file换成副本
+副本的有无由file_cache缓存，查不到的不会每次都去找文件*/
+void http_conn::negotiate_encoding()
+{
+    m_vary = true;
+    double q[SIDECAR_COUNT];
+    for (int i = 0; i < SIDECAR_COUNT; ++i)
+    {
+        q[i] = accept_q(m_accept_encoding, SIDECAR_CODINGS[i]);
+    }
+    while (1)
+    {
+        int best = -1;
+        for (int i = 0; i < SIDECAR_COUNT; ++i)
+        {
+            if (q[i] > 0 && (best < 0 || q[i] > q[best]))
+            {
+                best = i;
+            }
+        }
+        if (best < 0)
+        {
+            return;
+        }
+        file_entry* sidecar = NULL;
+        if (file_cache::instance()->acquire_sidecar(m_file, best, &sidecar) == 0)
+        {
+            file_cache::instance()->release(m_file);
+            m_file = sidecar;
+            m_encoding = best;
+            return;
+        }
+        q[best] = 0;
+    }
 }
 
-/*对内存映射区执行munmap*/
-void http_conn::unmap()
+/*"Sun, 06 Nov 1994 08:49:37 GMT"格式的日期*/
+static bool parse_http_date(const char* text, time_t* t)
 {
-    if (m_file_address)
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm))
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+        return false;
     }
+    *t = timegm(&tm);
+    return true;
 }
 
-/*写http响应*/
+/*If-None-Match的值是"*"或者逗号分隔的实体标签列表，按弱比较（忽略W/前缀）看有没有和etag相同的*/
+static bool etag_list_matches(const char* list, const char* etag, int len)
+{
+    while (1)
+    {
+        list += strspn(list, " \t,");
+        if (*list == '*')
+        {
+            return true;
+        }
+        if (strncmp(list, "W/", 2) == 0)
+        {
+            list += 2;
+        }
+        if (*list != '"')
+        {
+            return false;
+        }
+        const char* end = strchr(list + 1, '"');
+        if (!end)
+        {
+            return false;
+        }
+        if (end + 1 - list == len && memcmp(list, etag, len) == 0)
+        {
+            return true;
+        }
+        list = end + 1;
+    }
+}
+
+/*条件GET：有If-None-Match时只看它；没有时看If-Modified-Since，文件在那之后没改过就算没变
+校验值在file_cache加载文件时就生成好了，客户端一般原样带回我们发过的值，先直接比字节，不用解析日期*/
+bool http_conn::not_modified()
+{
+    if (m_if_none_match)
+    {
+        return etag_list_matches(m_if_none_match, m_file->m_etag, m_file->m_etag_len);
+    }
+    if (m_if_modified_since)
+    {
+        if (strncmp(m_if_modified_since, m_file->m_last_modified, HTTP_DATE_LEN) == 0
+            && m_if_modified_since[HTTP_DATE_LEN] == '\0')
+        {
+            return true;
+        }
+        time_t since;
+        return parse_http_date(m_if_modified_since, &since) && m_file_stat.st_mtime <= since;
+    }
+    return false;
+}
+
+/*If-Range：带实体标签时必须和文件的ETag完全一致（强比较，弱标签一律不匹配）；带日期时必须和文件的最后修改时间完全一致
+不匹配时忽略Range，发整个文件*/
+bool http_conn::if_range_matches()
+{
+    if (!m_if_range)
+    {
+        return true;
+    }
+    if (m_if_range[0] == '"')
+    {
+        return strncmp(m_if_range, m_file->m_etag, m_file->m_etag_len) == 0
+               && m_if_range[m_file->m_etag_len] == '\0';
+    }
+    if (strncmp(m_if_range, "W/", 2) == 0)
+    {
+        return false;
+    }
+    time_t date;
+    return parse_http_date(m_if_range, &date) && date == m_file_stat.st_mtime;
+}
+
+/*解析"Range: bytes=0-99,200-,-50"，结果按请求的顺序放进m_ranges
+语法不对、单位不是bytes、区间太多时当作没有Range（m_range_count为0）；语法对但所有区间都在文件外面时返回416*/
+http_conn::HTTP_CODE http_conn::parse_range()
+{
+    off_t size = m_file_stat.st_size;
+    char* text = m_range;
+    if (strncasecmp(text, "bytes=", 6) != 0)
+    {
+        return FILE_REQUEST;
+    }
+    text += 6;
+    while (1)
+    {
+        text += strspn(text, " \t");
+        char* end = 0;
+        off_t first = 0;
+        off_t last = 0;
+        bool satisfiable = true;
+        if (text[0] == '-' && isdigit(text[1]))
+        {
+            /*后缀区间：最后n个字节*/
+            off_t n = strtoll(text + 1, &end, 10);
+            satisfiable = n > 0;
+            first = n >= size ? 0 : size - n;
+            last = size - 1;
+        }
+        else if (isdigit(text[0]))
+        {
+            first = strtoll(text, &end, 10);
+            if (*end++ != '-')
+            {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            last = size - 1;
+            if (isdigit(*end))
+            {
+                last = strtoll(end, &end, 10);
+                if (last < first)
+                {
+                    m_range_count = 0;
+                    return FILE_REQUEST;
+                }
+                if (last >= size)
+                {
+                    last = size - 1;
+                }
+            }
+            satisfiable = first < size;
+        }
+        else
+        {
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
+
+        if (satisfiable)
+        {
+            if (m_range_count == MAX_RANGES)
+            {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            m_ranges[m_range_count].m_first = first;
+            m_ranges[m_range_count].m_last = last;
+            m_range_count++;
+        }
+        text = end + strspn(end, " \t");
+        if (*text == '\0')
+        {
+            break;
+        }
+        if (*text++ != ',')
+        {
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
+    }
+    return m_range_count > 0 ? FILE_REQUEST : RANGE_NOT_SATISFIABLE;
+}
+
+/*把文件还给file_cache，真正的close由file_cache在淘汰或文件变化时做*/
+void http_conn::release_files()
+{
+    if (m_file)
+    {
+        file_cache::instance()->release(m_file);
+        m_file = NULL;
+    }
+    for (int i = 0; i < m_file_count; ++i)
+    {
+        file_cache::instance()->release(m_files[i]);
+    }
+    m_file_count = 0;
+}
+
+/*写缓冲区和发送队列合在一块里从buffer_pool取，发送队列放前面，对齐不用另外操心*/
+void http_conn::acquire_send_buffer()
+{
+    if (!m_segments)
+    {
+        char* block = buffer_pool::instance()->get(MAX_SEGMENTS * sizeof(segment) + WRITE_BUFFER_SIZE);
+        m_segments = (segment*)block;
+        m_write_buf = block + MAX_SEGMENTS * sizeof(segment);
+    }
+}
+
+/*没有要发的应答时还掉写缓冲区，读缓冲区里也没有剩下的数据时一起还掉；
+keep-alive的连接大部分时间都在等下一个请求，这时候一个缓冲区都不占*/
+void http_conn::release_idle_buffers()
+{
+    if (m_segment_count == 0 && m_segments)
+    {
+        buffer_pool::instance()->put((char*)m_segments, MAX_SEGMENTS * sizeof(segment) + WRITE_BUFFER_SIZE);
+        m_segments = NULL;
+        m_write_buf = NULL;
+    }
+    if (m_read_idx == 0 && m_read_buf)
+    {
+        buffer_pool::instance()->put(m_read_buf, READ_BUFFER_SIZE);
+        m_read_buf = NULL;
+    }
+}
+
+/*写http响应：按顺序发m_segments里的各段，流水线上排队的几个应答也是一起发
+连续的内存段合成一次sendmsg，文件段用sendfile从缓存的fd直接发。后面还有文件内容时内存段带MSG_MORE，
+内核会等文件数据一起凑成整段再发，不会单独发一个只有头部的小包
+每段的m_offset都按实际发出的字节推进，遇到EAGAIN时正好停在没发出去的第一个字节上，下次EPOLLOUT从那里接着发*/
 bool http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    /*需要发送的字节长度*/
-    int bytes_to_send = m_write_idx;
-    if (bytes_to_send == 0)
+    if (m_segment_count == 0)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
+        if (!(m_one_shot && needs_processing()))
+        {
+            rearm(EPOLLIN);
+        }
         return true;
     }
 
     while (1)
     {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if (temp <= -1)
+        if (m_segment_idx == m_segment_count)
         {
-            /*如果tcp写缓冲没有空间，则等待下一轮epollout事件，虽然在此期间，
-            服务器无法立即接收到同一客户的下一个请求（因为EPOLLONESHOT）。但这可以保证连接的完整性*/
-            if (errno == EAGAIN)
+            /*这一批应答发完了，根据http请求中的connection字段决定是否立即关闭连接*/
+            release_files();
+            m_write_idx = 0;
+            m_segment_count = 0;
+            m_segment_idx = 0;
+            if (m_close_after)
+            {
+                rearm(EPOLLIN);
+                return false;
+            }
+            if (m_one_shot)
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                /*线程池模式下write在主线程里，主线程只管收发：流水线上剩下的请求、没读完的消息体都交回线程池，
+                不在主线程里解析、读文件、写上传。这时fd先不挂回去，主线程把连接重新排进线程池，由工作线程处理完再rearm*/
+                if (needs_processing())
+                {
+                    return true;
+                }
+                release_idle_buffers();
+                rearm(EPOLLIN);
                 return true;
             }
-            /*出错*/
-            unmap();
-            return false;
+            /*多reactor时发送期间读进来的请求接着处理，处理出新的应答就接着发*/
+            bool ret = process_buffered();
+            if (ret && m_segment_count == 0)
+            {
+                release_idle_buffers();
+            }
+            if (!ret)
+            {
+                return false;
+            }
+            if (m_segment_count == 0)
+            {
+                rearm(EPOLLIN);
+                return true;
+            }
+            continue;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        /*为什么这里就发完了？*/
-        if (bytes_to_send <= bytes_have_send)
+        ssize_t temp = 0;
+        segment* seg = m_segments + m_segment_idx;
+        if (seg->m_base)
         {
-            /*发送http响应成功，根据http请求中的connection字段决定是否立即关闭连接*/
-            unmap();
-            if (m_linger)
+            struct iovec iv[MAX_SEGMENTS];
+            int count = 0;
+            int i = m_segment_idx;
+            for (; i < m_segment_count && m_segments[i].m_base; ++i, ++count)
             {
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return true;
+                iv[count].iov_base = (char*)m_segments[i].m_base + m_segments[i].m_offset;
+                iv[count].iov_len = m_segments[i].m_end - m_segments[i].m_offset;
             }
-            else
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            temp = sendmsg(m_sockfd, &msg, i < m_segment_count ? MSG_MORE : 0);
+            /*把发出去的字节按顺序记到各段上*/
+            for (ssize_t left = temp; left > 0;)
             {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                segment* cur = m_segments + m_segment_idx;
+                off_t n = cur->m_end - cur->m_offset < left ? cur->m_end - cur->m_offset : left;
+                cur->m_offset += n;
+                left -= n;
+                if (cur->m_offset == cur->m_end)
+                {
+                    m_segment_idx++;
+                }
+            }
+        }
+        else
+        {
+            temp = sendfile(m_sockfd, seg->m_file->m_fd, &seg->m_offset, seg->m_end - seg->m_offset);
+            if (temp == 0)
+            {
+                /*文件在发送过程中被截短了，Content-Length已经发出去，只能断开*/
+                release_files();
                 return false;
             }
+            if (seg->m_offset == seg->m_end)
+            {
+                m_segment_idx++;
+            }
+        }
+
+        if (temp <= -1)
+        {
+            /*如果tcp写缓冲没有空间，则等待下一轮epollout事件，发送进度已经记在各段的m_offset里*/
+            if (errno == EAGAIN)
+            {
+                rearm(EPOLLOUT);
+                return true;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /*出错*/
+            release_files();
+            return false;
         }
     }
 }
 
-/*往写缓冲区写入待发送的数据*/
-bool http_conn::add_response(const char* format, ...)
+/*往响应里追加一段，base为空表示m_file里[offset, end)这段内容*/
+void http_conn::add_segment(const char* base, off_t offset, off_t end)
 {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    if (offset < end)
     {
-        return false;
+        m_segments[m_segment_count].m_base = base;
+        m_segments[m_segment_count].m_file = m_file;
+        m_segments[m_segment_count].m_offset = offset;
+        m_segments[m_segment_count].m_end = end;
+        m_segment_count++;
     }
-    /*VA_LIST 是在C语言中解决变参问题的一组宏，所在头文件：#include <stdarg.h>，用于获取不确定个数的参数。*/
-    va_list arg_list;
-    /*VA_START宏，获取可变参数列表的第一个参数的地址（ap是类型为va_list的指针，v是可变参数最左边的参数）
-    #define va_start(ap, v) (ap = (va_list)&v + _INTSIZEOF(v))*/
-    va_start(arg_list, format);
-    /*vsnprintf 将可变参数格式化输出到字符数组*/
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
+}
+
+/*文件内容：读进内存的小文件直接当内存段，和前后的头部一起发；大文件用sendfile*/
+void http_conn::add_file_segment(off_t offset, off_t end)
+{
+    add_segment(m_file->m_data, offset, end);
+}
+
+/*往写缓冲区追加一段数据，放不下返回false*/
+bool http_conn::add_bytes(const char* data, int len)
+{
+    if (len > WRITE_BUFFER_SIZE - m_write_idx)
     {
         return false;
     }
+    memcpy(m_write_buf + m_write_idx, data, len);
     m_write_idx += len;
-    /*va_end清空va_list可变参数列表*/
-    va_end(arg_list);
     return true;
 }
 
+/*十进制整数*/
+bool http_conn::add_number(long long value)
+{
+    char digits[20];
+    return add_bytes(digits, format_uint(digits, value));
+}
+
 /*请求行*/
-bool http_conn::add_status_line(int status, const char* title)
+bool http_conn::add_status_line(const prerendered& status)
 {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    return add_bytes(status.m_data, status.m_len);
 }
 
 /*头部信息*/
-bool http_conn::add_headers(int content_length)
+bool http_conn::add_headers(off_t content_length)
 {
-    add_content_length(content_length);
-    add_linger();
-    add_blank_line();
-    return true;
+    return add_content_length(content_length) && add_linger() && add_date() && add_blank_line();
 }
 
 /*长度*/
-bool http_conn::add_content_length(int content_len)
+bool http_conn::add_content_length(off_t content_len)
+{
+    return add_literal("Content-Length: ") && add_number(content_len) && add_literal("\r\n");
+}
+
+/*当前时间，从每秒刷新一次的缓存里拷*/
+bool http_conn::add_date()
+{
+    return add_bytes(cached_date_header(), DATE_HEADER_LEN);
+}
+
+/*"bytes first-last/size"，不带头部名字和换行，单区间的头部和multipart的分段头共用*/
+bool http_conn::add_byte_range(off_t first, off_t last, off_t size)
+{
+    return add_literal("bytes ") && add_number(first) && add_literal("-") && add_number(last)
+           && add_literal("/") && add_number(size);
+}
+
+/*文件的校验值，客户端下次拿它们做条件请求，都是file_cache里现成的*/
+bool http_conn::add_validators()
+{
+    return add_literal("ETag: ") && add_bytes(m_file->m_etag, m_file->m_etag_len)
+           && add_literal("\r\nLast-Modified: ") && add_bytes(m_file->m_last_modified, HTTP_DATE_LEN)
+           && add_literal("\r\n");
+}
+
+/*发的是按Accept-Encoding选出来的版本时，告诉中间的缓存不同的Accept-Encoding可能拿到不同的内容*/
+bool http_conn::add_vary()
+{
+    return !m_vary || add_literal("Vary: Accept-Encoding\r\n");
+}
+
+/*文件应答才有的头部：校验值，内容编码，以及告诉客户端可以按字节区间请求*/
+bool http_conn::add_file_headers()
+{
+    if (m_encoding >= 0 && !(add_literal("Content-Encoding: ") && add_content(SIDECAR_CODINGS[m_encoding])
+                             && add_literal("\r\n")))
+    {
+        return false;
+    }
+    return add_validators() && add_vary() && add_literal("Accept-Ranges: bytes\r\n");
+}
+
+/*206应答。单个区间直接用sendfile从文件偏移处发；多个区间拼成multipart/byteranges，
+每个分段头写在写缓冲区里，文件内容还是sendfile。写缓冲区放不下时退回200发整个文件*/
+bool http_conn::add_ranges()
 {
-    return add_response("Content-Length: %d\r\n", content_len);
+    static std::atomic<unsigned int> boundary_seq(0);
+    off_t size = m_file_stat.st_size;
+    int response_start = m_write_idx;
+    if (m_range_count == 1)
+    {
+        off_t first = m_ranges[0].m_first;
+        off_t last = m_ranges[0].m_last;
+        add_status_line(partial_206_status);
+        add_file_headers();
+        add_literal("Content-Range: ");
+        add_byte_range(first, last, size);
+        add_literal("\r\n");
+        add_headers(last - first + 1);
+        add_segment(m_write_buf, response_start, m_write_idx);
+        add_file_segment(first, last + 1);
+        return true;
+    }
+
+    /*先写各分段头和结尾，算出消息体总长度后再写状态行和头部；各段记的是缓冲区里的位置，发送顺序不受写入顺序影响*/
+    char boundary[32];
+    int boundary_len = snprintf(boundary, sizeof(boundary), "%08lx%08x",
+                                (unsigned long)(m_file_stat.st_mtime ^ m_file_stat.st_ino), boundary_seq++);
+    int part_start[MAX_RANGES + 1];
+    off_t body_length = 0;
+    bool ok = true;
+    for (int i = 0; i < m_range_count && ok; ++i)
+    {
+        part_start[i] = m_write_idx;
+        ok = add_literal("\r\n--") && add_bytes(boundary, boundary_len)
+             && add_literal("\r\nContent-Range: ")
+             && add_byte_range(m_ranges[i].m_first, m_ranges[i].m_last, size)
+             && add_literal("\r\n\r\n");
+        body_length += m_ranges[i].m_last - m_ranges[i].m_first + 1;
+    }
+    part_start[m_range_count] = m_write_idx;
+    ok = ok && add_literal("\r\n--") && add_bytes(boundary, boundary_len) && add_literal("--\r\n");
+    int head_start = m_write_idx;
+    /*分段头和结尾从response_start写起，前面可能是流水线上别的应答*/
+    body_length += head_start - response_start;
+    ok = ok && add_status_line(partial_206_status) && add_file_headers()
+         && add_literal("Content-Type: multipart/byteranges; boundary=") && add_bytes(boundary, boundary_len)
+         && add_literal("\r\n") && add_headers(body_length);
+    if (!ok)
+    {
+        m_write_idx = response_start;
+        m_range_count = 0;
+        return process_write(FILE_REQUEST);
+    }
+
+    add_segment(m_write_buf, head_start, m_write_idx);
+    for (int i = 0; i < m_range_count; ++i)
+    {
+        add_segment(m_write_buf, part_start[i], part_start[i + 1]);
+        add_file_segment(m_ranges[i].m_first, m_ranges[i].m_last + 1);
+    }
+    add_segment(m_write_buf, part_start[m_range_count], head_start);
+    return true;
 }
 
 /*Connection信息 长连接或短连接*/
 bool http_conn::add_linger()
 {
-    return add_response("Connection: %s\r\n", m_linger ? "keep-alive" : "close");
+    return m_linger ? add_literal("Connection: keep-alive\r\n") : add_literal("Connection: close\r\n");
 }
 
 /*头部信息结束后的空行*/
 bool http_conn::add_blank_line()
 {
-    return add_response("%s", "\r\n");
+    return add_literal("\r\n");
 }
 
 /*内容*/
 bool http_conn::add_content(const char* content)
 {
-    return add_response("%s", content);
+    return add_bytes(content, strlen(content));
 }
 
-/*根据服务器处理http请求的结果，决定返回给客户端的内容*/
-bool http_conn::process_write(HTTP_CODE ret)
+/*400/403/404/500的应答除了Date都是固定的：状态行到Connection拼成一段，空行加正文拼成一段，
+进程里第一次用到时拼好，之后直接当内存段发，不用拷贝；只有中间的Date写在写缓冲区里*/
+struct canned_response
+{
+    // 下标是m_linger
+    std::string m_head[2];
+    std::string m_tail;
+};
+
+static canned_response make_canned(const prerendered& status, const char* form)
+{
+    char digits[20];
+    std::string head(status.m_data, status.m_len);
+    head += "Content-Length: ";
+    head.append(digits, format_uint(digits, strlen(form)));
+    head += "\r\n";
+    canned_response canned;
+    canned.m_head[0] = head + "Connection: close\r\n";
+    canned.m_head[1] = head + "Connection: keep-alive\r\n";
+    canned.m_tail = std::string("\r\n") + form;
+    return canned;
+}
+
+bool http_conn::add_canned(HTTP_CODE ret)
 {
+    static const canned_response bad_request = make_canned(error_400_status, error_400_form);
+    static const canned_response forbidden = make_canned(error_403_status, error_403_form);
+    static const canned_response not_found = make_canned(error_404_status, error_404_form);
+    static const canned_response internal_error = make_canned(error_500_status, error_500_form);
+    static const canned_response created = make_canned(created_201_status, created_201_form);
+    static const canned_response replaced = make_canned(ok_200_status, replaced_200_form);
+    static const canned_response too_large = make_canned(error_413_status, error_413_form);
+    const canned_response* canned = &internal_error;
     switch (ret)
     {
+        case http_conn::UPLOAD_CREATED:
+            canned = &created;
+            break;
+        case http_conn::UPLOAD_REPLACED:
+            canned = &replaced;
+            break;
+        case http_conn::PAYLOAD_TOO_LARGE:
+            canned = &too_large;
+            break;
         case http_conn::BAD_REQUEST:
-        {
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if (!add_content(error_400_form))
-            {
-                return false;
-            }
-        }
+            canned = &bad_request;
+            break;
+        case http_conn::FORBIDDEN_REQUEST:
+            canned = &forbidden;
             break;
         case http_conn::NO_RESOURCE:
-        {
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if (!add_content(error_404_form))
-            {
-                return false;
-            }
-        }
+            canned = &not_found;
             break;
+        default:
+            break;
+    }
+    int date_start = m_write_idx;
+    if (!add_date())
+    {
+        return false;
+    }
+    const std::string& head = canned->m_head[m_linger ? 1 : 0];
+    add_segment(head.data(), 0, head.size());
+    add_segment(m_write_buf, date_start, m_write_idx);
+    add_segment(canned->m_tail.data(), 0, canned->m_tail.size());
+    return true;
+}
+
+/*根据服务器处理http请求的结果，决定返回给客户端的内容*/
+bool http_conn::process_write(HTTP_CODE ret)
+{
+    /*前面可能还有流水线上排着的应答，这个应答的头部接在它们后面*/
+    int response_start = m_write_idx;
+    switch (ret)
+    {
+        case http_conn::BAD_REQUEST:
+        case http_conn::NO_RESOURCE:
         case http_conn::FORBIDDEN_REQUEST:
+        case http_conn::INTERNAL_ERROR:
+        case http_conn::UPLOAD_CREATED:
+        case http_conn::UPLOAD_REPLACED:
+        case http_conn::PAYLOAD_TOO_LARGE:
+            return add_canned(ret);
+        case http_conn::RANGE_NOT_SATISFIABLE:
         {
-            add_status_line(403, error_403_title);
-            add_headers(strlen(error_403_form));
-            if (!add_content(error_403_form))
+            add_status_line(error_416_status);
+            add_literal("Content-Range: bytes */");
+            add_number(m_file_stat.st_size);
+            add_literal("\r\n");
+            add_headers(strlen(error_416_form));
+            if (!add_content(error_416_form))
             {
                 return false;
             }
         }
             break;
-        case http_conn::INTERNAL_ERROR:
+        case http_conn::NOT_MODIFIED:
         {
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if (!add_content(error_500_form))
+            /*只有头部，文件内容不发，文件也用不着了，马上还给file_cache*/
+            add_status_line(not_modified_304_status);
+            add_validators();
+            add_vary();
+            add_linger();
+            add_date();
+            if (!add_blank_line())
             {
                 return false;
             }
+            file_cache::instance()->release(m_file);
+            m_file = NULL;
         }
             break;
         case http_conn::FILE_REQUEST:
         {
-            add_status_line(200, ok_200_title);
+            if (m_range_count > 0)
+            {
+                return add_ranges();
+            }
+            add_status_line(ok_200_status);
             if (m_file_stat.st_size != 0)
             {
+                add_file_headers();
                 add_headers(m_file_stat.st_size);
-                m_iv[0].iov_base = m_write_buf;
-                m_iv[0].iov_len = m_write_idx;
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
+                add_segment(m_write_buf, response_start, m_write_idx);
+                add_file_segment(0, m_file_stat.st_size);
                 return true;
             }
             else
@@ -575,36 +1482,151 @@ bool http_conn::process_write(HTTP_CODE ret)
         default:
             return false;
     }
-
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
+    add_segment(m_write_buf, response_start, m_write_idx);
     return true;
 }
 
-/*由线程池中的工作线程调用，这是处理http请求的入口函数*/
-void http_conn::process()
+/*处理http请求的入口函数，由线程池中的工作线程调用，或者多reactor模式下由连接所属的reactor线程直接调用
+线程池模式下连接注册了EPOLLONESHOT，主线程收到一个事件以后这个fd不会再报事件，连接交给工作线程，
+工作线程处理完rearm，连接才交回主线程，同一时刻只有一个线程在碰这个http_conn，所以不用加锁，工作线程也不会互相等*/
+void http_conn::process(bool in_loop)
 {
-    //后来加上的
-    data_locker.lock();
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST)
+    //上一批应答还没发完，新来的请求先留在读缓冲区里，发完以后接着处理：多reactor时write直接处理，线程池模式下主线程重新交给线程池
+    //这次事件可能同时带着EPOLLOUT，被主循环当成EPOLLIN处理掉了，边沿触发下不会再报，所以这里接着写或者重新注册
+    if (m_segment_count > 0)
     {
-        //如果一次请求不完整，直接返回，没有给客户端发送任何信息，但是连接的socket fd还没有关闭，user数组中的http_conn类保留了上一个线程处理后的信息，
-        //等客户端把剩下的数据发送过来后，也许另一个线程获得消息，接着处理就是了，这就是无状态吗？
-        //有没有可能上一个线程还没处理完不完整的请求，客户端接下来的请求又到了，另一个线程开始处理，这样的话岂不是两个线程同时修改http_conn了，明天加一个sleep函数试一下。
-        //
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        printf("request not complete\n");
-        data_locker.unlock();
+        if (in_loop)
+        {
+            if (!write())
+            {
+                close_conn();
+            }
+            return;
+        }
+        rearm(EPOLLOUT);
         return;
     }
 
-    bool write_ret = process_write(read_ret);
-    if (!write_ret)
+    bool ret = process_buffered();
+    if (!ret)
     {
         close_conn();
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-    data_locker.unlock();
+    else if (m_segment_count == 0)
+    {
+        //请求还不完整，先把用不上的写缓冲区还掉
+        release_idle_buffers();
+    }
+    if (in_loop)
+    {
+        //直接写，写不完write会自己注册EPOLLOUT，省掉一轮epoll_wait
+        if (m_sockfd != -1 && m_segment_count > 0 && !write())
+        {
+            close_conn();
+        }
+        return;
+    }
+    //请求还不完整时没有应答，接着等数据；连接关了就不用再挂
+    if (m_sockfd != -1)
+    {
+        rearm(m_segment_count > 0 ? EPOLLOUT : EPOLLIN);
+    }
+}
+
+/*HTTP/1.1流水线：客户端可以不等应答连着发好几个请求，它们可能一起躺在读缓冲区里
+逐个解析，应答按请求的顺序排进发送队列，最后由write一次发出去；写缓冲区或者发送队列快满了就先停，发完再接着处理
+返回false表示填充应答失败，要关闭连接*/
+bool http_conn::process_requests()
+{
+    m_unprocessed = false;
+    //收消息体时读缓冲区空了也要进去，m_sink可能直接从socket splice
+    if (m_read_idx == 0 && m_check_state != CHECK_STATE_CONTENT)
+    {
+        return true;
+    }
+    acquire_send_buffer();
+    bool waiting = false;
+    while (!m_close_after && m_file_count < MAX_PIPELINE
+           && m_segment_count + MAX_RESPONSE_SEGMENTS <= MAX_SEGMENTS
+           && m_write_idx + RESPONSE_RESERVE <= WRITE_BUFFER_SIZE)
+    {
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST)
+        {
+            waiting = true;
+            break;
+        }
+        if (read_ret == BAD_REQUEST)
+        {
+            //请求的边界已经乱了，后面的数据没法再解析，发完400就关
+            m_linger = false;
+        }
+        if (!process_write(read_ret))
+        {
+            return false;
+        }
+        if (m_file)
+        {
+            m_files[m_file_count++] = m_file;
+            m_file = NULL;
+        }
+        if (!m_linger)
+        {
+            m_close_after = true;
+        }
+        m_request_start = m_checked_idx;
+        m_start_line = m_checked_idx;
+        init_request();
+    }
+    //不是等数据停下的，后面排着的请求一个字节都还没看过
+    m_unprocessed = !waiting && !m_close_after && m_read_idx > m_checked_idx;
+    compact_read_buf();
+    //读缓冲区满了却一个完整的请求都没有，请求太长
+    return m_segment_count > 0 || m_read_idx < READ_BUFFER_SIZE;
+}
+
+/*消息体比读缓冲区大时，读缓冲区会满着停下来（m_read_blocked），交掉一部分腾出地方以后要接着读socket，
+边沿触发下不读到EAGAIN不会再报EPOLLIN。排出了应答就先停，发完以后再来（多reactor时由write调用，线程池模式下由工作线程调用）*/
+bool http_conn::process_buffered()
+{
+    do
+    {
+        if (m_read_blocked)
+        {
+            m_read_blocked = false;
+            if (!read())
+            {
+                return false;
+            }
+        }
+        if (!process_requests())
+        {
+            return false;
+        }
+    } while (m_read_blocked && m_segment_count == 0);
+    return true;
+}
+
+/*把处理完的请求从读缓冲区里挪掉，没处理完的那个请求挪到开头，解析到一半留下的指针跟着挪*/
+void http_conn::compact_read_buf()
+{
+    int delta = m_request_start;
+    if (delta == 0)
+    {
+        return;
+    }
+    memmove(m_read_buf, m_read_buf + delta, m_read_idx - delta);
+    m_read_idx -= delta;
+    m_checked_idx -= delta;
+    m_start_line -= delta;
+    m_request_start = 0;
+    char** pointers[] = {&m_url, &m_version, &m_host, &m_range, &m_if_range, &m_if_none_match, &m_if_modified_since,
+                         &m_accept_encoding};
+    for (unsigned int i = 0; i < sizeof(pointers) / sizeof(pointers[0]); ++i)
+    {
+        if (*pointers[i])
+        {
+            *pointers[i] -= delta;
+        }
+    }
 }
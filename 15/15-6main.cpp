@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,13 +10,18 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "14-2locker.h"
 #include "15-3threadpool.h"
 #include "15-4http_conn.h"
+#include "15-16slab_pool.h"
+#include "15-18admission.h"
+#define TW_TIMER_QUIET
+#include "11-5tw_timer.h"
 #include <assert.h>
 
 
-#define  MAX_FD 65536
 #define  MAX_EVENT_NUMBER	10000
 
 //http_conn* users = new http_conn[MAX_FD]; user数组是所有线程的共享数据，但是并没有加锁，容易造成两个线程处理修改同一个数据的情况，通过sleep函数可以个模拟
@@ -28,6 +34,22 @@
 //    相应的socket文件描述符上注册一个写事件，然后主函数里调用http_conn::write()函数完成信息的发送，完成一次请求。
 // 4、如果read函数里一次没有接收到完整的请求，process函数会在process_read函数后直接返回，连接没有关闭，下次收到数据后选择一个线程接着处理
 // 5、一个连接的请求可能会被不同的线程处理，所以只能处理无状态的连接
+// 6、后来锁去掉了：连接注册时带EPOLLONESHOT，主线程收到事件后fd不再报事件，连接交给工作线程，工作线程处理完重新挂回epoll才交回来，
+//    同一时刻只有一个线程碰一个连接。第二个EPOLLIN不会再给同一个连接排第二个任务，工作线程也不会卡在别的连接的锁上
+//
+//加上 -r N 参数后换成多reactor模式（one loop per thread）：
+// 1、起N个reactor线程，每个线程有自己的epoll和自己的监听socket，监听socket都开SO_REUSEPORT绑在同一个端口上，由内核把新连接分给各个线程
+// 2、连接从accept到关闭都只在接受它的那个线程里，read、process、write都在这个线程里做完，不经过线程池，也不用加锁
+// 3、fd表还是所有线程共用，但是fd在进程内是唯一的，一个槽同一时刻只会属于一个线程
+// 4、再加-x时所有reactor共用一个监听socket，各自用EPOLLEXCLUSIVE挂到自己的epoll上，新连接来时内核只叫醒一个在等的线程去accept。
+//    SO_REUSEPORT按四元组哈希固定分配，某个线程正忙着时分给它的连接只能在它的队列里等；共用一个socket时谁闲谁来取
+//
+//连接对象不再按fd上限预先分配（new http_conn[MAX_FD]要占几百MB），accept时从slab池里取，确认关闭后还回去，
+//按fd找对象用两级的fd表，fd超过65536也能用；读写缓冲区在http_conn里按需从buffer_pool取，空闲连接不占缓冲区
+//
+//线程池模式下任务进队列前要过准入控制（15-18admission.h）：请求在队列里等的时间一直超过目标值时，新请求由主线程直接回503，
+//不再排进去等到超时；队列满了也是一样。已经读了一半的请求照常排队
+//主线程只收发：一批应答发完后读缓冲区里剩下的请求、没收完的消息体也是重新排进线程池，不在主线程里解析和写文件
 
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int removefd(int epollfd, int fd);
@@ -52,43 +74,251 @@ void show_error(int connfd, const char* info)
     close(connfd);
 }
 
-int main(int argc, char* argv[])
+/*超时：每个线程（多reactor时是每个reactor线程，否则是主线程）一个11-5的时间轮，一格1秒，
+由epoll_wait的超时驱动，不用SIGALRM。连接只在它所属的线程里续期和删除定时器，所以时间轮不用加锁
+连接刚建立、或者空闲时收到新请求的数据，定请求超时；同一个请求后面再来的数据不续期，一点一点挤数据的客户端到点就断
+没有读了一半的请求时用空闲超时；应答没发完时每写出去一些续一次空闲超时，对方一直不收的也会到点断开*/
+static int idle_timeout = 60;
+static int request_timeout = 20;
+
+struct connection;
+struct conn_timer
+{
+    // 放在第一个，定时器回调拿到的client_data*就是conn_timer*
+    client_data data;
+    // 现在定的是请求超时还是空闲超时
+    bool request;
+    connection* owner;
+};
+
+/*一个连接在服务器这边的全部状态*/
+struct connection
+{
+    http_conn conn;
+    conn_timer timer;
+    // 连接所属线程的时间轮，只有这个线程动它的定时器
+    time_wheel* wheel;
+    // fd表占一个引用，在线程池里排队和处理时再占一个，都放掉了才还给slab池，工作线程不会碰到已经还掉的对象
+    std::atomic<int> refs;
+    // 进线程池队列的时间，微秒
+    long long queued_at;
+    // 线程池调用
+    void process();
+};
+
+static slab_pool<connection> conn_pool;
+static fd_table<connection> conns;
+static codel_admission admission;
+
+void put_connection(connection* c)
 {
-    if (argc <=2)
+    if (--c->refs == 0)
     {
-        printf("usage: %s ip port\n", argv[0]);
-        return 1;
+        conn_pool.free(c);
     }
+}
 
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-    /*忽略SIGPIPE信号 在向已经收到RST的socket执行写操作时，内核会向进程发送SIGPIPE信号，告知进程连接对端已关闭
-    SIGPIPE默认处理方式是终止进程 所以需要对SIGPIPE信号进行处理*/
-    addsig(SIGPIPE, SIG_IGN);
+void connection::process()
+{
+    admission.dequeued(now_us() - queued_at);
+    conn.process();
+    put_connection(this);
+}
 
-    /*创建线程池*/
-    threadpool<http_conn>* pool = NULL;
+/*连接关了以后由它所属的线程调用：删定时器，从fd表里摘掉，放掉fd表的引用
+fd可能已经被别的线程accept重用，那时槽里是新连接，clear不会动它*/
+void retire(connection* c)
+{
+    c->wheel->del_timer(c->timer.data.timer);
+    c->timer.data.timer = NULL;
+    conns.clear(c->timer.data.sockfd, c);
+    put_connection(c);
+}
+
+/*运行统计，收到SIGUSR1后由下一次tick打印*/
+static std::atomic<long> accepted(0);
+static std::atomic<long> accept_errors(0);
+static std::atomic<long> closed_idle(0);
+static std::atomic<long> closed_request(0);
+static std::atomic<long> closed_send(0);
+static std::atomic<int> stats_requested(0);
+
+void stats_handler(int)
+{
+    stats_requested = 1;
+}
+
+void print_stats()
+{
+    printf("accepted %ld, accept errors %ld, not found %ld\n", accepted.load(), accept_errors.load(),
+           http_conn::m_not_found.load());
+    printf("users %d, closed by timeout: idle %ld, request %ld, send %ld\n", http_conn::m_user_count.load(),
+           closed_idle.load(), closed_request.load(), closed_send.load());
+    printf("connections %d of %d slab slots, buffers %ld KB in use of %ld KB\n", conn_pool.in_use(),
+           conn_pool.capacity(), buffer_pool::instance()->in_use() / 1024, buffer_pool::instance()->reserved() / 1024);
+    printf("admitted %ld, shed by queue delay %ld, shed by full queue %ld%s\n", admission.admitted(),
+           admission.shed_delay(), admission.shed_full(), admission.overloaded() ? ", overloaded" : "");
+    fflush(stdout);
+}
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void arm_timer(connection* c, int timeout, bool request);
+
+/*定时器到期：按到期的是哪种超时记到对应的计数上（连上以后一直不发请求的算请求超时），然后关掉；定时器由tick自己删
+线程池模式下工作线程关掉的连接也是在这里（或者fd被重用时）还回去的*/
+void timeout_cb(client_data* data)
+{
+    data->timer = NULL;
+    connection* c = ((conn_timer*)data)->owner;
+    if (c->refs > 1)
+    {
+        /*连接在工作线程手里，主线程不能碰，过一秒再看*/
+        arm_timer(c, 1, c->timer.request);
+        return;
+    }
+    http_conn& conn = c->conn;
+    if (!conn.closed())
+    {
+        if (c->timer.request)
+        {
+            closed_request++;
+        }
+        else if (conn.sending())
+        {
+            closed_send++;
+        }
+        else
+        {
+            closed_idle++;
+        }
+        conn.close_conn();
+    }
+    retire(c);
+}
+
+/*给连接定一个timeout秒后到期的定时器，已经有了就挪过去，O(1)*/
+void arm_timer(connection* c, int timeout, bool request)
+{
+    conn_timer& t = c->timer;
+    t.request = request;
+    if (t.data.timer)
+    {
+        c->wheel->adjust_timer(t.data.timer, timeout);
+        return;
+    }
+    t.data.timer = c->wheel->add_timer(timeout);
+    t.data.timer->cb_func = timeout_cb;
+    t.data.timer->user_data = &t.data;
+}
+
+/*连接上的一次事件处理完以后，按连接现在的状态重定定时器；连接已经关了就还回去*/
+void update_timer(connection* c)
+{
+    http_conn& conn = c->conn;
+    if (conn.closed())
+    {
+        retire(c);
+        return;
+    }
+    bool request = !conn.sending() && conn.partial_request();
+    if (request && c->timer.request)
+    {
+        /*请求超时从收到这个请求的第一批数据算起*/
+        return;
+    }
+    arm_timer(c, request ? request_timeout : idle_timeout, request);
+}
+
+/*给新接受的连接取一个对象，登记到fd表，注册到epoll，定上请求超时*/
+void accept_conn(time_wheel& wheel, int connfd, const sockaddr_in& addr, int epollfd, bool one_shot)
+{
+    if (connfd >= fd_table<connection>::MAX_FDS)
+    {
+        show_error(connfd, "Internal Server busy");
+        return;
+    }
+    connection* c = NULL;
+    connection* old = NULL;
     try
     {
-        pool = new threadpool<http_conn>;
+        c = conn_pool.alloc();
+        c->refs = 1;
+        c->wheel = &wheel;
+        c->timer.data.sockfd = connfd;
+        c->timer.data.timer = NULL;
+        c->timer.request = false;
+        c->timer.owner = c;
+        old = conns.exchange(connfd, c);
     }
-    catch (...)
+    catch (const std::bad_alloc&)
     {
-        printf("new threadpoll failure\n");
-        return 1;
+        if (c)
+        {
+            conn_pool.free(c);
+        }
+        show_error(connfd, "Internal Server busy");
+        return;
+    }
+    /*fd上还挂着这个线程的旧对象，是线程池模式下工作线程关掉、还没等到超时的连接，现在还回去；
+    别的reactor线程的旧对象由那个线程自己还*/
+    if (old && old->wheel == &wheel)
+    {
+        retire(old);
     }
+    c->conn.init(connfd, addr, epollfd, one_shot);
+    arm_timer(c, request_timeout, true);
+}
 
-    /*预先为每个可能的客户连接分配一个http_conn对象*/
-    http_conn* users = new http_conn[MAX_FD];
-    assert(users);
-    int user_count = 0;
+/*到点的格子都tick掉，返回离下一次tick的毫秒数，给epoll_wait当超时*/
+int run_timers(time_wheel& wheel, long long& next_tick)
+{
+    long long now = now_ms();
+    while (now >= next_tick)
+    {
+        wheel.tick();
+        next_tick += 1000;
+    }
+    if (stats_requested.exchange(0))
+    {
+        print_stats();
+    }
+    return next_tick - now;
+}
+
+/*监听队列长度，内核会再截到net.core.somaxconn；原来是5，一波连接同时到的时候多出来的SYN直接被丢掉，客户端要等重传*/
+static int listen_backlog = SOMAXCONN;
+/*TCP_DEFER_ACCEPT的秒数，0是不开。开了以后三次握手完成、但对方还没发数据的连接留在内核里，
+请求的第一批数据到了才让accept拿到，只连不发的客户端不占连接对象和定时器*/
+static int defer_accept = 0;
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+/*创建监听socket，多reactor时每个线程一个，靠SO_REUSEPORT共用一个端口；加-x时只建一个，所有reactor共用
+监听socket是非阻塞的，ET模式下要accept到EAGAIN为止，多个线程共用时没抢到的那个也只是拿到EAGAIN*/
+int open_listenfd(const char* ip, int port, bool reuseport)
+{
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     assert(listenfd >= 0);
-    /*SO_LINGER决定close行为，具体看这里：https://blog.csdn.net/qq_20363225/article/details/122352713?spm=1001.2014.3001.5501*/
-    struct linger tmp = {1, 0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    /*SO_LINGER决定close行为，具体看这里：https://blog.csdn.net/qq_20363225/article/details/122352713?spm=1001.2014.3001.5501
+    原来这里设成{1, 0}，accept出来的socket会继承，close时直接发RST，发送缓冲区里还没发出去的响应尾巴会被丢掉，所以不再设置
+    正常关闭会在端口上留下TIME_WAIT，加上SO_REUSEADDR，重启服务器时才能马上bind*/
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuseport)
+    {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
 
     int ret = 0;
     struct sockaddr_in address;
@@ -99,18 +329,88 @@ int main(int argc, char* argv[])
 
     ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
     assert(ret != -1);
-    ret = listen(listenfd, 5);
+    if (defer_accept > 0)
+    {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+    }
+    ret = listen(listenfd, listen_backlog);
     assert(ret != -1);
+    return listenfd;
+}
 
-    epoll_event events[MAX_EVENT_NUMBER];
+/*把监听socket挂到epoll上。exclusive时带EPOLLEXCLUSIVE，同一个监听socket挂在几个epoll上时，一个新连接只叫醒其中一个，
+不会所有reactor一起醒来抢一个连接*/
+void add_listenfd(int epollfd, int listenfd, bool exclusive)
+{
+    epoll_event event;
+    event.data.fd = listenfd;
+    event.events = EPOLLIN | EPOLLET;
+    if (exclusive)
+    {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    /*挂不上的话这个线程永远接不到连接，不能只靠assert，NDEBUG下assert是空的*/
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event) == -1)
+    {
+        printf("add listen socket to epoll failure errno %d\n", errno);
+        exit(1);
+    }
+}
+
+/*监听socket是ET模式，一次事件要把已经完成的连接都取完，剩在队列里的要等下一个新连接到来才会再报事件
+accept4直接拿到非阻塞、exec时关闭的socket*/
+void accept_all(time_wheel& wheel, int listenfd, int epollfd, bool one_shot)
+{
+    while (1)
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlen = sizeof(client_address);
+        int connfd = accept4(listenfd, (struct sockaddr*)&client_address, &client_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                /*连接在队列里等的时候被对方重置了，接着取下一个*/
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                /*EMFILE之类，剩下的连接留在队列里，等下一个新连接再来取*/
+                accept_errors++;
+                printf("accept failure errnor %d\n", errno);
+            }
+            break;
+        }
+        accepted++;
+        accept_conn(wheel, connfd, client_address, epollfd, one_shot);
+    }
+}
+
+struct reactor_arg
+{
+    const char* ip;
+    int port;
+    // 共用的监听socket，-1表示每个线程自己建一个
+    int listenfd;
+};
+
+/*一个reactor线程：自己accept，自己读、解析、写，连接不离开这个线程*/
+void* reactor(void* arg)
+{
+    reactor_arg* rarg = (reactor_arg*)arg;
+    bool shared = rarg->listenfd >= 0;
+    int listenfd = shared ? rarg->listenfd : open_listenfd(rarg->ip, rarg->port, true);
+
+    epoll_event* events = new epoll_event[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    add_listenfd(epollfd, listenfd, shared);
+    time_wheel wheel;
+    long long next_tick = now_ms() + 1000;
 
     while (1)
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, run_timers(wheel, next_tick));
         if (number < 0 && errno != EINTR)
         {
             printf("epoll failure\n");
@@ -122,47 +422,264 @@ int main(int argc, char* argv[])
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd)
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(sockfd, (struct sockaddr*)&client_address, &client_addrlen);
-                if (connfd < 0)
+                accept_all(wheel, listenfd, epollfd, false);
+                continue;
+            }
+            connection* c = conns.get(sockfd);
+            if (!c)
+            {
+                continue;
+            }
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                c->conn.close_conn();
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                /*读完当场处理并写回，写不完的留给EPOLLOUT*/
+                if (c->conn.read())
                 {
-                    printf("accept failure errnor %d\n", errno);
-                    continue;
+                    c->conn.process(true);
                 }
-                if (http_conn::m_user_count >= MAX_FD)
+                else
                 {
-                    show_error(connfd, "Internal Server busy");
-                    continue;
+                    c->conn.close_conn();
+                }
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                if (!c->conn.write())
+                {
+                    c->conn.close_conn();
                 }
+            }
+            update_timer(c);
+        }
+    }
+
+    close(epollfd);
+    if (!shared)
+    {
+        close(listenfd);
+    }
+    delete[] events;
+    return NULL;
+}
+
+/*线程池模式下把连接交给线程池：新请求先过准入控制，过载或者队列满了就由主线程直接回503
+交之前定好定时器，之后这个连接归工作线程，直到它重新挂回epoll，主线程不再看它的状态
+任务自己占一个引用，定时器看到引用没放就知道连接还在工作线程手里*/
+void dispatch(threadpool<connection>* pool, connection* c, bool new_request)
+{
+    long long now = now_us();
+    if (new_request && !admission.admit(now))
+    {
+        c->conn.reject_overloaded();
+        update_timer(c);
+        return;
+    }
+    if (!new_request)
+    {
+        admission.enqueue();
+    }
+    update_timer(c);
+    c->refs++;
+    c->queued_at = now;
+    if (!pool->append(c))
+    {
+        /*队列满了，fd已经摘下来了，不回应答的话这个连接再也不会有事件*/
+        admission.queue_full();
+        put_connection(c);
+        c->conn.reject_overloaded();
+        update_timer(c);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    /*-r N：N个reactor线程，0表示每个CPU一个；不给-r时用原来的单reactor+线程池
+      -t N：单reactor模式下线程池的线程数
+      -c N：静态文件缓存的预算，单位MB
+      -k N：空闲连接的超时秒数
+      -q N：收一个请求的超时秒数，从收到这个请求的第一批数据算起
+      -u dir：接受PUT上传，文件写到dir下
+      -b N：请求体的上限，单位KB
+      -l N：监听队列长度
+      -d N：TCP_DEFER_ACCEPT，对方连上以后最多等N秒数据
+      -x：多reactor时共用一个监听socket，用EPOLLEXCLUSIVE分连接，代替SO_REUSEPORT
+      -w N：线程池队列的目标排队时间，单位毫秒，0表示只在队列满了时拒
+      -i N：准入控制看排队时间的周期，单位毫秒*/
+    int reactors = -1;
+    int threads = 8;
+    bool exclusive = false;
+    long long admission_target = 20;
+    long long admission_interval = 200;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:c:k:q:u:b:l:d:xw:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                reactors = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'c':
+                file_cache::instance()->set_budget((size_t)atoi(optarg) * 1024 * 1024);
+                break;
+            case 'k':
+                idle_timeout = atoi(optarg);
+                break;
+            case 'q':
+                request_timeout = atoi(optarg);
+                break;
+            case 'u':
+                http_conn::m_upload_root = optarg;
+                break;
+            case 'b':
+                http_conn::m_max_body = atoll(optarg) * 1024;
+                break;
+            case 'l':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'd':
+                defer_accept = atoi(optarg);
+                break;
+            case 'x':
+                exclusive = true;
+                break;
+            case 'w':
+                admission_target = atoll(optarg);
+                break;
+            case 'i':
+                admission_interval = atoll(optarg);
+                break;
+            default:
+                printf("usage: %s [-r reactors] [-t threads] [-c cache_mb] [-k idle_timeout] [-q request_timeout] [-u upload_dir] [-b max_body_kb] [-l backlog] [-d defer_accept] [-x] [-w queue_target_ms] [-i queue_interval_ms] ip port\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2)
+    {
+        printf("usage: %s [-r reactors] [-t threads] [-c cache_mb] [-k idle_timeout] [-q request_timeout] [-u upload_dir] [-b max_body_kb] [-l backlog] [-d defer_accept] [-x] [-w queue_target_ms] [-i queue_interval_ms] ip port\n", argv[0]);
+        return 1;
+    }
+
+    const char* ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    /*忽略SIGPIPE信号 在向已经收到RST的socket执行写操作时，内核会向进程发送SIGPIPE信号，告知进程连接对端已关闭
+    SIGPIPE默认处理方式是终止进程 所以需要对SIGPIPE信号进行处理*/
+    addsig(SIGPIPE, SIG_IGN);
+    /*kill -USR1打印运行统计*/
+    addsig(SIGUSR1, stats_handler);
+
+    if (reactors >= 0)
+    {
+        if (reactors == 0)
+        {
+            reactors = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        printf("%d reactors%s\n", reactors, exclusive ? ", shared listener" : "");
+        reactor_arg rarg = {ip, port, exclusive ? open_listenfd(ip, port, false) : -1};
+        pthread_t* tids = new pthread_t[reactors];
+        for (int i = 0; i < reactors; ++i)
+        {
+            if (pthread_create(tids + i, NULL, reactor, &rarg) != 0)
+            {
+                printf("create reactor failure\n");
+                return 1;
+            }
+        }
+        for (int i = 0; i < reactors; ++i)
+        {
+            pthread_join(tids[i], NULL);
+        }
+        delete[] tids;
+        return 0;
+    }
+
+    /*创建线程池*/
+    threadpool<connection>* pool = NULL;
+    try
+    {
+        pool = new threadpool<connection>(threads);
+    }
+    catch (...)
+    {
+        printf("new threadpoll failure\n");
+        return 1;
+    }
+
+    admission.configure(admission_target * 1000, admission_interval * 1000);
+    int listenfd = open_listenfd(ip, port, false);
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    int epollfd = epoll_create(5);
+    assert(epollfd != -1);
+    add_listenfd(epollfd, listenfd, false);
+    time_wheel wheel;
+    long long next_tick = now_ms() + 1000;
+
+    while (1)
+    {
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, run_timers(wheel, next_tick));
+        if (number < 0 && errno != EINTR)
+        {
+            printf("epoll failure\n");
+            break;
+        }
+
+        for (int i = 0; i < number; ++i)
+        {
+            int sockfd = events[i].data.fd;
+            if (sockfd == listenfd)
+            {
                 /*初始化客户链接*/
-                users[connfd].init(connfd, client_address);
+                accept_all(wheel, listenfd, epollfd, true);
+                continue;
             }
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            connection* c = conns.get(sockfd);
+            if (!c)
+            {
+                continue;
+            }
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
                 /*有异常，直接关闭客户端*/
-                users[sockfd].close_conn();
+                c->conn.close_conn();
+                update_timer(c);
             }
-            else if (events[i].events & EPOLLIN)
+            else if (events[i].events & EPOLLOUT)
             {
-                /*根据读的结果决定是将任务添加到线程池还是关闭连接*/
-                if (users[sockfd].read())
+                /*流水线上的请求多到读缓冲区放不下时，socket一直可读，EPOLLIN和EPOLLOUT会一起来，
+                要先写，否则一直在读和重新注册EPOLLOUT之间打转。write最后会modfd，没读的数据会再报EPOLLIN*/
+                /*根据写的结果，决定是否关闭连接*/
+                if (!c->conn.write())
                 {
-                    /*也可以这样写：&(uses[sockfd])*/
-                    //上面这样写不行，因为append里不仅往user数组里加东西了，还添加了信号量
-                    pool->append(users + sockfd);
+                    c->conn.close_conn();
                 }
-                else
+                else if (c->conn.needs_processing())
                 {
-                    users[sockfd].close_conn();
+                    /*应答发完了，流水线上还有请求或者消息体还没收完，write没有rearm，连接交回线程池*/
+                    dispatch(pool, c, c->conn.between_requests());
+                    continue;
                 }
+                update_timer(c);
             }
-            else if (events[i].events & EPOLLOUT)
+            else if (events[i].events & EPOLLIN)
             {
-                /*根据写的结果，决定是否关闭连接*/
-                if (!users[sockfd].write())
+                /*根据读的结果决定是将任务添加到线程池还是关闭连接*/
+                bool new_request = c->conn.between_requests();
+                if (c->conn.read())
+                {
+                    dispatch(pool, c, new_request);
+                }
+                else
                 {
-                    users[sockfd].close_conn();
+                    c->conn.close_conn();
+                    update_timer(c);
                 }
             }
         }
@@ -170,7 +687,6 @@ int main(int argc, char* argv[])
 
     close(epollfd);
     close(listenfd);
-    delete[] users;
     delete pool;
     return 0;
 }
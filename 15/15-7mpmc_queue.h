@@ -0,0 +1,186 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+//有界无锁多生产者多消费者队列（Dmitry Vyukov 的环形队列）
+//每个槽位带一个序号：序号等于入队位置时可写，等于入队位置+1时可读，
+//生产者和消费者各自只用一次 CAS 抢位置，不加锁，也不在入队时分配内存
+template< typename T >
+class mpmc_queue
+{
+public:
+    //容量向上取整为 2 的幂
+    explicit mpmc_queue( size_t capacity );
+    ~mpmc_queue();
+    //队列满时返回 false
+    bool push( const T& data );
+    //队列空时返回 false
+    bool pop( T& data );
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell
+    {
+        std::atomic< size_t > m_sequence;
+        T m_data;
+    };
+    static const size_t CACHELINE = 64;
+
+    //入队、出队位置各占一个缓存行，避免生产者和消费者互相踩缓存行
+    char m_pad0[ CACHELINE ];
+    cell* m_buffer;
+    size_t m_mask;
+    char m_pad1[ CACHELINE - sizeof( cell* ) - sizeof( size_t ) ];
+    std::atomic< size_t > m_enqueue_pos;
+    char m_pad2[ CACHELINE - sizeof( std::atomic< size_t > ) ];
+    std::atomic< size_t > m_dequeue_pos;
+    char m_pad3[ CACHELINE - sizeof( std::atomic< size_t > ) ];
+};
+
+template< typename T >
+mpmc_queue< T >::mpmc_queue( size_t capacity ) : m_buffer( NULL ), m_mask( 0 )
+{
+    if( capacity < 2 )
+    {
+        capacity = 2;
+    }
+    size_t size = 1;
+    while( size < capacity )
+    {
+        size <<= 1;
+    }
+    m_buffer = new cell[ size ];
+    m_mask = size - 1;
+    for( size_t i = 0; i < size; ++i )
+    {
+        m_buffer[i].m_sequence.store( i, std::memory_order_relaxed );
+    }
+    m_enqueue_pos.store( 0, std::memory_order_relaxed );
+    m_dequeue_pos.store( 0, std::memory_order_relaxed );
+}
+
+template< typename T >
+mpmc_queue< T >::~mpmc_queue()
+{
+    delete [] m_buffer;
+}
+
+template< typename T >
+bool mpmc_queue< T >::push( const T& data )
+{
+    cell* target;
+    size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+    while( true )
+    {
+        target = &m_buffer[ pos & m_mask ];
+        size_t seq = target->m_sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )pos;
+        if( diff == 0 )
+        {
+            if( m_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            {
+                break;
+            }
+        }
+        else if( diff < 0 )
+        {
+            //槽位还没被消费，队列满了
+            return false;
+        }
+        else
+        {
+            pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    target->m_data = data;
+    target->m_sequence.store( pos + 1, std::memory_order_release );
+    return true;
+}
+
+template< typename T >
+bool mpmc_queue< T >::pop( T& data )
+{
+    cell* target;
+    size_t pos = m_dequeue_pos.load( std::memory_order_relaxed );
+    while( true )
+    {
+        target = &m_buffer[ pos & m_mask ];
+        size_t seq = target->m_sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )( pos + 1 );
+        if( diff == 0 )
+        {
+            if( m_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            {
+                break;
+            }
+        }
+        else if( diff < 0 )
+        {
+            //槽位还没被写入，队列空了
+            return false;
+        }
+        else
+        {
+            pos = m_dequeue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    data = target->m_data;
+    //槽位留给下一圈的生产者
+    target->m_sequence.store( pos + m_mask + 1, std::memory_order_release );
+    return true;
+}
+
+//空闲线程的停车场：只有真的没活干时才进入 futex 等待，有活时生产者不进内核
+//用法：seq = prepare(); 再检查一次队列；有活就 cancel()，没活就 wait( seq )
+class futex_parker
+{
+public:
+    futex_parker()
+    {
+        m_seq.store( 0 );
+        m_sleepers.store( 0 );
+    }
+    int prepare()
+    {
+        m_sleepers.fetch_add( 1 );
+        return m_seq.load();
+    }
+    void cancel()
+    {
+        m_sleepers.fetch_sub( 1 );
+    }
+    void wait( int seq )
+    {
+        //期间有人 notify 过，m_seq 已经变了，futex 直接返回，不会丢唤醒
+        syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0 );
+        m_sleepers.fetch_sub( 1 );
+    }
+    //生产者入队之后调用，没有人在睡时只有一次原子读
+    void notify_one()
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_sleepers.load( std::memory_order_relaxed ) > 0 )
+        {
+            m_seq.fetch_add( 1 );
+            syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+        }
+    }
+    void notify_all()
+    {
+        m_seq.fetch_add( 1 );
+        syscall( SYS_futex, ( int* )&m_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+    }
+
+private:
+    std::atomic< int > m_seq;
+    std::atomic< int > m_sleepers;
+};
+
+#endif
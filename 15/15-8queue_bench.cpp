@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <list>
+#include <atomic>
+#include "14-2locker.h"
+#include "15-7mpmc_queue.h"
+
+//线程池任务队列的微基准：原来的 std::list + 互斥锁 + 信号量，对比无锁环形队列 + futex 停车
+//pairs：每个线程先入队再出队，看队列本身的吞吐
+//fanout：一个线程入队（相当于主线程 append），其余线程出队（相当于工作线程），1 个线程时同 pairs
+
+//原 threadpool 的做法，原样搬过来当基准
+class locked_queue
+{
+public:
+    bool push( int* data )
+    {
+        m_locker.lock();
+        m_list.push_back( data );
+        m_locker.unlock();
+        m_stat.post();
+        return true;
+    }
+    int* pop()
+    {
+        m_stat.wait();
+        m_locker.lock();
+        int* data = m_list.front();
+        m_list.pop_front();
+        m_locker.unlock();
+        return data;
+    }
+
+private:
+    std::list< int* > m_list;
+    locker m_locker;
+    sem m_stat;
+};
+
+//threadpool::run 里的取任务方式：先自旋，再在 futex 上睡
+class lockfree_queue
+{
+public:
+    lockfree_queue() : m_queue( 65536 ) {}
+    bool push( int* data )
+    {
+        while( !m_queue.push( data ) )
+        {
+            sched_yield();
+        }
+        m_parker.notify_one();
+        return true;
+    }
+    int* pop()
+    {
+        int* data = NULL;
+        int idle = 0;
+        while( !m_queue.pop( data ) )
+        {
+            if( ++idle < 64 )
+            {
+                continue;
+            }
+            int seq = m_parker.prepare();
+            if( m_queue.pop( data ) )
+            {
+                m_parker.cancel();
+                break;
+            }
+            m_parker.wait( seq );
+            idle = 0;
+        }
+        return data;
+    }
+
+private:
+    mpmc_queue< int* > m_queue;
+    futex_parker m_parker;
+};
+
+static int g_item;
+static std::atomic< int > g_ready;
+static volatile bool g_go;
+
+template< typename Q >
+struct bench_arg
+{
+    Q* queue;
+    long pushes;
+    long pops;
+};
+
+template< typename Q >
+static void* pairs_worker( void* arg )
+{
+    bench_arg< Q >* a = ( bench_arg< Q >* )arg;
+    g_ready++;
+    while( !g_go )
+    {
+    }
+    for( long i = 0; i < a->pushes; ++i )
+    {
+        a->queue->push( &g_item );
+        a->queue->pop();
+    }
+    return NULL;
+}
+
+template< typename Q >
+static void* fanout_worker( void* arg )
+{
+    bench_arg< Q >* a = ( bench_arg< Q >* )arg;
+    g_ready++;
+    while( !g_go )
+    {
+    }
+    for( long i = 0; i < a->pushes; ++i )
+    {
+        a->queue->push( &g_item );
+    }
+    for( long i = 0; i < a->pops; ++i )
+    {
+        a->queue->pop();
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//返回每秒完成的入队+出队次数（百万）
+template< typename Q >
+static double run( int threads, bool fanout, long total )
+{
+    Q queue;
+    pthread_t* tids = new pthread_t[ threads ];
+    bench_arg< Q >* args = new bench_arg< Q >[ threads ];
+    g_ready = 0;
+    g_go = false;
+    for( int i = 0; i < threads; ++i )
+    {
+        args[i].queue = &queue;
+        if( !fanout || threads == 1 )
+        {
+            args[i].pushes = total / threads;
+            args[i].pops = 0;
+        }
+        else
+        {
+            //0 号线程只管入队，其余线程平分出队
+            args[i].pushes = ( i == 0 ) ? total - total % ( threads - 1 ) : 0;
+            args[i].pops = ( i == 0 ) ? 0 : total / ( threads - 1 );
+        }
+        pthread_create( tids + i, NULL, ( fanout && threads > 1 ) ? fanout_worker< Q > : pairs_worker< Q >, args + i );
+    }
+    while( g_ready < threads )
+    {
+    }
+    double start = now();
+    g_go = true;
+    for( int i = 0; i < threads; ++i )
+    {
+        pthread_join( tids[i], NULL );
+    }
+    double elapsed = now() - start;
+    long done = 0;
+    for( int i = 0; i < threads; ++i )
+    {
+        done += ( fanout && threads > 1 ) ? args[i].pops : args[i].pushes;
+    }
+    delete [] tids;
+    delete [] args;
+    return 2.0 * done / elapsed / 1e6;
+}
+
+int main( int argc, char* argv[] )
+{
+    long total = ( argc > 1 ) ? atol( argv[1] ) : 1000000;
+    int counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const char* names[] = { "pairs", "fanout" };
+    for( int mode = 0; mode < 2; ++mode )
+    {
+        printf( "%s, %ld items, Mops/s (push+pop)\n", names[mode], total );
+        printf( "%8s %14s %14s %8s\n", "threads", "list+mutex", "mpmc+futex", "speedup" );
+        for( size_t i = 0; i < sizeof( counts ) / sizeof( counts[0] ); ++i )
+        {
+            double locked = run< locked_queue >( counts[i], mode == 1, total );
+            double lockfree = run< lockfree_queue >( counts[i], mode == 1, total );
+            printf( "%8d %14.2f %14.2f %7.2fx\n", counts[i], locked, lockfree, lockfree / locked );
+        }
+        printf( "\n" );
+    }
+    return 0;
+}
@@ -0,0 +1,231 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <atomic>
+#include <vector>
+#include "15-7mpmc_queue.h"
+
+//Chase-Lev 双端队列（按 Lê 等人给弱内存模型的版本）
+//只有所属线程在底部 push/take（后进先出，缓存热），其他线程从顶部 steal（先进先出，偷最老的）
+//容量固定，满了 push 返回 false，由调用者另找地方放
+template< typename T >
+class chase_lev_deque
+{
+public:
+    explicit chase_lev_deque( long capacity );
+    ~chase_lev_deque();
+    bool push( T* data );
+    T* take();
+    T* steal();
+
+private:
+    static const int CACHELINE = 64;
+    std::atomic< long > m_top;
+    char m_pad0[ CACHELINE - sizeof( std::atomic< long > ) ];
+    std::atomic< long > m_bottom;
+    char m_pad1[ CACHELINE - sizeof( std::atomic< long > ) ];
+    std::atomic< T* >* m_buffer;
+    long m_mask;
+};
+
+template< typename T >
+chase_lev_deque< T >::chase_lev_deque( long capacity ) : m_buffer( NULL ), m_mask( 0 )
+{
+    long size = 2;
+    while( size < capacity )
+    {
+        size <<= 1;
+    }
+    m_buffer = new std::atomic< T* >[ size ];
+    m_mask = size - 1;
+    m_top.store( 0, std::memory_order_relaxed );
+    m_bottom.store( 0, std::memory_order_relaxed );
+}
+
+template< typename T >
+chase_lev_deque< T >::~chase_lev_deque()
+{
+    delete [] m_buffer;
+}
+
+template< typename T >
+bool chase_lev_deque< T >::push( T* data )
+{
+    long b = m_bottom.load( std::memory_order_relaxed );
+    long t = m_top.load( std::memory_order_acquire );
+    if( b - t > m_mask )
+    {
+        return false;
+    }
+    m_buffer[ b & m_mask ].store( data, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    m_bottom.store( b + 1, std::memory_order_relaxed );
+    return true;
+}
+
+template< typename T >
+T* chase_lev_deque< T >::take()
+{
+    long b = m_bottom.load( std::memory_order_relaxed ) - 1;
+    m_bottom.store( b, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    long t = m_top.load( std::memory_order_relaxed );
+    if( t > b )
+    {
+        //空的
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+        return NULL;
+    }
+    T* data = m_buffer[ b & m_mask ].load( std::memory_order_relaxed );
+    if( t == b )
+    {
+        //只剩最后一个，和小偷抢
+        if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+        {
+            data = NULL;
+        }
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+    }
+    return data;
+}
+
+template< typename T >
+T* chase_lev_deque< T >::steal()
+{
+    long t = m_top.load( std::memory_order_acquire );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    long b = m_bottom.load( std::memory_order_acquire );
+    if( t >= b )
+    {
+        return NULL;
+    }
+    T* data = m_buffer[ t & m_mask ].load( std::memory_order_relaxed );
+    if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+    {
+        //被别人抢先了，下次再偷
+        return NULL;
+    }
+    return data;
+}
+
+//工作窃取策略：每个工作线程一个 Chase-Lev 队列，外加一个收件箱
+//主线程（I/O 线程）不是任何队列的主人，不能往 Chase-Lev 队列里放，只能轮流或按 key 投进各线程的收件箱；
+//工作线程里 append 的后续任务进自己的队列；自己没活时先看收件箱，再随机挑一个线程偷
+template< typename T >
+class work_stealing
+{
+public:
+    work_stealing( int thread_number, int max_requests );
+    ~work_stealing();
+    bool submit( T* request, int hint );
+    bool push_local( int idx, T* request );
+    T* take( int idx );
+
+private:
+    int m_thread_number;
+    std::vector< chase_lev_deque< T >* > m_deques;
+    std::vector< mpmc_queue< T* >* > m_inboxes;
+    std::atomic< unsigned int > m_next;
+    //每个工作线程自己的随机数状态，只有它自己改；没活时每次偷都要改一下，各占一个缓存行，空转的线程不互相踩
+    static const size_t CACHELINE = 64;
+    struct seed_slot
+    {
+        unsigned int m_value;
+        char m_pad[ CACHELINE - sizeof( unsigned int ) ];
+    };
+    std::vector< seed_slot > m_seeds;
+};
+
+template< typename T >
+work_stealing< T >::work_stealing( int thread_number, int max_requests ) : m_thread_number( thread_number )
+{
+    int per_worker = max_requests / thread_number;
+    if( per_worker < 64 )
+    {
+        per_worker = 64;
+    }
+    for( int i = 0; i < thread_number; ++i )
+    {
+        m_deques.push_back( new chase_lev_deque< T >( per_worker ) );
+        m_inboxes.push_back( new mpmc_queue< T* >( per_worker ) );
+        seed_slot seed;
+        seed.m_value = 2654435761u * ( i + 1 );
+        m_seeds.push_back( seed );
+    }
+    m_next.store( 0 );
+}
+
+template< typename T >
+work_stealing< T >::~work_stealing()
+{
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        delete m_deques[i];
+        delete m_inboxes[i];
+    }
+}
+
+template< typename T >
+bool work_stealing< T >::submit( T* request, int hint )
+{
+    if( hint >= 0 && m_inboxes[ hint ]->push( request ) )
+    {
+        return true;
+    }
+    //轮流投递，某个收件箱满了就往后找；指定的收件箱满了也走这里，key 分布不均时不至于线程池还有空位就拒
+    unsigned int start = m_next.fetch_add( 1, std::memory_order_relaxed );
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        if( m_inboxes[ ( start + i ) % m_thread_number ]->push( request ) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+template< typename T >
+bool work_stealing< T >::push_local( int idx, T* request )
+{
+    return m_deques[ idx ]->push( request ) || m_inboxes[ idx ]->push( request );
+}
+
+template< typename T >
+T* work_stealing< T >::take( int idx )
+{
+    T* request = m_deques[ idx ]->take();
+    if( request )
+    {
+        return request;
+    }
+    if( m_inboxes[ idx ]->pop( request ) )
+    {
+        return request;
+    }
+    if( m_thread_number == 1 )
+    {
+        return NULL;
+    }
+    //从随机一个线程开始，把其他线程都看一遍：先偷它的队列，再拿它收件箱里积压的
+    unsigned int& seed = m_seeds[ idx ].m_value;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int start = seed % m_thread_number;
+    for( int i = 0; i < m_thread_number; ++i )
+    {
+        int victim = ( start + i ) % m_thread_number;
+        if( victim == idx )
+        {
+            continue;
+        }
+        request = m_deques[ victim ]->steal();
+        if( request || m_inboxes[ victim ]->pop( request ) )
+        {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,482 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "cache.h"
+#include "log.h"
+
+static uint64_t fnv_hash( uint64_t hash, const char* data, int len )
+{
+    for( int i = 0; i < len; ++i )
+    {
+        hash = ( hash ^ ( unsigned char )data[i] ) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool header_is( const char* line, int name_len, const char* name )
+{
+    return name_len == strlen( name ) && strncasecmp( line, name, name_len ) == 0;
+}
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT", the only format a sender may generate */
+static time_t parse_http_date( const char* value, int len )
+{
+    char date[64];
+    if( len >= sizeof( date ) )
+    {
+        return -1;
+    }
+    memcpy( date, value, len );
+    date[len] = '\0';
+    struct tm tm;
+    memset( &tm, 0, sizeof( tm ) );
+    if( !strptime( date, "%a, %d %b %Y %H:%M:%S GMT", &tm ) )
+    {
+        return -1;
+    }
+    return timegm( &tm );
+}
+
+/* value of "name=N" in a Cache-Control header, -1 if absent */
+static long directive_value( const char* value, int len, const char* name )
+{
+    int name_len = strlen( name );
+    for( int i = 0; i + name_len < len; ++i )
+    {
+        if( strncasecmp( value + i, name, name_len ) == 0 && value[i + name_len] == '='
+            && ( i == 0 || value[i - 1] == ' ' || value[i - 1] == ',' ) )
+        {
+            return atol( value + i + name_len + 1 );
+        }
+    }
+    return -1;
+}
+
+static bool has_directive( const char* value, int len, const char* name )
+{
+    int name_len = strlen( name );
+    for( int i = 0; i + name_len <= len; ++i )
+    {
+        if( strncasecmp( value + i, name, name_len ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+cache_fill::cache_fill( const string& key, uint64_t hash, int max_object )
+    : m_key( key ), m_hash( hash ), m_max_object( max_object ), m_head_len( 0 ), m_body_read( 0 ), m_entry( new cache_entry )
+{
+    m_entry->m_key = key;
+    m_entry->m_hash = hash;
+    m_entry->m_header_len = -1;
+}
+
+cache_fill::~cache_fill()
+{
+    delete m_entry;
+}
+
+cache_entry* cache_fill::take_entry()
+{
+    cache_entry* entry = m_entry;
+    m_entry = NULL;
+    return entry;
+}
+
+/* returns the length of the head, 0 if the response can not be stored */
+int cache_fill::parse_head()
+{
+    const char* end = ( const char* )memmem( m_head, m_head_len, "\r\n\r\n", 4 );
+    int head_len = end - m_head + 4;
+    if( head_len < 13 || strncmp( m_head, "HTTP/1.", 7 ) != 0 || strncmp( m_head + 8, " 200", 4 ) != 0 )
+    {
+        return 0;
+    }
+
+    time_t now = time( NULL );
+    long content_length = -1;
+    long max_age = -1;
+    time_t expires = -1;
+    time_t date = -1;
+    bool no_cache = false;
+    /* the header fields worth keeping, hop-by-hop ones are written per client */
+    char* stored = new char[ head_len ];
+    int stored_len = 0;
+    const char* line = m_head;
+    while( line < end + 2 )
+    {
+        const char* eol = ( const char* )memmem( line, end + 2 - line, "\r\n", 2 );
+        int line_len = eol - line;
+        const char* colon = ( const char* )memchr( line, ':', line_len );
+        bool keep = true;
+        if( colon )
+        {
+            int name_len = colon - line;
+            const char* value = colon + 1;
+            int value_len = eol - value;
+            while( value_len > 0 && *value == ' ' )
+            {
+                value++;
+                value_len--;
+            }
+            if( header_is( line, name_len, "Content-Length" ) )
+            {
+                content_length = atol( value );
+            }
+            else if( header_is( line, name_len, "Transfer-Encoding" ) || header_is( line, name_len, "Set-Cookie" )
+                     || ( header_is( line, name_len, "Vary" ) && value_len > 0 ) )
+            {
+                content_length = -2;
+            }
+            else if( header_is( line, name_len, "Cache-Control" ) )
+            {
+                if( has_directive( value, value_len, "no-store" ) || has_directive( value, value_len, "private" ) )
+                {
+                    content_length = -2;
+                }
+                no_cache = no_cache || has_directive( value, value_len, "no-cache" );
+                long s_maxage = directive_value( value, value_len, "s-maxage" );
+                max_age = s_maxage >= 0 ? s_maxage : directive_value( value, value_len, "max-age" );
+            }
+            else if( header_is( line, name_len, "Expires" ) )
+            {
+                /* an invalid date means already expired */
+                expires = parse_http_date( value, value_len );
+                expires = expires < 0 ? 0 : expires;
+            }
+            else if( header_is( line, name_len, "Date" ) )
+            {
+                date = parse_http_date( value, value_len );
+            }
+            else if( header_is( line, name_len, "Connection" ) || header_is( line, name_len, "Keep-Alive" )
+                     || header_is( line, name_len, "Age" ) )
+            {
+                keep = false;
+            }
+        }
+        if( content_length == -2 )
+        {
+            break;
+        }
+        if( keep )
+        {
+            memcpy( stored + stored_len, line, line_len + 2 );
+            stored_len += line_len + 2;
+        }
+        line = eol + 2;
+    }
+
+    /* a response without freshness is still shared with the requests that waited for it, but not stored */
+    long lifetime = 0;
+    if( !no_cache && max_age >= 0 )
+    {
+        lifetime = max_age;
+    }
+    else if( !no_cache && expires >= 0 )
+    {
+        lifetime = expires - ( date >= 0 ? date : now );
+    }
+    if( content_length < 0 || stored_len + content_length > m_max_object )
+    {
+        delete [] stored;
+        return 0;
+    }
+
+    m_entry->m_data = new char[ stored_len + content_length ];
+    memcpy( m_entry->m_data, stored, stored_len );
+    delete [] stored;
+    m_entry->m_header_len = stored_len;
+    m_entry->m_body_len = content_length;
+    m_entry->m_stored = now;
+    m_entry->m_expires = now + ( lifetime > 0 ? lifetime : 0 );
+    return head_len;
+}
+
+int cache_fill::feed( const char* data, int len )
+{
+    if( !m_entry )
+    {
+        return FILL_ABORT;
+    }
+    if( m_entry->m_header_len < 0 )
+    {
+        int copy = ( len < MAX_HEAD - m_head_len ) ? len : MAX_HEAD - m_head_len;
+        int search_from = m_head_len > 3 ? m_head_len - 3 : 0;
+        memcpy( m_head + m_head_len, data, copy );
+        m_head_len += copy;
+        if( !memmem( m_head + search_from, m_head_len - search_from, "\r\n\r\n", 4 ) )
+        {
+            return m_head_len < MAX_HEAD ? FILL_MORE : FILL_ABORT;
+        }
+        int head_len = parse_head();
+        if( head_len == 0 )
+        {
+            return FILL_ABORT;
+        }
+        /* whatever followed the head in this chunk is body */
+        int consumed = head_len - ( m_head_len - copy );
+        data += consumed;
+        len -= consumed;
+    }
+
+    int body_left = m_entry->m_body_len - m_body_read;
+    int copy = len < body_left ? len : body_left;
+    memcpy( m_entry->m_data + m_entry->m_header_len + m_body_read, data, copy );
+    m_body_read += copy;
+    return ( m_body_read == m_entry->m_body_len ) ? FILL_DONE : FILL_MORE;
+}
+
+cache::cache( int mem_bytes, int max_object, bool coalesce, char* slots, int slot_count, int slot_size )
+    : m_hits( 0 ), m_shared_hits( 0 ), m_misses( 0 ), m_stores( 0 ), m_evictions( 0 ),
+      m_mem_bytes( mem_bytes ), m_used_bytes( 0 ), m_max_object( max_object ), m_coalesce( coalesce ),
+      m_slots( slots ), m_slot_count( slot_count ), m_slot_size( slot_size )
+{
+    m_lru.m_prev = m_lru.m_next = &m_lru;
+}
+
+cache* cache::create( int mem_bytes, int shared_bytes, int shared_slots, int max_object, bool coalesce )
+{
+    char* slots = NULL;
+    int slot_size = 0;
+    if( shared_bytes > 0 && shared_slots > 0 )
+    {
+        slot_size = ( shared_bytes / shared_slots ) & ~63;
+        if( slot_size <= sizeof( shm_slot ) )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "%s", "shared cache slots are too small" );
+            return NULL;
+        }
+        void* mem = mmap( NULL, ( long )slot_size * shared_slots, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        if( mem == MAP_FAILED )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "%s", "map the shared cache failed" );
+            return NULL;
+        }
+        slots = ( char* )mem;
+    }
+    else
+    {
+        shared_slots = 0;
+    }
+    return new cache( mem_bytes, max_object, coalesce, slots, shared_slots, slot_size );
+}
+
+bool cache::request_key( const http_head& head, string* key, uint64_t* hash )
+{
+    if( head.m_method_len != 3 || strncmp( head.m_method, "GET", 3 ) != 0 || head.m_has_body || head.m_no_cache )
+    {
+        return false;
+    }
+    key->assign( head.m_method, head.m_method_len );
+    key->push_back( ' ' );
+    for( int i = 0; i < head.m_host_len; ++i )
+    {
+        key->push_back( tolower( head.m_host[i] ) );
+    }
+    key->append( head.m_path, head.m_path_len );
+    *hash = fnv_hash( 14695981039346656037ull, key->data(), key->size() );
+    return true;
+}
+
+void cache::unlink( cache_entry* entry )
+{
+    entry->m_prev->m_next = entry->m_next;
+    entry->m_next->m_prev = entry->m_prev;
+    entry->m_prev = entry->m_next = NULL;
+    m_index.erase( entry->m_hash );
+    m_used_bytes -= entry->m_header_len + entry->m_body_len + entry->m_key.size();
+}
+
+void cache::push_front( cache_entry* entry )
+{
+    entry->m_next = m_lru.m_next;
+    entry->m_prev = &m_lru;
+    m_lru.m_next->m_prev = entry;
+    m_lru.m_next = entry;
+}
+
+void cache::release( cache_entry* entry )
+{
+    if( entry && --entry->m_refs == 0 )
+    {
+        delete entry;
+    }
+}
+
+void cache::evict( long need )
+{
+    while( m_used_bytes + need > m_mem_bytes && m_lru.m_prev != &m_lru )
+    {
+        cache_entry* victim = m_lru.m_prev;
+        unlink( victim );
+        release( victim );
+        m_evictions++;
+    }
+}
+
+cache_entry* cache::lookup( const string& key, uint64_t hash )
+{
+    time_t now = time( NULL );
+    map< uint64_t, cache_entry* >::iterator iter = m_index.find( hash );
+    if( iter != m_index.end() )
+    {
+        cache_entry* entry = iter->second;
+        if( entry->m_key == key && entry->m_expires > now )
+        {
+            entry->m_prev->m_next = entry->m_next;
+            entry->m_next->m_prev = entry->m_prev;
+            push_front( entry );
+            entry->m_refs++;
+            m_hits++;
+            return entry;
+        }
+        if( entry->m_expires <= now )
+        {
+            unlink( entry );
+            release( entry );
+        }
+    }
+
+    cache_entry* entry = shared_lookup( key, hash, now );
+    if( entry )
+    {
+        /* keep a copy here, the shared slot may be reused while we are still sending */
+        m_shared_hits++;
+        entry->m_refs++;
+        insert_local( entry );
+        return entry;
+    }
+    m_misses++;
+    return NULL;
+}
+
+void cache::insert( cache_entry* entry )
+{
+    m_stores++;
+    shared_insert( entry, time( NULL ) );
+    insert_local( entry );
+}
+
+void cache::insert_local( cache_entry* entry )
+{
+    long size = entry->m_header_len + entry->m_body_len + entry->m_key.size();
+    map< uint64_t, cache_entry* >::iterator iter = m_index.find( entry->m_hash );
+    if( iter != m_index.end() )
+    {
+        cache_entry* old = iter->second;
+        unlink( old );
+        release( old );
+    }
+    if( size > m_mem_bytes )
+    {
+        release( entry );
+        return;
+    }
+    evict( size );
+    push_front( entry );
+    m_index[ entry->m_hash ] = entry;
+    m_used_bytes += size;
+}
+
+void cache::lock( shm_slot* slot )
+{
+    while( __sync_lock_test_and_set( &slot->m_lock, 1 ) )
+    {
+        while( slot->m_lock )
+        {
+        }
+    }
+}
+
+void cache::unlock( shm_slot* slot )
+{
+    __sync_lock_release( &slot->m_lock );
+}
+
+cache_entry* cache::shared_lookup( const string& key, uint64_t hash, time_t now )
+{
+    for( int i = 0; i < MAX_PROBE && i < m_slot_count; ++i )
+    {
+        shm_slot* slot = slot_at( ( hash + i ) % m_slot_count );
+        if( !slot->m_used || slot->m_hash != hash )
+        {
+            continue;
+        }
+        lock( slot );
+        char* data = ( char* )( slot + 1 );
+        if( slot->m_used && slot->m_hash == hash && slot->m_key_len == key.size() && slot->m_expires > now
+            && memcmp( data, key.data(), key.size() ) == 0 )
+        {
+            cache_entry* entry = new cache_entry;
+            entry->m_hash = hash;
+            entry->m_key = key;
+            entry->m_header_len = slot->m_header_len;
+            entry->m_body_len = slot->m_body_len;
+            entry->m_stored = slot->m_stored;
+            entry->m_expires = slot->m_expires;
+            entry->m_data = new char[ slot->m_header_len + slot->m_body_len ];
+            memcpy( entry->m_data, data + slot->m_key_len, slot->m_header_len + slot->m_body_len );
+            slot->m_clock = 1;
+            unlock( slot );
+            return entry;
+        }
+        unlock( slot );
+    }
+    return NULL;
+}
+
+void cache::shared_insert( const cache_entry* entry, time_t now )
+{
+    long size = entry->m_key.size() + entry->m_header_len + entry->m_body_len;
+    if( m_slot_count == 0 || size > m_slot_size - sizeof( shm_slot ) )
+    {
+        return;
+    }
+
+    /* a free, expired or same key slot in the probe window, else the first one CLOCK lets go of */
+    shm_slot* victim = NULL;
+    for( int i = 0; i < MAX_PROBE && i < m_slot_count && !victim; ++i )
+    {
+        shm_slot* slot = slot_at( ( entry->m_hash + i ) % m_slot_count );
+        if( !slot->m_used || slot->m_expires <= now || slot->m_hash == entry->m_hash )
+        {
+            victim = slot;
+        }
+    }
+    for( int round = 0; round < 2 && !victim; ++round )
+    {
+        for( int i = 0; i < MAX_PROBE && i < m_slot_count && !victim; ++i )
+        {
+            shm_slot* slot = slot_at( ( entry->m_hash + i ) % m_slot_count );
+            if( slot->m_clock )
+            {
+                slot->m_clock = 0;
+            }
+            else
+            {
+                victim = slot;
+            }
+        }
+    }
+    if( !victim )
+    {
+        victim = slot_at( entry->m_hash % m_slot_count );
+    }
+
+    lock( victim );
+    char* data = ( char* )( victim + 1 );
+    victim->m_used = 1;
+    victim->m_clock = 0;
+    victim->m_hash = entry->m_hash;
+    victim->m_key_len = entry->m_key.size();
+    victim->m_header_len = entry->m_header_len;
+    victim->m_body_len = entry->m_body_len;
+    victim->m_stored = entry->m_stored;
+    victim->m_expires = entry->m_expires;
+    memcpy( data, entry->m_key.data(), entry->m_key.size() );
+    memcpy( data + entry->m_key.size(), entry->m_data, entry->m_header_len + entry->m_body_len );
+    unlock( victim );
+}
@@ -0,0 +1,133 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include "http_head.h"
+
+using std::map;
+using std::string;
+
+/* one complete 200 response, refcounted so it can be written to several clients while it is evicted */
+class cache_entry
+{
+public:
+    cache_entry() : m_hash( 0 ), m_data( NULL ), m_header_len( 0 ), m_body_len( 0 ), m_stored( 0 ), m_expires( 0 ),
+                    m_refs( 1 ), m_prev( NULL ), m_next( NULL ) {}
+    ~cache_entry() { delete [] m_data; }
+    /* fresh when it was received, otherwise it may only answer requests that were already waiting */
+    bool storable() const { return m_expires > m_stored; }
+
+public:
+    uint64_t m_hash;
+    string m_key;
+    /* status line and header fields without the empty line, then the body */
+    char* m_data;
+    int m_header_len;
+    int m_body_len;
+    time_t m_stored;
+    time_t m_expires;
+    int m_refs;
+    cache_entry* m_prev;
+    cache_entry* m_next;
+};
+
+/* collects a server response and decides whether it may be shared and stored */
+class cache_fill
+{
+public:
+    cache_fill( const string& key, uint64_t hash, int max_object );
+    ~cache_fill();
+    /* FILL_MORE, FILL_DONE or FILL_ABORT */
+    int feed( const char* data, int len );
+    /* the finished entry, owned by the caller */
+    cache_entry* take_entry();
+    const string& key() const { return m_key; }
+    uint64_t hash() const { return m_hash; }
+
+public:
+    enum { FILL_MORE = 0, FILL_DONE, FILL_ABORT };
+
+private:
+    int parse_head();
+
+private:
+    static const int MAX_HEAD = 8192;
+    string m_key;
+    uint64_t m_hash;
+    int m_max_object;
+    char m_head[MAX_HEAD];
+    int m_head_len;
+    int m_body_read;
+    cache_entry* m_entry;
+};
+
+/* a slot of the tier shared by all workers, followed by key, headers and body */
+struct shm_slot
+{
+    volatile int m_lock;
+    int m_used;
+    /* CLOCK reference bit */
+    int m_clock;
+    uint64_t m_hash;
+    int m_key_len;
+    int m_header_len;
+    int m_body_len;
+    time_t m_stored;
+    time_t m_expires;
+};
+
+/* per worker response cache with an LRU byte budget, in front of a fixed slot tier mapped shared
+ * before the workers fork and evicted by CLOCK */
+class cache
+{
+private:
+    cache( int mem_bytes, int max_object, bool coalesce, char* slots, int slot_count, int slot_size );
+public:
+    static cache* create( int mem_bytes, int shared_bytes, int shared_slots, int max_object, bool coalesce );
+    /* builds the key of a GET request, false if the request must not be answered from the cache */
+    static bool request_key( const http_head& head, string* key, uint64_t* hash );
+    /* returns a referenced entry or NULL */
+    cache_entry* lookup( const string& key, uint64_t hash );
+    void release( cache_entry* entry );
+    /* takes over the caller's reference */
+    void insert( cache_entry* entry );
+    int max_object() const { return m_max_object; }
+    /* concurrent misses for one key wait for a single server fetch */
+    bool coalesce() const { return m_coalesce; }
+
+public:
+    long m_hits;
+    long m_shared_hits;
+    long m_misses;
+    long m_stores;
+    long m_evictions;
+
+private:
+    void unlink( cache_entry* entry );
+    void push_front( cache_entry* entry );
+    void evict( long need );
+    void insert_local( cache_entry* entry );
+    shm_slot* slot_at( int idx ) { return ( shm_slot* )( m_slots + ( long )idx * m_slot_size ); }
+    void lock( shm_slot* slot );
+    void unlock( shm_slot* slot );
+    cache_entry* shared_lookup( const string& key, uint64_t hash, time_t now );
+    void shared_insert( const cache_entry* entry, time_t now );
+
+private:
+    static const int MAX_PROBE = 8;
+    long m_mem_bytes;
+    long m_used_bytes;
+    int m_max_object;
+    bool m_coalesce;
+    map< uint64_t, cache_entry* > m_index;
+    /* most recently used first */
+    cache_entry m_lru;
+    char* m_slots;
+    int m_slot_count;
+    int m_slot_size;
+};
+
+#endif
@@ -1,13 +1,23 @@
 #include <exception>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "conn.h"
 #include "log.h"
 #include "fdwrapper.h"
+#include "proxy.h"
+#include "cache.h"
 
 conn::conn()
 {
     m_srvfd = -1;
+    m_fill = NULL;
+    m_out_entry = NULL;
+    m_mirrorfd = -1;
+    m_mirror_pipe[0] = m_mirror_pipe[1] = -1;
+    m_mirror_pending = 0;
     m_clt_buf = new char[ BUF_SIZE ];
     if( !m_clt_buf )
     {
@@ -27,7 +37,7 @@ conn::~conn()
     delete [] m_srv_buf;
 }
 
-void conn::init_clt( int sockfd, const sockaddr_in& client_addr )
+void conn::init_clt( int sockfd, const sockaddr_storage& client_addr )
 {
     m_cltfd = sockfd;
     m_clt_address = client_addr;
@@ -39,6 +49,21 @@ void conn::init_srv( int sockfd, const sockaddr_in& server_addr )
     m_srv_address = server_addr;
 }
 
+void conn::take_clt( conn& other )
+{
+    char* buf = m_clt_buf;
+    m_clt_buf = other.m_clt_buf;
+    other.m_clt_buf = buf;
+    m_clt_read_idx = other.m_clt_read_idx;
+    m_clt_write_idx = other.m_clt_write_idx;
+    m_clt_address = other.m_clt_address;
+    m_clt_local_address = other.m_clt_local_address;
+    m_cltfd = other.m_cltfd;
+    m_limit_slot = other.m_limit_slot;
+    m_throttled = other.m_throttled;
+    m_proxy_expect = other.m_proxy_expect;
+}
+
 void conn::reset()
 {
     m_clt_read_idx = 0;
@@ -47,22 +72,73 @@ void conn::reset()
     m_srv_write_idx = 0;
     m_srv_closed = false;
     m_cltfd = -1;
+    m_limit_slot = -1;
+    m_throttled = false;
+    m_proxy_send = 0;
+    m_proxy_expect = false;
+    m_routed = false;
+    m_out_iovcnt = 0;
+    m_out_close = false;
+    m_parked = false;
+    m_park_hash = 0;
+    m_no_coalesce = false;
     memset( m_clt_buf, '\0', BUF_SIZE );
     memset( m_srv_buf, '\0', BUF_SIZE );
 }
 
+bool conn::add_proxy_header( int version )
+{
+    char header[ PROXY_HEADER_MAX ];
+    int len = proxy_build( version, m_clt_address, m_clt_local_address, header, sizeof( header ) );
+    int pending = m_clt_read_idx - m_clt_write_idx;
+    if( len < 0 || len + pending > BUF_SIZE )
+    {
+        return false;
+    }
+    memmove( m_clt_buf + len, m_clt_buf + m_clt_write_idx, pending );
+    memcpy( m_clt_buf, header, len );
+    m_clt_write_idx = 0;
+    m_clt_read_idx = len + pending;
+    return true;
+}
+
+RET_CODE conn::read_proxy_header()
+{
+    int len = proxy_parse( m_clt_buf, m_clt_read_idx, &m_clt_address );
+    if( len < 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "bad PROXY header from client" );
+        return IOERR;
+    }
+    if( len == 0 )
+    {
+        /* read_clt keeps PROXY_HEADER_MAX bytes free while a header is expected */
+        return ( m_clt_read_idx >= BUF_SIZE - PROXY_HEADER_MAX ) ? IOERR : NOTHING;
+    }
+    memmove( m_clt_buf, m_clt_buf + len, m_clt_read_idx - len );
+    m_clt_read_idx -= len;
+    m_proxy_expect = false;
+    if( m_proxy_send && !add_proxy_header( m_proxy_send ) )
+    {
+        return IOERR;
+    }
+    return OK;
+}
+
 RET_CODE conn::read_clt()
 {
     int bytes_read = 0;
+    /* leave room for the PROXY header we send, it is only added once the incoming one or the route is known */
+    int buf_size = ( m_proxy_expect || m_srvfd == -1 ) ? BUF_SIZE - PROXY_HEADER_MAX : BUF_SIZE;
     while( true )
     {
-        if( m_clt_read_idx >= BUF_SIZE )
+        if( m_clt_read_idx >= buf_size )
         {
             log( LOG_ERR, __FILE__, __LINE__, "%s", "the client read buffer is full, let server write" );
             return BUFFER_FULL;
         }
 
-        bytes_read = recv( m_cltfd, m_clt_buf + m_clt_read_idx, BUF_SIZE - m_clt_read_idx, 0 );
+        bytes_read = recv( m_cltfd, m_clt_buf + m_clt_read_idx, buf_size - m_clt_read_idx, 0 );
         if ( bytes_read == -1 )
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
@@ -173,3 +249,138 @@ RET_CODE conn::write_clt()
         m_srv_write_idx += bytes_write;
     }
 }
+
+void conn::start_cached( cache_entry* entry, int age, bool keep_alive )
+{
+    int len = snprintf( m_out_hdr, sizeof( m_out_hdr ), "Age: %d\r\nConnection: %s\r\n\r\n",
+                        age, keep_alive ? "keep-alive" : "close" );
+    m_out_entry = entry;
+    m_out_close = !keep_alive;
+    m_out_iov[0].iov_base = entry->m_data;
+    m_out_iov[0].iov_len = entry->m_header_len;
+    m_out_iov[1].iov_base = m_out_hdr;
+    m_out_iov[1].iov_len = len;
+    m_out_iov[2].iov_base = entry->m_data + entry->m_header_len;
+    m_out_iov[2].iov_len = entry->m_body_len;
+    m_out_iovcnt = 3;
+}
+
+RET_CODE conn::write_cached()
+{
+    int bytes_write = 0;
+    while( true )
+    {
+        while( m_out_iovcnt > 0 && m_out_iov[0].iov_len == 0 )
+        {
+            memmove( m_out_iov, m_out_iov + 1, ( --m_out_iovcnt ) * sizeof( struct iovec ) );
+        }
+        if( m_out_iovcnt == 0 )
+        {
+            return BUFFER_EMPTY;
+        }
+
+        bytes_write = writev( m_cltfd, m_out_iov, m_out_iovcnt );
+        if ( bytes_write == -1 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return TRY_AGAIN;
+            }
+            log( LOG_ERR, __FILE__, __LINE__, "write client socket failed, %s", strerror( errno ) );
+            return IOERR;
+        }
+        else if ( bytes_write == 0 )
+        {
+            return CLOSED;
+        }
+
+        for( int i = 0; i < m_out_iovcnt && bytes_write > 0; ++i )
+        {
+            int step = ( bytes_write < m_out_iov[i].iov_len ) ? bytes_write : m_out_iov[i].iov_len;
+            m_out_iov[i].iov_base = ( char* )m_out_iov[i].iov_base + step;
+            m_out_iov[i].iov_len -= step;
+            bytes_write -= step;
+        }
+    }
+}
+
+bool conn::open_mirror( const sockaddr_in& mirror_addr )
+{
+    m_mirrorfd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( m_mirrorfd < 0 )
+    {
+        return false;
+    }
+    /* the primary path must not wait for the mirror, not even for its handshake */
+    setnonblocking( m_mirrorfd );
+    if( ( connect( m_mirrorfd, ( struct sockaddr* )&mirror_addr, sizeof( mirror_addr ) ) < 0 && errno != EINPROGRESS )
+        || pipe2( m_mirror_pipe, O_NONBLOCK ) < 0 )
+    {
+        close_mirror();
+        return false;
+    }
+    m_mirror_pending = 0;
+    return true;
+}
+
+void conn::close_mirror()
+{
+    if( m_mirrorfd >= 0 )
+    {
+        close( m_mirrorfd );
+    }
+    if( m_mirror_pipe[0] >= 0 )
+    {
+        close( m_mirror_pipe[0] );
+        close( m_mirror_pipe[1] );
+    }
+    m_mirrorfd = -1;
+    m_mirror_pipe[0] = m_mirror_pipe[1] = -1;
+    m_mirror_pending = 0;
+}
+
+bool conn::mirror( const char* data, int len )
+{
+    int ret = write( m_mirror_pipe[1], data, len );
+    if( ret < 0 )
+    {
+        return false;
+    }
+    m_mirror_pending += ret;
+    return ret == len;
+}
+
+RET_CODE conn::flush_mirror()
+{
+    while( m_mirror_pending > 0 )
+    {
+        int ret = splice( m_mirror_pipe[0], NULL, m_mirrorfd, NULL, m_mirror_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if( ret < 0 )
+        {
+            return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? TRY_AGAIN : IOERR;
+        }
+        if( ret == 0 )
+        {
+            return CLOSED;
+        }
+        m_mirror_pending -= ret;
+    }
+    return BUFFER_EMPTY;
+}
+
+RET_CODE conn::drain_mirror()
+{
+    char discard[ BUF_SIZE ];
+    while( true )
+    {
+        int ret = recv( m_mirrorfd, discard, sizeof( discard ), 0 );
+        if( ret < 0 )
+        {
+            return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? OK : IOERR;
+        }
+        if( ret == 0 )
+        {
+            return CLOSED;
+        }
+    }
+}
@@ -2,20 +2,42 @@
 #define CONN_H
 
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include "fdwrapper.h"
 
+class cache_entry;
+class cache_fill;
+
 class conn
 {
 public:
     conn();
     ~conn();
-    void init_clt( int sockfd, const sockaddr_in& client_addr );
+    void init_clt( int sockfd, const sockaddr_storage& client_addr );
     void init_srv( int sockfd, const sockaddr_in& server_addr );
+    /* moves the client side of a not yet bound conn over to this one, buffers are swapped, not copied */
+    void take_clt( conn& other );
     void reset();
+    /* puts a PROXY header in front of the client bytes, so it leaves with the first write to the server */
+    bool add_proxy_header( int version );
+    /* strips the PROXY header sent by a balancer in front of us and takes the client address from it */
+    RET_CODE read_proxy_header();
     RET_CODE read_clt();
     RET_CODE write_clt();
     RET_CODE read_srv();
     RET_CODE write_srv();
+    /* queues a cached response for the client, the entry reference is held until it is written */
+    void start_cached( cache_entry* entry, int age, bool keep_alive );
+    RET_CODE write_cached();
+    /* shadow connection: a copy of the client bytes goes through a pipe and is spliced to it */
+    bool open_mirror( const sockaddr_in& mirror_addr );
+    void close_mirror();
+    /* false if the pipe is full, the mirror has fallen behind */
+    bool mirror( const char* data, int len );
+    RET_CODE flush_mirror();
+    /* reads and drops what the mirror answers */
+    RET_CODE drain_mirror();
 
 public:
     static const int BUF_SIZE = 2048;
@@ -23,7 +45,9 @@ public:
     char* m_clt_buf;
     int m_clt_read_idx;
     int m_clt_write_idx;
-    sockaddr_in m_clt_address;
+    sockaddr_storage m_clt_address;
+    /* the local end of the client connection, the destination in a PROXY header */
+    sockaddr_storage m_clt_local_address;
     int m_cltfd;
 
     char* m_srv_buf;
@@ -33,6 +57,33 @@ public:
     int m_srvfd;
 
     bool m_srv_closed;
+    /* slot of the client address in the shared limit table */
+    int m_limit_slot;
+    /* client reads are paused until its byte bucket refills */
+    bool m_throttled;
+    /* PROXY protocol version to send to the server, 0 for none */
+    int m_proxy_send;
+    /* the client connection starts with a PROXY header */
+    bool m_proxy_expect;
+    /* the client was already routed, by us or by the worker that handed it over */
+    bool m_routed;
+    /* the server response being collected for the cache, owned by the conn */
+    cache_fill* m_fill;
+    /* a cached response in flight to a client that has no server */
+    cache_entry* m_out_entry;
+    struct iovec m_out_iov[3];
+    int m_out_iovcnt;
+    char m_out_hdr[64];
+    bool m_out_close;
+    /* waiting for another client's fetch of the same key, the request stays in the buffer */
+    bool m_parked;
+    uint64_t m_park_hash;
+    /* that fetch could not be shared, go to the server alone */
+    bool m_no_coalesce;
+    int m_mirrorfd;
+    int m_mirror_pipe[2];
+    /* bytes in the pipe not yet spliced to the mirror */
+    int m_mirror_pending;
 };
 
 #endif
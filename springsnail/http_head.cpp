@@ -0,0 +1,147 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "http_head.h"
+
+static bool has_token( const char* value, int len, const char* token )
+{
+    int token_len = strlen( token );
+    for( int i = 0; i + token_len <= len; ++i )
+    {
+        if( strncasecmp( value + i, token, token_len ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int parse_http_head( const char* buf, int len, http_head* head )
+{
+    memset( head, 0, sizeof( *head ) );
+    const char* end = buf + len;
+    const char* line_end = ( const char* )memchr( buf, '\n', len );
+    if( !line_end )
+    {
+        return 0;
+    }
+
+    /* request line: METHOD SP request-target SP HTTP-version CRLF */
+    const char* sp = ( const char* )memchr( buf, ' ', line_end - buf );
+    if( !sp || sp == buf )
+    {
+        return -1;
+    }
+    head->m_method = buf;
+    head->m_method_len = sp - buf;
+    head->m_url = sp + 1;
+    const char* url_end = ( const char* )memchr( head->m_url, ' ', line_end - head->m_url );
+    if( !url_end || url_end == head->m_url )
+    {
+        return -1;
+    }
+    head->m_url_len = url_end - head->m_url;
+    const char* version = url_end + 1;
+    if( line_end - version < 8 || strncmp( version, "HTTP/1.", 7 ) != 0 )
+    {
+        return -1;
+    }
+    head->m_keep_alive = version[7] == '1';
+
+    head->m_path = head->m_url;
+    head->m_path_len = head->m_url_len;
+    if( head->m_url_len > 7 && strncasecmp( head->m_url, "http://", 7 ) == 0 )
+    {
+        head->m_host = head->m_url + 7;
+        const char* slash = ( const char* )memchr( head->m_host, '/', url_end - head->m_host );
+        head->m_path = slash ? slash : url_end;
+        head->m_path_len = url_end - head->m_path;
+        head->m_host_len = head->m_path - head->m_host;
+    }
+
+    const char* p = line_end + 1;
+    while( true )
+    {
+        const char* eol = ( const char* )memchr( p, '\n', end - p );
+        if( !eol )
+        {
+            return 0;
+        }
+        int line_len = eol - p;
+        if( line_len > 0 && p[line_len - 1] == '\r' )
+        {
+            line_len--;
+        }
+        if( line_len == 0 )
+        {
+            p = eol + 1;
+            break;
+        }
+
+        const char* colon = ( const char* )memchr( p, ':', line_len );
+        if( colon )
+        {
+            int name_len = colon - p;
+            const char* value = colon + 1;
+            int value_len = p + line_len - value;
+            while( value_len > 0 && ( *value == ' ' || *value == '\t' ) )
+            {
+                value++;
+                value_len--;
+            }
+            if( name_len == 4 && strncasecmp( p, "Host", 4 ) == 0 && !head->m_host )
+            {
+                head->m_host = value;
+                head->m_host_len = value_len;
+            }
+            else if( name_len == 10 && strncasecmp( p, "Connection", 10 ) == 0 )
+            {
+                if( has_token( value, value_len, "close" ) )
+                {
+                    head->m_keep_alive = false;
+                }
+                else if( has_token( value, value_len, "keep-alive" ) )
+                {
+                    head->m_keep_alive = true;
+                }
+            }
+            else if( name_len == 14 && strncasecmp( p, "Content-Length", 14 ) == 0 )
+            {
+                head->m_has_body = head->m_has_body || atol( value ) > 0;
+            }
+            else if( name_len == 17 && strncasecmp( p, "Transfer-Encoding", 17 ) == 0 )
+            {
+                head->m_has_body = true;
+            }
+            else if( ( name_len == 13 && strncasecmp( p, "Cache-Control", 13 ) == 0 )
+                     || ( name_len == 6 && strncasecmp( p, "Pragma", 6 ) == 0 ) )
+            {
+                if( has_token( value, value_len, "no-cache" ) || has_token( value, value_len, "no-store" ) )
+                {
+                    head->m_no_cache = true;
+                }
+            }
+            else if( name_len == 13 && strncasecmp( p, "Authorization", 13 ) == 0 )
+            {
+                head->m_no_cache = true;
+            }
+        }
+        p = eol + 1;
+    }
+
+    if( head->m_host )
+    {
+        /* the port is not part of the name */
+        const char* colon = ( const char* )memchr( head->m_host, ':', head->m_host_len );
+        if( colon && head->m_host[0] != '[' )
+        {
+            head->m_host_len = colon - head->m_host;
+        }
+        while( head->m_host_len > 0 && ( head->m_host[head->m_host_len - 1] == ' ' || head->m_host[head->m_host_len - 1] == '\t' ) )
+        {
+            head->m_host_len--;
+        }
+    }
+    head->m_head_len = p - buf;
+    return head->m_head_len;
+}
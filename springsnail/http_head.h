@@ -0,0 +1,31 @@
+#ifndef HTTP_HEAD_H
+#define HTTP_HEAD_H
+
+/* the parts of an HTTP request head the L7 features look at, all pointing into the client buffer */
+class http_head
+{
+public:
+    const char* m_method;
+    int m_method_len;
+    /* request-target as sent, including the query */
+    const char* m_url;
+    int m_url_len;
+    /* path part of the target, without scheme and authority */
+    const char* m_path;
+    int m_path_len;
+    /* from the Host header or an absolute-form target, without the port */
+    const char* m_host;
+    int m_host_len;
+    /* bytes up to and including the empty line */
+    int m_head_len;
+    bool m_keep_alive;
+    /* the request carries a body */
+    bool m_has_body;
+    /* no-cache/no-store/Pragma: no-cache, or credentials a shared cache must not answer for */
+    bool m_no_cache;
+};
+
+/* returns the length of a complete head at the start of buf, 0 if it is not complete yet, -1 if it is not HTTP */
+int parse_http_head( const char* buf, int len, http_head* head );
+
+#endif
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include "limiter.h"
+#include "log.h"
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* IPv4 addresses are stored v4-mapped so both families share one key format */
+static void addr_key( const sockaddr_storage& addr, unsigned char* key )
+{
+    memset( key, 0, 16 );
+    if( addr.ss_family == AF_INET6 )
+    {
+        memcpy( key, &( ( const sockaddr_in6* )&addr )->sin6_addr, 16 );
+    }
+    else
+    {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy( key + 12, &( ( const sockaddr_in* )&addr )->sin_addr, 4 );
+    }
+}
+
+static uint32_t addr_hash( const unsigned char* key )
+{
+    uint32_t hash = 2166136261u;
+    for( int i = 0; i < 16; ++i )
+    {
+        hash = ( hash ^ key[i] ) * 16777619u;
+    }
+    return hash;
+}
+
+limiter::limiter( int conn_rate, int conn_burst, int byte_rate, int byte_burst, int max_conns, int slots, limit_entry* table )
+    : m_conn_rate( conn_rate ), m_conn_burst( conn_burst ), m_byte_rate( byte_rate ), m_byte_burst( byte_burst ),
+      m_max_conns( max_conns ), m_slots( slots ), m_table( table )
+{
+}
+
+limiter* limiter::create( int conn_rate, int conn_burst, int byte_rate, int byte_burst, int max_conns, int slots )
+{
+    if( slots <= 0 )
+    {
+        return NULL;
+    }
+    void* table = mmap( NULL, sizeof( limit_entry ) * slots, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( table == MAP_FAILED )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "map the limit table failed" );
+        return NULL;
+    }
+    conn_burst = conn_burst > 0 ? conn_burst : conn_rate;
+    byte_burst = byte_burst > 0 ? byte_burst : byte_rate;
+    return new limiter( conn_rate, conn_burst, byte_rate, byte_burst, max_conns, slots, ( limit_entry* )table );
+}
+
+void limiter::lock( limit_entry* entry )
+{
+    while( __sync_lock_test_and_set( &entry->m_lock, 1 ) )
+    {
+        while( entry->m_lock )
+        {
+        }
+    }
+}
+
+void limiter::unlock( limit_entry* entry )
+{
+    __sync_lock_release( &entry->m_lock );
+}
+
+void limiter::refill( limit_entry* entry, int64_t now )
+{
+    int64_t elapsed = now - entry->m_stamp;
+    if( elapsed <= 0 )
+    {
+        return;
+    }
+    entry->m_stamp = now;
+    entry->m_conn_tokens += elapsed * m_conn_rate;
+    if( entry->m_conn_tokens > ( int64_t )m_conn_burst * 1000 )
+    {
+        entry->m_conn_tokens = ( int64_t )m_conn_burst * 1000;
+    }
+    entry->m_byte_tokens += elapsed * m_byte_rate;
+    if( entry->m_byte_tokens > ( int64_t )m_byte_burst * 1000 )
+    {
+        entry->m_byte_tokens = ( int64_t )m_byte_burst * 1000;
+    }
+}
+
+int limiter::admit( const sockaddr_storage& addr )
+{
+    unsigned char key[16];
+    addr_key( addr, key );
+    uint32_t hash = addr_hash( key );
+    int64_t now = now_ms();
+
+    /* look for the address first, then for a slot nobody holds and whose buckets have refilled */
+    int slot = -1;
+    for( int pass = 0; pass < 2 && slot < 0; ++pass )
+    {
+        for( int i = 0; i < MAX_PROBE; ++i )
+        {
+            int idx = ( hash + i ) % m_slots;
+            limit_entry* entry = m_table + idx;
+            lock( entry );
+            if( entry->m_used && memcmp( entry->m_addr, key, 16 ) == 0 )
+            {
+                slot = idx;
+                break;
+            }
+            bool idle = !entry->m_used
+                        || ( entry->m_conns == 0 && ( now - entry->m_stamp ) * m_conn_rate >= ( int64_t )m_conn_burst * 1000
+                             && ( now - entry->m_stamp ) * m_byte_rate >= ( int64_t )m_byte_burst * 1000 );
+            if( pass == 1 && idle )
+            {
+                entry->m_used = 1;
+                memcpy( entry->m_addr, key, 16 );
+                entry->m_conns = 0;
+                entry->m_conn_tokens = ( int64_t )m_conn_burst * 1000;
+                entry->m_byte_tokens = ( int64_t )m_byte_burst * 1000;
+                entry->m_stamp = now;
+                slot = idx;
+                break;
+            }
+            unlock( entry );
+        }
+    }
+    if( slot < 0 )
+    {
+        log( LOG_WARNING, __FILE__, __LINE__, "%s", "limit table is full, client not tracked" );
+        return NOT_TRACKED;
+    }
+
+    /* the entry is still locked here */
+    limit_entry* entry = m_table + slot;
+    refill( entry, now );
+    bool ok = true;
+    if( m_max_conns > 0 && entry->m_conns >= m_max_conns )
+    {
+        ok = false;
+    }
+    else if( m_conn_rate > 0 )
+    {
+        if( entry->m_conn_tokens < 1000 )
+        {
+            ok = false;
+        }
+        else
+        {
+            entry->m_conn_tokens -= 1000;
+        }
+    }
+    if( ok )
+    {
+        entry->m_conns++;
+    }
+    unlock( entry );
+    return ok ? slot : REJECTED;
+}
+
+void limiter::release( int slot )
+{
+    if( slot < 0 )
+    {
+        return;
+    }
+    limit_entry* entry = m_table + slot;
+    lock( entry );
+    if( entry->m_conns > 0 )
+    {
+        entry->m_conns--;
+    }
+    unlock( entry );
+}
+
+bool limiter::consume( int slot, int bytes )
+{
+    if( slot < 0 || m_byte_rate <= 0 )
+    {
+        return true;
+    }
+    limit_entry* entry = m_table + slot;
+    lock( entry );
+    refill( entry, now_ms() );
+    entry->m_byte_tokens -= ( int64_t )bytes * 1000;
+    bool ok = entry->m_byte_tokens > 0;
+    unlock( entry );
+    return ok;
+}
+
+bool limiter::can_read( int slot )
+{
+    if( slot < 0 || m_byte_rate <= 0 )
+    {
+        return true;
+    }
+    limit_entry* entry = m_table + slot;
+    lock( entry );
+    refill( entry, now_ms() );
+    bool ok = entry->m_byte_tokens > 0;
+    unlock( entry );
+    return ok;
+}
@@ -0,0 +1,56 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* one source address, lives in memory shared by every worker */
+struct limit_entry
+{
+    volatile int m_lock;
+    int m_used;
+    unsigned char m_addr[16];
+    int m_conns;
+    int64_t m_conn_tokens;
+    int64_t m_byte_tokens;
+    int64_t m_stamp;
+};
+
+/* per source address token buckets (new connections/s, bytes/s) and a concurrent connection cap,
+ * token counts are kept in thousandths so the refill needs no floating point */
+class limiter
+{
+private:
+    limiter( int conn_rate, int conn_burst, int byte_rate, int byte_burst, int max_conns, int slots, limit_entry* table );
+public:
+    /* must be called before the worker processes are forked */
+    static limiter* create( int conn_rate, int conn_burst, int byte_rate, int byte_burst, int max_conns, int slots );
+    /* returns the slot charged for this client, NOT_TRACKED when the table is full, or REJECTED */
+    int admit( const sockaddr_storage& addr );
+    void release( int slot );
+    /* charges bytes sent by the client, false once its byte bucket is in debt */
+    bool consume( int slot, int bytes );
+    bool can_read( int slot );
+    bool limit_bytes() const { return m_byte_rate > 0; }
+
+public:
+    static const int REJECTED = -1;
+    static const int NOT_TRACKED = -2;
+
+private:
+    static const int MAX_PROBE = 8;
+    void refill( limit_entry* entry, int64_t now );
+    void lock( limit_entry* entry );
+    void unlock( limit_entry* entry );
+
+private:
+    int m_conn_rate;
+    int m_conn_burst;
+    int m_byte_rate;
+    int m_byte_burst;
+    int m_max_conns;
+    int m_slots;
+    limit_entry* m_table;
+};
+
+#endif
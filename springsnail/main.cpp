@@ -14,13 +14,20 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <vector>
+#include <map>
+#include <string>
 
 #include "log.h"
 #include "conn.h"
 #include "mgr.h"
+#include "limiter.h"
+#include "router.h"
+#include "cache.h"
 #include "processpool.h"
 
 using std::vector;
+using std::map;
+using std::string;
 
 static const char* version = "1.0";
 
@@ -29,6 +36,246 @@ static void usage( const char* prog )
     log( LOG_INFO, __FILE__, __LINE__,  "usage: %s [-h] [-v] [-f config_file]", prog );
 }
 
+/* "Listen 1.2.3.4:80 [backlog=N] [group=name] [proxy=on]", IPv6 addresses are written as [::1]:80 */
+static int parse_listen( char* text, host& listen_host )
+{
+    char* addr = strtok( text, " \t" );
+    if( !addr )
+    {
+        return -1;
+    }
+    char* colon = strrchr( addr, ':' );
+    if( !colon )
+    {
+        return -1;
+    }
+    *colon = '\0';
+    listen_host.m_port = atoi( colon + 1 );
+    if( addr[0] == '[' )
+    {
+        char* end = strchr( ++addr, ']' );
+        if( !end )
+        {
+            return -1;
+        }
+        *end = '\0';
+    }
+    if( strlen( addr ) >= sizeof( listen_host.m_hostname ) )
+    {
+        return -1;
+    }
+    memcpy( listen_host.m_hostname, addr, strlen( addr ) );
+
+    char* option = NULL;
+    while( option = strtok( NULL, " \t" ) )
+    {
+        if( strncmp( option, "backlog=", 8 ) == 0 )
+        {
+            listen_host.m_backlog = atoi( option + 8 );
+        }
+        else if( strncmp( option, "group=", 6 ) == 0 && strlen( option + 6 ) < sizeof( listen_host.m_group ) )
+        {
+            memcpy( listen_host.m_group, option + 6, strlen( option + 6 ) );
+        }
+        else if( strcmp( option, "proxy=on" ) == 0 )
+        {
+            listen_host.m_accept_proxy = true;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return ( listen_host.m_port > 0 && listen_host.m_backlog > 0 ) ? 0 : -1;
+}
+
+/* "Cache [memory=N] [shared=N] [slots=N] [max_object=N] [coalesce=on|off]", byte sizes,
+ * shared=0 keeps the cache per worker */
+static cache* parse_cache( char* text )
+{
+    int memory = 16 << 20, shared = 0, slots = 1024, max_object = 256 << 10;
+    bool coalesce = true;
+    char* option = strtok( text, " \t" );
+    for( ; option; option = strtok( NULL, " \t" ) )
+    {
+        char* value = strchr( option, '=' );
+        if( !value )
+        {
+            return NULL;
+        }
+        *value++ = '\0';
+        if( strcmp( option, "memory" ) == 0 )
+        {
+            memory = atoi( value );
+        }
+        else if( strcmp( option, "shared" ) == 0 )
+        {
+            shared = atoi( value );
+        }
+        else if( strcmp( option, "slots" ) == 0 )
+        {
+            slots = atoi( value );
+        }
+        else if( strcmp( option, "max_object" ) == 0 )
+        {
+            max_object = atoi( value );
+        }
+        else if( strcmp( option, "coalesce" ) == 0 )
+        {
+            coalesce = strcmp( value, "off" ) != 0;
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    if( memory <= 0 || max_object <= 0 )
+    {
+        return NULL;
+    }
+    log( LOG_INFO, __FILE__, __LINE__, "response cache: %d bytes per worker, %d bytes in %d shared slots", memory, shared, slots );
+    return cache::create( memory, shared, slots, max_object, coalesce );
+}
+
+/* "Limit [rate=N] [burst=N] [bytes=N] [byte_burst=N] [conns=N] [slots=N]", per client address, 0 means unlimited */
+static limiter* parse_limit( char* text )
+{
+    int conn_rate = 0, conn_burst = 0, byte_rate = 0, byte_burst = 0, max_conns = 0, slots = 65536;
+    char* option = strtok( text, " \t" );
+    for( ; option; option = strtok( NULL, " \t" ) )
+    {
+        char* value = strchr( option, '=' );
+        if( !value )
+        {
+            return NULL;
+        }
+        *value++ = '\0';
+        if( strcmp( option, "rate" ) == 0 )
+        {
+            conn_rate = atoi( value );
+        }
+        else if( strcmp( option, "burst" ) == 0 )
+        {
+            conn_burst = atoi( value );
+        }
+        else if( strcmp( option, "bytes" ) == 0 )
+        {
+            byte_rate = atoi( value );
+        }
+        else if( strcmp( option, "byte_burst" ) == 0 )
+        {
+            byte_burst = atoi( value );
+        }
+        else if( strcmp( option, "conns" ) == 0 )
+        {
+            max_conns = atoi( value );
+        }
+        else if( strcmp( option, "slots" ) == 0 )
+        {
+            slots = atoi( value );
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    log( LOG_INFO, __FILE__, __LINE__, "limit per client: %d conns/s, %d bytes/s, %d concurrent conns", conn_rate, byte_rate, max_conns );
+    return limiter::create( conn_rate, conn_burst, byte_rate, byte_burst, max_conns, slots );
+}
+
+/* the logical hosts of a group, an empty group is all of them */
+static vector< int > group_workers( const char* group, const vector< host >& logical_srv )
+{
+    vector< int > workers;
+    for( int j = 0; j < logical_srv.size(); ++j )
+    {
+        if( group[0] == '\0' || strcmp( group, logical_srv[j].m_group ) == 0 )
+        {
+            workers.push_back( j );
+        }
+    }
+    return workers;
+}
+
+/* copies the value of "<tag>value</tag>" into value, returns 1 if the line has the tag, -1 if it is malformed */
+static int parse_tag( char* line, const char* tag, char* value, int size )
+{
+    char open_tag[64];
+    char close_tag[64];
+    snprintf( open_tag, sizeof( open_tag ), "<%s>", tag );
+    snprintf( close_tag, sizeof( close_tag ), "</%s>", tag );
+    char* begin = strstr( line, open_tag );
+    if( !begin )
+    {
+        return 0;
+    }
+    begin += strlen( open_tag );
+    char* end = strstr( begin, close_tag );
+    if( !end || end - begin >= size )
+    {
+        return -1;
+    }
+    memcpy( value, begin, end - begin );
+    value[ end - begin ] = '\0';
+    return 1;
+}
+
+static int open_listener( const host& listen_host )
+{
+    struct sockaddr_storage address;
+    socklen_t addrlen = 0;
+    bzero( &address, sizeof( address ) );
+    if( strchr( listen_host.m_hostname, ':' ) )
+    {
+        struct sockaddr_in6* addr6 = ( struct sockaddr_in6* )&address;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons( listen_host.m_port );
+        if( inet_pton( AF_INET6, listen_host.m_hostname, &addr6->sin6_addr ) != 1 )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "bad listen address %s", listen_host.m_hostname );
+            return -1;
+        }
+        addrlen = sizeof( *addr6 );
+    }
+    else
+    {
+        struct sockaddr_in* addr4 = ( struct sockaddr_in* )&address;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons( listen_host.m_port );
+        if( inet_pton( AF_INET, listen_host.m_hostname, &addr4->sin_addr ) != 1 )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "bad listen address %s", listen_host.m_hostname );
+            return -1;
+        }
+        addrlen = sizeof( *addr4 );
+    }
+
+    int listenfd = socket( address.ss_family, SOCK_STREAM, 0 );
+    if( listenfd < 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "create listen socket failed: %s", strerror( errno ) );
+        return -1;
+    }
+    int on = 1;
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+    if( address.ss_family == AF_INET6 )
+    {
+        /* let [::]:port and 0.0.0.0:port be configured side by side */
+        setsockopt( listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof( on ) );
+    }
+    if( bind( listenfd, ( struct sockaddr* )&address, addrlen ) < 0
+        || listen( listenfd, listen_host.m_backlog ) < 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "listen on %s:%d failed: %s", listen_host.m_hostname, listen_host.m_port, strerror( errno ) );
+        close( listenfd );
+        return -1;
+    }
+    setnonblocking( listenfd );
+    log( LOG_INFO, __FILE__, __LINE__, "listen on %s:%d, backlog %d, group %s", listen_host.m_hostname, listen_host.m_port,
+         listen_host.m_backlog, listen_host.m_group[0] ? listen_host.m_group : "*" );
+    return listenfd;
+}
+
 int main( int argc, char* argv[] )
 {
     char cfg_file[1024];
@@ -94,8 +341,10 @@ int main( int argc, char* argv[] )
     }
     vector< host > balance_srv;
     vector< host > logical_srv;
+    vector< route > routes;
     host tmp_host;
-    memset( tmp_host.m_hostname, '\0', 1024 );
+    route tmp_route;
+    bool route_opentag = false;
     char* tmp_hostname;
     char* tmp_port;
     char* tmp_conncnt;
@@ -107,7 +356,38 @@ int main( int argc, char* argv[] )
     while( tmp2 = strpbrk( tmp, "\n" ) )
     {
         *tmp2++ = '\0';
-        if( strstr( tmp, "<logical_host>" ) )
+        if( strstr( tmp, "<route>" ) )
+        {
+            if( route_opentag || opentag )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            route_opentag = true;
+        }
+        else if( strstr( tmp, "</route>" ) )
+        {
+            if( !route_opentag || tmp_route.m_target[0] == '\0' )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            routes.push_back( tmp_route );
+            tmp_route = route();
+            route_opentag = false;
+        }
+        else if( route_opentag )
+        {
+            if( parse_tag( tmp, "method", tmp_route.m_method, sizeof( tmp_route.m_method ) ) < 0
+                || parse_tag( tmp, "host", tmp_route.m_host, sizeof( tmp_route.m_host ) ) < 0
+                || parse_tag( tmp, "path", tmp_route.m_path, sizeof( tmp_route.m_path ) ) < 0
+                || parse_tag( tmp, "target", tmp_route.m_target, sizeof( tmp_route.m_target ) ) < 0 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+        }
+        else if( strstr( tmp, "<logical_host>" ) )
         {
             if( opentag )
             {
@@ -124,7 +404,7 @@ int main( int argc, char* argv[] )
                 return 1;
             }
             logical_srv.push_back( tmp_host );
-            memset( tmp_host.m_hostname, '\0', 1024 );
+            tmp_host = host();
             opentag = false;
         }
         else if( tmp3 = strstr( tmp, "<name>" ) )
@@ -163,20 +443,87 @@ int main( int argc, char* argv[] )
             *tmp4 = '\0';
             tmp_host.m_conncnt = atoi( tmp_conncnt );
         }
-        else if( tmp3 = strstr( tmp, "Listen" ) )
+        else if( tmp3 = strstr( tmp, "<proxy_protocol>" ) )
         {
-            tmp_hostname = tmp3 + 6;
-            tmp4 = strstr( tmp_hostname, ":" );
+            tmp_hostname = tmp3 + 16;
+            tmp4 = strstr( tmp_hostname, "</proxy_protocol>" );
             if( !tmp4 )
             {
                 log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
                 return 1;
             }
-            *tmp4++ = '\0';
-            tmp_host.m_port = atoi( tmp4 );
-            memcpy( tmp_host.m_hostname, tmp3, strlen( tmp3 ) );
+            *tmp4 = '\0';
+            if( strcmp( tmp_hostname, "v1" ) == 0 )
+            {
+                tmp_host.m_send_proxy = 1;
+            }
+            else if( strcmp( tmp_hostname, "v2" ) == 0 )
+            {
+                tmp_host.m_send_proxy = 2;
+            }
+            else
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+        }
+        else if( tmp3 = strstr( tmp, "<mirror>" ) )
+        {
+            tmp_hostname = tmp3 + 8;
+            tmp4 = strstr( tmp_hostname, "</mirror>" );
+            char* colon = tmp4 ? ( char* )memchr( tmp_hostname, ':', tmp4 - tmp_hostname ) : NULL;
+            if( !colon || colon - tmp_hostname >= sizeof( tmp_host.m_mirror_name ) )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            memcpy( tmp_host.m_mirror_name, tmp_hostname, colon - tmp_hostname );
+            tmp_host.m_mirror_port = atoi( colon + 1 );
+        }
+        else if( tmp3 = strstr( tmp, "<group>" ) )
+        {
+            tmp_hostname = tmp3 + 7;
+            tmp4 = strstr( tmp_hostname, "</group>" );
+            if( !tmp4 || tmp4 - tmp_hostname >= sizeof( tmp_host.m_group ) )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            *tmp4 = '\0';
+            memcpy( tmp_host.m_group, tmp_hostname, strlen( tmp_hostname ) );
+        }
+        else if( tmp3 = strstr( tmp, "Limit" ) )
+        {
+            /* the table is mapped shared, so it has to exist before the workers are forked */
+            limiter* limit = parse_limit( tmp3 + 5 );
+            if( !limit )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            mgr::set_limiter( limit );
+        }
+        else if( tmp3 = strstr( tmp, "Cache" ) )
+        {
+            /* like the limit table, the shared slots have to be mapped before the fork */
+            cache* responses = parse_cache( tmp3 + 5 );
+            if( !responses )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
+            mgr::set_cache( responses );
+        }
+        else if( tmp3 = strstr( tmp, "Listen" ) )
+        {
+            if( parse_listen( tmp3 + 6, tmp_host ) < 0 )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
+                return 1;
+            }
             balance_srv.push_back( tmp_host );
-            memset( tmp_host.m_hostname, '\0', 1024 );
+            tmp_host = host();
         }
         tmp = tmp2;
     }
@@ -186,36 +533,66 @@ int main( int argc, char* argv[] )
         log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
         return 1;
     }
-    const char* ip = balance_srv[0].m_hostname;
-    int port = balance_srv[0].m_port;
-
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
- 
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
+    vector< int > listenfds;
+    vector< vector< int > > listen_workers;
+    for( int i = 0; i < balance_srv.size(); ++i )
+    {
+        vector< int > workers = group_workers( balance_srv[i].m_group, logical_srv );
+        if( workers.empty() )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "no logical host in group %s", balance_srv[i].m_group );
+            return 1;
+        }
 
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret != -1 );
+        int listenfd = open_listener( balance_srv[i] );
+        if( listenfd < 0 )
+        {
+            return 1;
+        }
+        listenfds.push_back( listenfd );
+        listen_workers.push_back( workers );
+    }
 
-    ret = listen( listenfd, 5 );
-    assert( ret != -1 );
+    if( !routes.empty() )
+    {
+        /* one target per distinct group named by the rules */
+        router* route_table = new router;
+        map< string, int > targets;
+        for( int i = 0; i < routes.size(); ++i )
+        {
+            map< string, int >::iterator iter = targets.find( routes[i].m_target );
+            int target = -1;
+            if( iter != targets.end() )
+            {
+                target = iter->second;
+            }
+            else
+            {
+                vector< int > workers = group_workers( routes[i].m_target, logical_srv );
+                if( workers.empty() )
+                {
+                    log( LOG_ERR, __FILE__, __LINE__, "no logical host in group %s", routes[i].m_target );
+                    return 1;
+                }
+                target = route_table->add_target( workers );
+                targets[ routes[i].m_target ] = target;
+            }
+            route_table->add_rule( routes[i], target );
+        }
+        route_table->compile();
+        mgr::set_router( route_table );
+    }
 
-    //memset( cfg_host.m_hostname, '\0', 1024 );
-    //memcpy( cfg_host.m_hostname, "127.0.0.1", strlen( "127.0.0.1" ) );
-    //cfg_host.m_port = 54321;
-    //cfg_host.m_conncnt = 5;
-    processpool< conn, host, mgr >* pool = processpool< conn, host, mgr >::create( listenfd, logical_srv.size() );
+    processpool< conn, host, mgr >* pool = processpool< conn, host, mgr >::create( listenfds, balance_srv, listen_workers, logical_srv.size() );
     if( pool )
     {
         pool->run( logical_srv );
         delete pool;
     }
 
-    close( listenfd );
+    for( int i = 0; i < listenfds.size(); ++i )
+    {
+        close( listenfds[i] );
+    }
     return 0;
 }
@@ -13,6 +13,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <exception>
 #include "log.h"
@@ -21,6 +22,9 @@
 using std::pair;
 
 int mgr::m_epollfd = -1;
+limiter* mgr::m_limiter = NULL;
+router* mgr::m_router = NULL;
+cache* mgr::m_cache = NULL;
 int mgr::conn2srv( const sockaddr_in& address )
 {
     int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
@@ -37,7 +41,9 @@ int mgr::conn2srv( const sockaddr_in& address )
     return sockfd;
 }
 
-mgr::mgr( int epollfd, const host& srv ) : m_logic_srv( srv )
+mgr::mgr( int epollfd, const host& srv )
+    : m_flights_led( 0 ), m_coalesced( 0 ), m_fanned_out( 0 ), m_released( 0 ),
+      m_mirrors_opened( 0 ), m_mirrors_dropped( 0 ), m_mirrored_bytes( 0 ), m_bound( 0 ), m_idx( -1 ), m_next_peer( 0 ), m_logic_srv( srv )
 {
     m_epollfd = epollfd;
     int ret = 0;
@@ -47,6 +53,14 @@ mgr::mgr( int epollfd, const host& srv ) : m_logic_srv( srv )
     inet_pton( AF_INET, srv.m_hostname, &address.sin_addr );
     address.sin_port = htons( srv.m_port );
     log( LOG_INFO, __FILE__, __LINE__, "logcial srv host info: (%s, %d)", srv.m_hostname, srv.m_port );
+    bzero( &m_mirror_address, sizeof( m_mirror_address ) );
+    if( srv.m_mirror_port )
+    {
+        m_mirror_address.sin_family = AF_INET;
+        inet_pton( AF_INET, srv.m_mirror_name, &m_mirror_address.sin_addr );
+        m_mirror_address.sin_port = htons( srv.m_mirror_port );
+        log( LOG_INFO, __FILE__, __LINE__, "mirror client bytes to (%s, %d)", srv.m_mirror_name, srv.m_mirror_port );
+    }
 
     for( int i = 0; i < srv.m_conncnt; ++i )
     {
@@ -81,34 +95,645 @@ mgr::~mgr()
 
 int mgr::get_used_conn_cnt()
 {
-    return m_used.size();
+    return m_used.size() + m_pending.size();
+}
+
+conn* mgr::pick_conn( int cltfd, const sockaddr_storage& client_addr, const host& listener )
+{
+    /* checked before any backend connection is touched, so a rejected client costs nothing but the close */
+    int limit_slot = limiter::NOT_TRACKED;
+    if( m_limiter )
+    {
+        limit_slot = m_limiter->admit( client_addr );
+        if( limit_slot == limiter::REJECTED )
+        {
+            log( LOG_DEBUG, __FILE__, __LINE__, "client sock %d is over its limits", cltfd );
+            return NULL;
+        }
+    }
+
+    /* with routing rules or a cache the server is chosen once the request is read, a cache hit needs none */
+    bool deferred = m_router || m_cache;
+    conn* tmp = deferred ? get_spare_conn() : NULL;
+    if( !deferred )
+    {
+        if( m_conns.empty() )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "%s", "not enough srv connections to server" );
+        }
+        else
+        {
+            map< int, conn* >::iterator iter =  m_conns.begin();
+            tmp = iter->second;
+            if( !tmp )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "%s", "empty server connection object" );
+            }
+            m_conns.erase( iter );
+        }
+    }
+    if( !tmp )
+    {
+        if( m_limiter )
+        {
+            m_limiter->release( limit_slot );
+        }
+        return NULL;
+    }
+
+    tmp->init_clt( cltfd, client_addr );
+    tmp->m_limit_slot = limit_slot;
+    tmp->m_proxy_expect = listener.m_accept_proxy;
+    if( m_logic_srv.m_send_proxy )
+    {
+        socklen_t addrlen = sizeof( tmp->m_clt_local_address );
+        getsockname( cltfd, ( struct sockaddr* )&tmp->m_clt_local_address, &addrlen );
+    }
+    add_read_fd( m_epollfd, cltfd );
+    if( deferred )
+    {
+        m_pending.insert( pair< int, conn* >( cltfd, tmp ) );
+        return tmp;
+    }
+
+    int srvfd = tmp->m_srvfd;
+    tmp->m_proxy_send = m_logic_srv.m_send_proxy;
+    /* with an incoming header the real client is only known after the first read */
+    if( tmp->m_proxy_send && !tmp->m_proxy_expect )
+    {
+        tmp->add_proxy_header( tmp->m_proxy_send );
+    }
+    m_used.insert( pair< int, conn* >( cltfd, tmp ) );
+    m_used.insert( pair< int, conn* >( srvfd, tmp ) );
+    m_bound++;
+    add_read_fd( m_epollfd, srvfd );
+    log( LOG_INFO, __FILE__, __LINE__, "bind client sock %d with server sock %d", cltfd, srvfd );
+    open_mirror( tmp );
+    return tmp;
+}
+
+conn* mgr::get_spare_conn()
+{
+    if( !m_spare.empty() )
+    {
+        conn* tmp = m_spare.back();
+        m_spare.pop_back();
+        return tmp;
+    }
+    if( m_pending.size() >= MAX_PENDING )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "%s", "too many clients waiting for a route" );
+        return NULL;
+    }
+    try
+    {
+        return new conn;
+    }
+    catch( ... )
+    {
+        return NULL;
+    }
+}
+
+void mgr::free_pending( conn* pending )
+{
+    int cltfd = pending->m_cltfd;
+    closefd( m_epollfd, cltfd );
+    m_pending.erase( cltfd );
+    m_throttled.erase( cltfd );
+    if( m_limiter )
+    {
+        m_limiter->release( pending->m_limit_slot );
+    }
+    if( pending->m_out_entry )
+    {
+        m_cache->release( pending->m_out_entry );
+        pending->m_out_entry = NULL;
+    }
+    if( pending->m_parked )
+    {
+        map< uint64_t, flight >::iterator iter = m_flights.find( pending->m_park_hash );
+        if( iter != m_flights.end() )
+        {
+            vector< conn* >& waiters = iter->second.m_waiters;
+            for( int i = 0; i < waiters.size(); ++i )
+            {
+                if( waiters[i] == pending )
+                {
+                    waiters.erase( waiters.begin() + i );
+                    break;
+                }
+            }
+        }
+    }
+    pending->reset();
+    m_spare.push_back( pending );
 }
 
-conn* mgr::pick_conn( int cltfd  )
+conn* mgr::bind_pending( conn* pending )
 {
     if( m_conns.empty() )
     {
         log( LOG_ERR, __FILE__, __LINE__, "%s", "not enough srv connections to server" );
         return NULL;
     }
-
     map< int, conn* >::iterator iter =  m_conns.begin();
     int srvfd = iter->first;
     conn* tmp = iter->second;
-    if( !tmp )
+    m_conns.erase( iter );
+
+    int cltfd = pending->m_cltfd;
+    tmp->take_clt( *pending );
+    m_pending.erase( cltfd );
+    pending->reset();
+    m_spare.push_back( pending );
+    if( tmp->m_throttled )
     {
-        log( LOG_ERR, __FILE__, __LINE__, "%s", "empty server connection object" );
-        return NULL;
+        m_throttled[ cltfd ] = tmp;
+    }
+
+    tmp->m_proxy_send = m_logic_srv.m_send_proxy;
+    if( tmp->m_proxy_send )
+    {
+        tmp->add_proxy_header( tmp->m_proxy_send );
     }
-    m_conns.erase( iter );
     m_used.insert( pair< int, conn* >( cltfd, tmp ) );
     m_used.insert( pair< int, conn* >( srvfd, tmp ) );
-    add_read_fd( m_epollfd, cltfd );
+    m_bound++;
     add_read_fd( m_epollfd, srvfd );
     log( LOG_INFO, __FILE__, __LINE__, "bind client sock %d with server sock %d", cltfd, srvfd );
+    open_mirror( tmp );
     return tmp;
 }
 
+/* what travels with the client fd from one worker to another */
+struct handoff_msg
+{
+    sockaddr_storage m_clt_address;
+    sockaddr_storage m_clt_local_address;
+    int m_limit_slot;
+};
+
+void mgr::set_peers( int idx, const vector<int>& handoff_fds )
+{
+    m_idx = idx;
+    m_handoff_fds = handoff_fds;
+}
+
+bool mgr::hand_off( conn* pending, int worker )
+{
+    /* the other worker may send a PROXY header even if we do not */
+    if( !m_logic_srv.m_send_proxy )
+    {
+        socklen_t addrlen = sizeof( pending->m_clt_local_address );
+        getsockname( pending->m_cltfd, ( struct sockaddr* )&pending->m_clt_local_address, &addrlen );
+    }
+
+    handoff_msg msg;
+    msg.m_clt_address = pending->m_clt_address;
+    msg.m_clt_local_address = pending->m_clt_local_address;
+    msg.m_limit_slot = pending->m_limit_slot;
+
+    /* the bytes already read go along in the same datagram */
+    struct iovec iov[2];
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof( msg );
+    iov[1].iov_base = pending->m_clt_buf + pending->m_clt_write_idx;
+    iov[1].iov_len = pending->m_clt_read_idx - pending->m_clt_write_idx;
+
+    char control[ CMSG_SPACE( sizeof( int ) ) ];
+    memset( control, 0, sizeof( control ) );
+    struct msghdr hdr;
+    memset( &hdr, 0, sizeof( hdr ) );
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof( control );
+    struct cmsghdr* cm = CMSG_FIRSTHDR( &hdr );
+    cm->cmsg_len = CMSG_LEN( sizeof( int ) );
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    *( int* )CMSG_DATA( cm ) = pending->m_cltfd;
+
+    if( sendmsg( m_handoff_fds[worker], &hdr, MSG_DONTWAIT ) < 0 )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "hand client over to worker %d failed: %s", worker, strerror( errno ) );
+        return false;
+    }
+    log( LOG_INFO, __FILE__, __LINE__, "hand client sock %d over to worker %d", pending->m_cltfd, worker );
+
+    /* the limiter slot now belongs to the other worker */
+    int cltfd = pending->m_cltfd;
+    closefd( m_epollfd, cltfd );
+    m_pending.erase( cltfd );
+    m_throttled.erase( cltfd );
+    pending->reset();
+    m_spare.push_back( pending );
+    return true;
+}
+
+int mgr::adopt_conns( int handoff_fd )
+{
+    int count = 0;
+    while( true )
+    {
+        conn* pending = get_spare_conn();
+        if( !pending )
+        {
+            break;
+        }
+
+        handoff_msg msg;
+        struct iovec iov[2];
+        iov[0].iov_base = &msg;
+        iov[0].iov_len = sizeof( msg );
+        iov[1].iov_base = pending->m_clt_buf;
+        iov[1].iov_len = conn::BUF_SIZE;
+        char control[ CMSG_SPACE( sizeof( int ) ) ];
+        struct msghdr hdr;
+        memset( &hdr, 0, sizeof( hdr ) );
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = 2;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof( control );
+
+        int ret = recvmsg( handoff_fd, &hdr, MSG_DONTWAIT );
+        if( ret <= 0 )
+        {
+            m_spare.push_back( pending );
+            break;
+        }
+        int cltfd = -1;
+        struct cmsghdr* cm = CMSG_FIRSTHDR( &hdr );
+        if( cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS )
+        {
+            cltfd = *( int* )CMSG_DATA( cm );
+        }
+        /* MSG_CTRUNC means the kernel could not install the fd here (EMFILE and the like) */
+        if( cltfd < 0 || ( hdr.msg_flags & MSG_CTRUNC ) || ret < ( int )sizeof( msg ) )
+        {
+            log( LOG_ERR, __FILE__, __LINE__, "dropped a handed off client: %s",
+                 ret < ( int )sizeof( msg ) ? "short message" : "fd not received" );
+            if( cltfd >= 0 )
+            {
+                close( cltfd );
+            }
+            /* the client is lost, but the slot it holds in the limiter must not be */
+            if( ret >= ( int )sizeof( msg ) && m_limiter )
+            {
+                m_limiter->release( msg.m_limit_slot );
+            }
+            m_spare.push_back( pending );
+            continue;
+        }
+        pending->init_clt( cltfd, msg.m_clt_address );
+        pending->m_clt_local_address = msg.m_clt_local_address;
+        pending->m_limit_slot = msg.m_limit_slot;
+        pending->m_clt_read_idx = ret - sizeof( msg );
+        pending->m_routed = true;
+        add_read_fd( m_epollfd, cltfd );
+        m_pending.insert( pair< int, conn* >( cltfd, pending ) );
+        count++;
+        serve_pending( pending, false );
+    }
+    return count;
+}
+
+RET_CODE mgr::process_pending( conn* pending, OP_TYPE type )
+{
+    if( type == WRITE )
+    {
+        if( !pending->m_out_entry )
+        {
+            return NOTHING;
+        }
+        RET_CODE res = write_cached( pending );
+        return ( res == OK ) ? serve_pending( pending, false ) : ( res == CLOSED ? CLOSED : OK );
+    }
+    if( type != READ )
+    {
+        return NOTHING;
+    }
+    int read_idx = pending->m_clt_read_idx;
+    RET_CODE res = pending->read_clt();
+    charge_clt_read( pending, pending->m_clt_read_idx - read_idx );
+    if( res == IOERR || res == CLOSED )
+    {
+        free_pending( pending );
+        return CLOSED;
+    }
+    if( pending->m_proxy_expect )
+    {
+        RET_CODE proxy_res = accept_proxy_header( pending );
+        if( proxy_res == IOERR )
+        {
+            free_pending( pending );
+            return CLOSED;
+        }
+        if( proxy_res == NOTHING )
+        {
+            return OK;
+        }
+    }
+    /* the next request waits until the cached response is out, or the one it waits for arrives */
+    if( pending->m_out_entry || pending->m_parked )
+    {
+        return OK;
+    }
+    return serve_pending( pending, res == BUFFER_FULL );
+}
+
+RET_CODE mgr::serve_pending( conn* pending, bool full )
+{
+    while( pending->m_clt_read_idx > pending->m_clt_write_idx )
+    {
+        http_head head;
+        int head_len = parse_http_head( pending->m_clt_buf + pending->m_clt_write_idx,
+                                        pending->m_clt_read_idx - pending->m_clt_write_idx, &head );
+        if( head_len == 0 && !full )
+        {
+            return OK;
+        }
+
+        if( head_len > 0 && m_router && !pending->m_routed )
+        {
+            pending->m_routed = true;
+            int target = m_router->match( head );
+            if( target >= 0 )
+            {
+                const vector<int>& workers = m_router->target_workers( target );
+                bool local = false;
+                for( int i = 0; i < workers.size(); ++i )
+                {
+                    if( workers[i] == m_idx )
+                    {
+                        local = true;
+                        break;
+                    }
+                }
+                if( !local && hand_off( pending, workers[ m_next_peer++ % workers.size() ] ) )
+                {
+                    return CLOSED;
+                }
+            }
+        }
+
+        string key;
+        uint64_t hash = 0;
+        bool cacheable = head_len > 0 && m_cache && cache::request_key( head, &key, &hash );
+        if( cacheable )
+        {
+            cache_entry* entry = m_cache->lookup( key, hash );
+            if( entry )
+            {
+                log( LOG_DEBUG, __FILE__, __LINE__, "client sock %d served from cache", pending->m_cltfd );
+                pending->start_cached( entry, time( NULL ) - entry->m_stored, head.m_keep_alive );
+                pending->m_clt_write_idx += head_len;
+                if( pending->m_clt_write_idx == pending->m_clt_read_idx )
+                {
+                    pending->m_clt_read_idx = pending->m_clt_write_idx = 0;
+                }
+                RET_CODE res = write_cached( pending );
+                if( res != OK )
+                {
+                    return ( res == CLOSED ) ? CLOSED : OK;
+                }
+                full = false;
+                continue;
+            }
+
+            map< uint64_t, flight >::iterator iter = m_flights.find( hash );
+            if( m_cache->coalesce() && !pending->m_no_coalesce && iter != m_flights.end() && iter->second.m_key == key )
+            {
+                /* the head stays in the buffer and is parsed again when the response is there */
+                log( LOG_DEBUG, __FILE__, __LINE__, "client sock %d waits for a fetch in flight", pending->m_cltfd );
+                pending->m_parked = true;
+                pending->m_park_hash = hash;
+                iter->second.m_waiters.push_back( pending );
+                m_coalesced++;
+                arm_clt_read( pending );
+                return OK;
+            }
+        }
+
+        /* the rest of the connection is relayed, the first response may still fill the cache;
+         * the client may still be armed for the write of an earlier cached response */
+        arm_clt_read( pending );
+        bool no_coalesce = pending->m_no_coalesce;
+        conn* connection = bind_pending( pending );
+        if( !connection )
+        {
+            free_pending( pending );
+            return CLOSED;
+        }
+        if( cacheable )
+        {
+            try
+            {
+                connection->m_fill = new cache_fill( key, hash, m_cache->max_object() );
+            }
+            catch( ... )
+            {
+                connection->m_fill = NULL;
+            }
+            if( connection->m_fill && m_cache->coalesce() && !no_coalesce && m_flights.find( hash ) == m_flights.end() )
+            {
+                flight& fetch = m_flights[ hash ];
+                fetch.m_leader = connection;
+                fetch.m_key = key;
+                m_flights_led++;
+            }
+        }
+        modfd( m_epollfd, connection->m_srvfd, EPOLLOUT );
+        return OK;
+    }
+
+    /* a cached response went out and nothing else is buffered */
+    if( pending->m_clt_write_idx > 0 )
+    {
+        pending->m_clt_read_idx = pending->m_clt_write_idx = 0;
+    }
+    arm_clt_read( pending );
+    return OK;
+}
+
+/* OK once the response is out, TRY_AGAIN while the client is slow */
+RET_CODE mgr::write_cached( conn* pending )
+{
+    RET_CODE res = pending->write_cached();
+    switch( res )
+    {
+        case TRY_AGAIN:
+        {
+            modfd( m_epollfd, pending->m_cltfd, EPOLLOUT );
+            return TRY_AGAIN;
+        }
+        case BUFFER_EMPTY:
+        {
+            m_cache->release( pending->m_out_entry );
+            pending->m_out_entry = NULL;
+            if( pending->m_out_close )
+            {
+                free_pending( pending );
+                return CLOSED;
+            }
+            return OK;
+        }
+        default:
+        {
+            free_pending( pending );
+            return CLOSED;
+        }
+    }
+}
+
+void mgr::fill_cache( conn* connection, int read_idx )
+{
+    int ret = connection->m_fill->feed( connection->m_srv_buf + read_idx, connection->m_srv_read_idx - read_idx );
+    if( ret == cache_fill::FILL_MORE )
+    {
+        return;
+    }
+    if( ret == cache_fill::FILL_DONE )
+    {
+        /* stored first, so pipelined requests of the waiters already hit */
+        cache_entry* entry = connection->m_fill->take_entry();
+        if( entry->storable() )
+        {
+            entry->m_refs++;
+            m_cache->insert( entry );
+        }
+        end_flight( connection, entry );
+        m_cache->release( entry );
+    }
+    else
+    {
+        end_flight( connection, NULL );
+    }
+    delete connection->m_fill;
+    connection->m_fill = NULL;
+}
+
+void mgr::end_flight( conn* leader, cache_entry* entry )
+{
+    map< uint64_t, flight >::iterator iter = m_flights.find( leader->m_fill->hash() );
+    if( iter == m_flights.end() || iter->second.m_leader != leader )
+    {
+        return;
+    }
+    vector< conn* > waiters;
+    waiters.swap( iter->second.m_waiters );
+    m_flights.erase( iter );
+
+    for( int i = 0; i < waiters.size(); ++i )
+    {
+        conn* waiter = waiters[i];
+        waiter->m_parked = false;
+        http_head head;
+        if( !entry || parse_http_head( waiter->m_clt_buf + waiter->m_clt_write_idx,
+                                       waiter->m_clt_read_idx - waiter->m_clt_write_idx, &head ) <= 0 )
+        {
+            waiter->m_no_coalesce = true;
+            m_released++;
+            serve_pending( waiter, false );
+            continue;
+        }
+        /* every waiter writes from the same entry and holds its own reference */
+        entry->m_refs++;
+        waiter->start_cached( entry, time( NULL ) - entry->m_stored, head.m_keep_alive );
+        waiter->m_clt_write_idx += head.m_head_len;
+        if( waiter->m_clt_write_idx == waiter->m_clt_read_idx )
+        {
+            waiter->m_clt_read_idx = waiter->m_clt_write_idx = 0;
+        }
+        m_fanned_out++;
+        if( write_cached( waiter ) == OK )
+        {
+            serve_pending( waiter, false );
+        }
+    }
+}
+
+void mgr::open_mirror( conn* connection )
+{
+    if( !m_logic_srv.m_mirror_port )
+    {
+        return;
+    }
+    if( !connection->open_mirror( m_mirror_address ) )
+    {
+        log( LOG_ERR, __FILE__, __LINE__, "connect to mirror failed: %s", strerror( errno ) );
+        return;
+    }
+    add_read_fd( m_epollfd, connection->m_mirrorfd );
+    m_mirrors.insert( pair< int, conn* >( connection->m_mirrorfd, connection ) );
+    m_mirrors_opened++;
+}
+
+void mgr::drop_mirror( conn* connection, const char* why )
+{
+    if( connection->m_mirrorfd < 0 )
+    {
+        return;
+    }
+    if( why )
+    {
+        log( LOG_INFO, __FILE__, __LINE__, "drop mirror of client sock %d: %s", connection->m_cltfd, why );
+        m_mirrors_dropped++;
+    }
+    else
+    {
+        /* the client is done: send what we can without waiting, and read the answers so close() does not reset */
+        connection->flush_mirror();
+        connection->drain_mirror();
+    }
+    removefd( m_epollfd, connection->m_mirrorfd );
+    m_mirrors.erase( connection->m_mirrorfd );
+    connection->close_mirror();
+}
+
+void mgr::mirror_clt_bytes( conn* connection, int from, int to )
+{
+    if( to <= from )
+    {
+        return;
+    }
+    /* the pipe is the mirror's whole allowance, once it is full the mirror goes */
+    if( !connection->mirror( connection->m_clt_buf + from, to - from ) )
+    {
+        drop_mirror( connection, "fell behind" );
+        return;
+    }
+    m_mirrored_bytes += to - from;
+    RET_CODE res = connection->flush_mirror();
+    if( res == TRY_AGAIN )
+    {
+        modfd( m_epollfd, connection->m_mirrorfd, EPOLLOUT );
+    }
+    else if( res == IOERR || res == CLOSED )
+    {
+        drop_mirror( connection, "mirror connection failed" );
+    }
+}
+
+void mgr::log_stats()
+{
+    log( LOG_INFO, __FILE__, __LINE__, "worker %d: %d bound, %d pending, %d idle server conns",
+         m_idx, m_bound, ( int )m_pending.size(), ( int )m_conns.size() );
+    if( m_cache )
+    {
+        log( LOG_INFO, __FILE__, __LINE__, "worker %d cache: %ld hits, %ld shared hits, %ld misses, %ld stores, %ld evictions",
+             m_idx, m_cache->m_hits, m_cache->m_shared_hits, m_cache->m_misses, m_cache->m_stores, m_cache->m_evictions );
+        log( LOG_INFO, __FILE__, __LINE__, "worker %d coalescing: %ld fetches led, %ld requests waited, %ld served from a shared response, %ld sent to the server alone",
+             m_idx, m_flights_led, m_coalesced, m_fanned_out, m_released );
+    }
+    if( m_logic_srv.m_mirror_port )
+    {
+        log( LOG_INFO, __FILE__, __LINE__, "worker %d mirror: %ld opened, %ld dropped, %ld bytes copied",
+             m_idx, m_mirrors_opened, m_mirrors_dropped, m_mirrored_bytes );
+    }
+}
+
 void mgr::free_conn( conn* connection )
 {
     int cltfd = connection->m_cltfd;
@@ -117,6 +742,19 @@ void mgr::free_conn( conn* connection )
     closefd( m_epollfd, srvfd );
     m_used.erase( cltfd );
     m_used.erase( srvfd );
+    m_bound--;
+    m_throttled.erase( cltfd );
+    if( m_limiter )
+    {
+        m_limiter->release( connection->m_limit_slot );
+    }
+    drop_mirror( connection, NULL );
+    if( connection->m_fill )
+    {
+        end_flight( connection, NULL );
+        delete connection->m_fill;
+        connection->m_fill = NULL;
+    }
     connection->reset();
     m_freed.insert( pair< int, conn* >( srvfd, connection ) );
 }
@@ -147,13 +785,87 @@ void mgr::recycle_conns()
     m_freed.clear();
 }
 
+void mgr::arm_clt_read( conn* connection )
+{
+    /* a throttled client stays silent until unthrottle_conns() re-arms it */
+    modfd( m_epollfd, connection->m_cltfd, connection->m_throttled ? 0 : EPOLLIN );
+}
+
+void mgr::charge_clt_read( conn* connection, int bytes )
+{
+    if( !m_limiter || bytes <= 0 )
+    {
+        return;
+    }
+    if( !m_limiter->consume( connection->m_limit_slot, bytes ) )
+    {
+        connection->m_throttled = true;
+        m_throttled.insert( pair< int, conn* >( connection->m_cltfd, connection ) );
+        modfd( m_epollfd, connection->m_cltfd, 0 );
+    }
+}
+
+RET_CODE mgr::accept_proxy_header( conn* connection )
+{
+    RET_CODE res = connection->read_proxy_header();
+    if( res != OK || !m_limiter )
+    {
+        return res;
+    }
+    /* the limits belong to the client behind the balancer, not to the balancer */
+    m_limiter->release( connection->m_limit_slot );
+    connection->m_limit_slot = m_limiter->admit( connection->m_clt_address );
+    if( connection->m_limit_slot == limiter::REJECTED )
+    {
+        log( LOG_DEBUG, __FILE__, __LINE__, "client sock %d is over its limits", connection->m_cltfd );
+        return IOERR;
+    }
+    return OK;
+}
+
+void mgr::unthrottle_conns()
+{
+    map< int, conn* >::iterator iter = m_throttled.begin();
+    while( iter != m_throttled.end() )
+    {
+        conn* connection = iter->second;
+        if( !m_limiter->can_read( connection->m_limit_slot ) )
+        {
+            ++iter;
+            continue;
+        }
+        connection->m_throttled = false;
+        /* only resume reading if the client is not waiting for its own writes to finish */
+        if( !connection->m_out_entry
+            && ( connection->m_srvfd == -1 || ( connection->m_clt_read_idx == 0 && connection->m_srv_read_idx == 0 ) ) )
+        {
+            modfd( m_epollfd, connection->m_cltfd, EPOLLIN );
+        }
+        m_throttled.erase( iter++ );
+    }
+}
+
 RET_CODE mgr::process( int fd, OP_TYPE type )
 {
-    conn* connection = m_used[ fd ];
-    if( !connection )
+    if( !m_pending.empty() )
     {
-        return NOTHING;
+        map< int, conn* >::iterator iter = m_pending.find( fd );
+        if( iter != m_pending.end() )
+        {
+            return process_pending( iter->second, type );
+        }
     }
+    /* find, not operator[]: an unknown fd must not leave an empty entry that counts as load */
+    map< int, conn* >::iterator used = m_used.find( fd );
+    if( used == m_used.end() )
+    {
+        used = m_mirrors.find( fd );
+        if( used == m_mirrors.end() )
+        {
+            return NOTHING;
+        }
+    }
+    conn* connection = used->second;
     if( connection->m_cltfd == fd )
     {
         int srvfd = connection->m_srvfd;
@@ -161,7 +873,22 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
         {
             case READ:
             {
+                int read_idx = connection->m_clt_read_idx;
                 RET_CODE res = connection->read_clt();
+                charge_clt_read( connection, connection->m_clt_read_idx - read_idx );
+                if( connection->m_proxy_expect && ( res == OK || res == BUFFER_FULL ) )
+                {
+                    RET_CODE proxy_res = accept_proxy_header( connection );
+                    if( proxy_res == IOERR )
+                    {
+                        free_conn( connection );
+                        return CLOSED;
+                    }
+                    if( proxy_res == NOTHING )
+                    {
+                        break;
+                    }
+                }
                 switch( res )
                 {
                     case OK:
@@ -202,7 +929,7 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                     case BUFFER_EMPTY:
                     {
                         modfd( m_epollfd, srvfd, EPOLLIN );
-                        modfd( m_epollfd, fd, EPOLLIN );
+                        arm_clt_read( connection );
                         break;
                     }
                     case IOERR:
@@ -235,7 +962,12 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
         {
             case READ:
             {
+                int read_idx = connection->m_srv_read_idx;
                 RET_CODE res = connection->read_srv();
+                if( connection->m_fill && connection->m_srv_read_idx > read_idx )
+                {
+                    fill_cache( connection, read_idx );
+                }
                 switch( res )
                 {
                     case OK:
@@ -261,7 +993,14 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
             }
             case WRITE:
             {
+                int write_idx = connection->m_clt_write_idx;
+                int read_idx = connection->m_clt_read_idx;
                 RET_CODE res = connection->write_srv();
+                if( connection->m_mirrorfd >= 0 )
+                {
+                    /* BUFFER_EMPTY has already rewound the indices, everything up to read_idx went out */
+                    mirror_clt_bytes( connection, write_idx, ( res == BUFFER_EMPTY ) ? read_idx : connection->m_clt_write_idx );
+                }
                 switch( res )
                 {
                     case TRY_AGAIN:
@@ -271,7 +1010,7 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
                     }
                     case BUFFER_EMPTY:
                     {
-                        modfd( m_epollfd, cltfd, EPOLLIN );
+                        arm_clt_read( connection );
                         modfd( m_epollfd, fd, EPOLLIN );
                         break;
                     }
@@ -304,6 +1043,32 @@ RET_CODE mgr::process( int fd, OP_TYPE type )
             }
         }
     }
+    else if( connection->m_mirrorfd == fd )
+    {
+        /* nothing the mirror does may affect the client */
+        RET_CODE res = ( type == READ ) ? connection->drain_mirror() : connection->flush_mirror();
+        switch( res )
+        {
+            case TRY_AGAIN:
+            {
+                modfd( m_epollfd, fd, EPOLLOUT );
+                break;
+            }
+            case BUFFER_EMPTY:
+            {
+                modfd( m_epollfd, fd, EPOLLIN );
+                break;
+            }
+            case IOERR:
+            case CLOSED:
+            {
+                drop_mirror( connection, "mirror connection failed" );
+                break;
+            }
+            default:
+                break;
+        }
+    }
     else
     {
         return NOTHING;
@@ -2,18 +2,52 @@
 #define SRVMGR_H
 
 #include <map>
+#include <vector>
+#include <string.h>
 #include <arpa/inet.h>
 #include "fdwrapper.h"
 #include "conn.h"
+#include "limiter.h"
+#include "router.h"
+#include "cache.h"
 
 using std::map;
+using std::vector;
+using std::string;
 
 class host
 {
+public:
+    host() : m_port( 0 ), m_conncnt( 0 ), m_backlog( 1024 ), m_accept_proxy( false ), m_send_proxy( 0 ), m_mirror_port( 0 )
+    {
+        memset( m_hostname, '\0', sizeof( m_hostname ) );
+        memset( m_group, '\0', sizeof( m_group ) );
+        memset( m_mirror_name, '\0', sizeof( m_mirror_name ) );
+    }
+
 public:
     char m_hostname[1024];
     int m_port;
     int m_conncnt;
+    /* listen() backlog, only meaningful for a Listen entry */
+    int m_backlog;
+    /* backend group: a Listen entry feeds the logical hosts of the same group, an empty group feeds all */
+    char m_group[64];
+    /* Listen entry: clients come through a balancer that sends a PROXY header first */
+    bool m_accept_proxy;
+    /* logical host: PROXY protocol version (1 or 2) to send to the servers, 0 for none */
+    int m_send_proxy;
+    /* logical host: shadow server that gets a copy of the client bytes, port 0 for none */
+    char m_mirror_name[64];
+    int m_mirror_port;
+};
+
+/* a server fetch that other clients asking for the same key wait on */
+struct flight
+{
+    conn* m_leader;
+    string m_key;
+    vector< conn* > m_waiters;
 };
 
 class mgr
@@ -22,17 +56,72 @@ public:
     mgr( int epollfd, const host& srv );
     ~mgr();
     int conn2srv( const sockaddr_in& address );
-    conn* pick_conn( int sockfd );
+    conn* pick_conn( int sockfd, const sockaddr_storage& client_addr, const host& listener );
     void free_conn( conn* connection );
     int get_used_conn_cnt();
     void recycle_conns();
+    bool has_throttled() { return !m_throttled.empty(); }
+    void unthrottle_conns();
     RET_CODE process( int fd, OP_TYPE type );
+    /* this worker's index and the sockets used to hand clients over to the other workers */
+    void set_peers( int idx, const vector<int>& handoff_fds );
+    /* takes the clients other workers routed to us, returns how many */
+    int adopt_conns( int handoff_fd );
+    static void set_limiter( limiter* limit ) { m_limiter = limit; }
+    static void set_router( router* route ) { m_router = route; }
+    static void set_cache( cache* responses ) { m_cache = responses; }
+    /* writes this worker's counters to the log, on SIGUSR1 */
+    void log_stats();
+
+private:
+    conn* get_spare_conn();
+    void free_pending( conn* pending );
+    conn* bind_pending( conn* pending );
+    bool hand_off( conn* pending, int worker );
+    RET_CODE process_pending( conn* pending, OP_TYPE type );
+    /* routes the requests read so far and answers them from the cache, until one needs a server */
+    RET_CODE serve_pending( conn* pending, bool full );
+    RET_CODE write_cached( conn* pending );
+    void fill_cache( conn* connection, int read_idx );
+    /* hands the leader's response to the waiting clients, or lets them fetch alone if entry is NULL */
+    void end_flight( conn* leader, cache_entry* entry );
+    void open_mirror( conn* connection );
+    void drop_mirror( conn* connection, const char* why );
+    /* copies what just went to the server, [from, to) of the client buffer, to the mirror */
+    void mirror_clt_bytes( conn* connection, int from, int to );
+    void arm_clt_read( conn* connection );
+    void charge_clt_read( conn* connection, int bytes );
+    RET_CODE accept_proxy_header( conn* connection );
 
 private:
+    static const int MAX_PENDING = 4096;
     static int m_epollfd;
+    static limiter* m_limiter;
+    static router* m_router;
+    static cache* m_cache;
     map< int, conn* > m_conns;
     map< int, conn* > m_used;
+    /* mirror fds are kept apart so they do not count as load in get_used_conn_cnt */
+    map< int, conn* > m_mirrors;
     map< int, conn* > m_freed;
+    map< int, conn* > m_throttled;
+    /* with routing rules or a cache a client is only bound to a server once its first request is read */
+    map< int, conn* > m_pending;
+    vector< conn* > m_spare;
+    map< uint64_t, flight > m_flights;
+    long m_flights_led;
+    long m_coalesced;
+    long m_fanned_out;
+    long m_released;
+    sockaddr_in m_mirror_address;
+    long m_mirrors_opened;
+    long m_mirrors_dropped;
+    long m_mirrored_bytes;
+    /* client/server pairs currently bound, for log_stats */
+    int m_bound;
+    int m_idx;
+    int m_next_peer;
+    vector< int > m_handoff_fds;
     host m_logic_srv;
 };
 
@@ -31,19 +31,21 @@ public:
     int m_busy_ratio;
     pid_t m_pid;
     int m_pipefd[2];
+    /* datagram socketpair, any child writes [1] to pass a client fd to this child, which reads [0] */
+    int m_handoff[2];
 };
 
 template< typename C, typename H, typename M >
 class processpool
 {
 private:
-    processpool( int listenfd, int process_number = 8 );
+    processpool( const vector<int>& listenfds, const vector<H>& listeners, const vector< vector<int> >& listen_workers, int process_number = 8 );
 public:
-    static processpool< C, H, M >* create( int listenfd, int process_number = 8 )
+    static processpool< C, H, M >* create( const vector<int>& listenfds, const vector<H>& listeners, const vector< vector<int> >& listen_workers, int process_number = 8 )
     {
         if( !m_instance )
         {
-            m_instance = new processpool< C, H, M >( listenfd, process_number );
+            m_instance = new processpool< C, H, M >( listenfds, listeners, listen_workers, process_number );
         }
         return m_instance;
     }
@@ -55,8 +57,9 @@ public:
 
 private:
     void notify_parent_busy_ratio( int pipefd, M* manager );
-    int get_most_free_srv();
+    int get_most_free_srv( const vector<int>& workers );
     void setup_sig_pipe();
+    void accept_clients( int listen_idx, M* manager, int pipefd );
     void run_parent();
     void run_child( const vector<H>& arg );
 
@@ -67,7 +70,11 @@ private:
     int m_process_number;
     int m_idx;
     int m_epollfd;
-    int m_listenfd;
+    /* every listening socket, shared by all the children */
+    vector<int> m_listenfds;
+    vector<H> m_listeners;
+    /* for each listening socket, the children allowed to serve it */
+    vector< vector<int> > m_listen_workers;
     int m_stop;
     process* m_sub_process;
     static processpool< C, H, M >* m_instance;
@@ -76,6 +83,8 @@ template< typename C, typename H, typename M >
 processpool< C, H, M >* processpool< C, H, M >::m_instance = NULL;
 
 static int EPOLL_WAIT_TIME = 5000;
+/* how often throttled clients are re-checked against their byte buckets */
+static int THROTTLE_WAIT_TIME = 50;
 static int sig_pipefd[2];
 static void sig_handler( int sig )
 {
@@ -99,14 +108,24 @@ static void addsig( int sig, void( handler )(int), bool restart = true )
 }
 
 template< typename C, typename H, typename M >
-processpool< C, H, M >::processpool( int listenfd, int process_number ) 
-    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
+processpool< C, H, M >::processpool( const vector<int>& listenfds, const vector<H>& listeners, const vector< vector<int> >& listen_workers, int process_number )
+    : m_listenfds( listenfds ), m_listeners( listeners ), m_listen_workers( listen_workers ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
 {
     assert( ( process_number > 0 ) && ( process_number <= MAX_PROCESS_NUMBER ) );
+    assert( m_listenfds.size() > 0 && m_listenfds.size() == m_listen_workers.size() );
 
     m_sub_process = new process[ process_number ];
     assert( m_sub_process );
 
+    /* every child needs the write end of every other child's handoff socket, so make them all before forking */
+    for( int i = 0; i < process_number; ++i )
+    {
+        int ret = socketpair( PF_UNIX, SOCK_DGRAM, 0, m_sub_process[i].m_handoff );
+        assert( ret == 0 );
+        setnonblocking( m_sub_process[i].m_handoff[0] );
+        setnonblocking( m_sub_process[i].m_handoff[1] );
+    }
+
     for( int i = 0; i < process_number; ++i )
     {
         int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd );
@@ -127,19 +146,33 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
             break;
         }
     }
+
+    if( m_idx == -1 )
+    {
+        for( int i = 0; i < process_number; ++i )
+        {
+            close( m_sub_process[i].m_handoff[0] );
+            close( m_sub_process[i].m_handoff[1] );
+        }
+    }
 }
 
 template< typename C, typename H, typename M >
-int processpool< C, H, M >::get_most_free_srv()
+int processpool< C, H, M >::get_most_free_srv( const vector<int>& workers )
 {
-    int ratio = m_sub_process[0].m_busy_ratio;
-    int idx = 0;
-    for( int i = 0; i < m_process_number; ++i )
+    int idx = -1;
+    int ratio = 0;
+    for( int i = 0; i < workers.size(); ++i )
     {
-        if( m_sub_process[i].m_busy_ratio < ratio )
+        int j = workers[i];
+        if( m_sub_process[j].m_pid == -1 )
+        {
+            continue;
+        }
+        if( idx == -1 || m_sub_process[j].m_busy_ratio < ratio )
         {
-            idx = i;
-            ratio = m_sub_process[i].m_busy_ratio;
+            idx = j;
+            ratio = m_sub_process[j].m_busy_ratio;
         }
     }
     return idx;
@@ -160,6 +193,7 @@ void processpool< C, H, M >::setup_sig_pipe()
     addsig( SIGCHLD, sig_handler );
     addsig( SIGTERM, sig_handler );
     addsig( SIGINT, sig_handler );
+    addsig( SIGUSR1, sig_handler );
     addsig( SIGPIPE, SIG_IGN );
 }
 
@@ -181,6 +215,39 @@ void processpool< C, H, M >::notify_parent_busy_ratio( int pipefd, M* manager )
     send( pipefd, ( char* )&msg, 1, 0 );    
 }
 
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::accept_clients( int listen_idx, M* manager, int pipefd )
+{
+    /* the listening sockets are edge triggered in the parent, so drain the whole backlog here */
+    int listenfd = m_listenfds[ listen_idx ];
+    bool accepted = false;
+    while( true )
+    {
+        struct sockaddr_storage client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+        if ( connfd < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                log( LOG_ERR, __FILE__, __LINE__, "errno: %s", strerror( errno ) );
+            }
+            break;
+        }
+        C* conn = manager->pick_conn( connfd, client_address, m_listeners[ listen_idx ] );
+        if( !conn )
+        {
+            close( connfd );
+            continue;
+        }
+        accepted = true;
+    }
+    if( accepted )
+    {
+        notify_parent_busy_ratio( pipefd, manager );
+    }
+}
+
 template< typename C, typename H, typename M >
 void processpool< C, H, M >::run_child( const vector<H>& arg )
 {
@@ -194,18 +261,32 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
     M* manager = new M( m_epollfd, arg[m_idx] );
     assert( manager );
 
+    int handoff_read = m_sub_process[m_idx].m_handoff[ 0 ];
+    add_read_fd( m_epollfd, handoff_read );
+    vector<int> handoff_fds;
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        handoff_fds.push_back( m_sub_process[i].m_handoff[ 1 ] );
+    }
+    manager->set_peers( m_idx, handoff_fds );
+
     int number = 0;
     int ret = -1;
 
     while( ! m_stop )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, EPOLL_WAIT_TIME );
+        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, manager->has_throttled() ? THROTTLE_WAIT_TIME : EPOLL_WAIT_TIME );
         if ( ( number < 0 ) && ( errno != EINTR ) )
         {
             log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
             break;
         }
 
+        if( manager->has_throttled() )
+        {
+            manager->unthrottle_conns();
+        }
+
         if( number == 0 )
         {
             manager->recycle_conns();
@@ -217,30 +298,21 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
             int sockfd = events[i].data.fd;
             if( ( sockfd == pipefd_read ) && ( events[i].events & EPOLLIN ) )
             {
-                int client = 0;
-                ret = recv( sockfd, ( char* )&client, sizeof( client ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 ) 
+                /* the parent may have queued several notifications since the last wake up */
+                int listen_idx = 0;
+                while( ( ret = recv( sockfd, ( char* )&listen_idx, sizeof( listen_idx ), 0 ) ) == sizeof( listen_idx ) )
                 {
-                    continue;
-                }
-                else
-                {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                    if ( connfd < 0 )
-                    {
-                        log( LOG_ERR, __FILE__, __LINE__, "errno: %s", strerror( errno ) );
-                        continue;
-                    }
-                    add_read_fd( m_epollfd, connfd );
-                    C* conn = manager->pick_conn( connfd );
-                    if( !conn )
+                    if( listen_idx < 0 || listen_idx >= m_listenfds.size() )
                     {
-                        closefd( m_epollfd, connfd );
                         continue;
                     }
-                    conn->init_clt( connfd, client_address );
+                    accept_clients( listen_idx, manager, pipefd_read );
+                }
+            }
+            else if( ( sockfd == handoff_read ) && ( events[i].events & EPOLLIN ) )
+            {
+                if( manager->adopt_conns( handoff_read ) > 0 )
+                {
                     notify_parent_busy_ratio( pipefd_read, manager );
                 }
             }
@@ -275,6 +347,11 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
                                 m_stop = true;
                                 break;
                             }
+                            case SIGUSR1:
+                            {
+                                manager->log_stats();
+                                break;
+                            }
                             default:
                             {
                                 break;
@@ -319,6 +396,7 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
     }
 
     close( pipefd_read );
+    close( handoff_read );
     close( m_epollfd );
 }
 
@@ -332,11 +410,12 @@ void processpool< C, H, M >::run_parent()
         add_read_fd( m_epollfd, m_sub_process[i].m_pipefd[ 0 ] );
     }
 
-    add_read_fd( m_epollfd, m_listenfd );
+    for( int i = 0; i < m_listenfds.size(); ++i )
+    {
+        add_read_fd( m_epollfd, m_listenfds[i] );
+    }
 
     epoll_event events[ MAX_EVENT_NUMBER ];
-    int sub_process_counter = 0;
-    int new_conn = 1;
     int number = 0;
     int ret = -1;
 
@@ -352,30 +431,25 @@ void processpool< C, H, M >::run_parent()
         for ( int i = 0; i < number; i++ )
         {
             int sockfd = events[i].data.fd;
-            if( sockfd == m_listenfd )
+            int listen_idx = -1;
+            for( int j = 0; j < m_listenfds.size(); ++j )
             {
-                /*
-                int i =  sub_process_counter;
-                do
+                if( sockfd == m_listenfds[j] )
                 {
-                    if( m_sub_process[i].m_pid != -1 )
-                    {
-                        break;
-                    }
-                    i = (i+1)%m_process_number;
+                    listen_idx = j;
+                    break;
                 }
-                while( i != sub_process_counter );
-                
-                if( m_sub_process[i].m_pid == -1 )
+            }
+            if( listen_idx != -1 )
+            {
+                int idx = get_most_free_srv( m_listen_workers[ listen_idx ] );
+                if( idx == -1 )
                 {
-                    m_stop = true;
-                    break;
+                    log( LOG_ERR, __FILE__, __LINE__, "no child left to serve listener %d", listen_idx );
+                    continue;
                 }
-                sub_process_counter = (i+1)%m_process_number;
-                */
-                int idx = get_most_free_srv();
-                send( m_sub_process[idx].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
-                log( LOG_INFO, __FILE__, __LINE__, "send request to child %d", idx );
+                send( m_sub_process[idx].m_pipefd[0], ( char* )&listen_idx, sizeof( listen_idx ), 0 );
+                log( LOG_INFO, __FILE__, __LINE__, "send request on listener %d to child %d", listen_idx, idx );
             }
             else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
             {
@@ -432,6 +506,17 @@ void processpool< C, H, M >::run_parent()
                                 }
                                 break;
                             }
+                            case SIGUSR1:
+                            {
+                                for( int i = 0; i < m_process_number; ++i )
+                                {
+                                    if( m_sub_process[i].m_pid != -1 )
+                                    {
+                                        kill( m_sub_process[i].m_pid, SIGUSR1 );
+                                    }
+                                }
+                                break;
+                            }
                             default:
                             {
                                 break;
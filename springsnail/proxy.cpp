@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy.h"
+
+static const char v2_signature[12] = { '\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n' };
+
+static int build_v1( const sockaddr_storage& src, const sockaddr_storage& dst, char* buf, int len )
+{
+    char src_ip[INET6_ADDRSTRLEN];
+    char dst_ip[INET6_ADDRSTRLEN];
+    int ret = 0;
+    if( src.ss_family == AF_INET && dst.ss_family == AF_INET )
+    {
+        const sockaddr_in* s = ( const sockaddr_in* )&src;
+        const sockaddr_in* d = ( const sockaddr_in* )&dst;
+        inet_ntop( AF_INET, &s->sin_addr, src_ip, sizeof( src_ip ) );
+        inet_ntop( AF_INET, &d->sin_addr, dst_ip, sizeof( dst_ip ) );
+        ret = snprintf( buf, len, "PROXY TCP4 %s %s %d %d\r\n", src_ip, dst_ip, ntohs( s->sin_port ), ntohs( d->sin_port ) );
+    }
+    else if( src.ss_family == AF_INET6 && dst.ss_family == AF_INET6 )
+    {
+        const sockaddr_in6* s = ( const sockaddr_in6* )&src;
+        const sockaddr_in6* d = ( const sockaddr_in6* )&dst;
+        inet_ntop( AF_INET6, &s->sin6_addr, src_ip, sizeof( src_ip ) );
+        inet_ntop( AF_INET6, &d->sin6_addr, dst_ip, sizeof( dst_ip ) );
+        ret = snprintf( buf, len, "PROXY TCP6 %s %s %d %d\r\n", src_ip, dst_ip, ntohs( s->sin6_port ), ntohs( d->sin6_port ) );
+    }
+    else
+    {
+        ret = snprintf( buf, len, "PROXY UNKNOWN\r\n" );
+    }
+    return ( ret > 0 && ret < len ) ? ret : -1;
+}
+
+static int build_v2( const sockaddr_storage& src, const sockaddr_storage& dst, char* buf, int len )
+{
+    if( len < 16 )
+    {
+        return -1;
+    }
+    memcpy( buf, v2_signature, sizeof( v2_signature ) );
+    unsigned char* p = ( unsigned char* )buf;
+    p[12] = 0x21;
+    int addr_len = 0;
+    if( src.ss_family == AF_INET && dst.ss_family == AF_INET )
+    {
+        addr_len = 12;
+        if( len < 16 + addr_len )
+        {
+            return -1;
+        }
+        const sockaddr_in* s = ( const sockaddr_in* )&src;
+        const sockaddr_in* d = ( const sockaddr_in* )&dst;
+        p[13] = 0x11;
+        memcpy( p + 16, &s->sin_addr, 4 );
+        memcpy( p + 20, &d->sin_addr, 4 );
+        memcpy( p + 24, &s->sin_port, 2 );
+        memcpy( p + 26, &d->sin_port, 2 );
+    }
+    else if( src.ss_family == AF_INET6 && dst.ss_family == AF_INET6 )
+    {
+        addr_len = 36;
+        if( len < 16 + addr_len )
+        {
+            return -1;
+        }
+        const sockaddr_in6* s = ( const sockaddr_in6* )&src;
+        const sockaddr_in6* d = ( const sockaddr_in6* )&dst;
+        p[13] = 0x21;
+        memcpy( p + 16, &s->sin6_addr, 16 );
+        memcpy( p + 32, &d->sin6_addr, 16 );
+        memcpy( p + 48, &s->sin6_port, 2 );
+        memcpy( p + 50, &d->sin6_port, 2 );
+    }
+    else
+    {
+        /* LOCAL command, the receiver keeps the real connection endpoints */
+        p[12] = 0x20;
+        p[13] = 0x00;
+    }
+    p[14] = addr_len >> 8;
+    p[15] = addr_len & 0xff;
+    return 16 + addr_len;
+}
+
+/* an IPv4 endpoint paired with an IPv6 one is written v4-mapped */
+static void map_v6( const sockaddr_storage& addr, sockaddr_storage* mapped )
+{
+    const sockaddr_in* v4 = ( const sockaddr_in* )&addr;
+    sockaddr_in6* v6 = ( sockaddr_in6* )mapped;
+    memset( mapped, 0, sizeof( *mapped ) );
+    v6->sin6_family = AF_INET6;
+    v6->sin6_port = v4->sin_port;
+    v6->sin6_addr.s6_addr[10] = 0xff;
+    v6->sin6_addr.s6_addr[11] = 0xff;
+    memcpy( v6->sin6_addr.s6_addr + 12, &v4->sin_addr, 4 );
+}
+
+int proxy_build( int version, const sockaddr_storage& src, const sockaddr_storage& dst, char* buf, int len )
+{
+    sockaddr_storage mapped;
+    if( src.ss_family == AF_INET6 && dst.ss_family == AF_INET )
+    {
+        map_v6( dst, &mapped );
+        return version == 1 ? build_v1( src, mapped, buf, len ) : build_v2( src, mapped, buf, len );
+    }
+    if( src.ss_family == AF_INET && dst.ss_family == AF_INET6 )
+    {
+        map_v6( src, &mapped );
+        return version == 1 ? build_v1( mapped, dst, buf, len ) : build_v2( mapped, dst, buf, len );
+    }
+    return version == 1 ? build_v1( src, dst, buf, len ) : build_v2( src, dst, buf, len );
+}
+
+static int parse_v1( const char* buf, int len, sockaddr_storage* src )
+{
+    const char* end = ( const char* )memchr( buf, '\n', len < PROXY_HEADER_MAX ? len : PROXY_HEADER_MAX );
+    if( !end )
+    {
+        return len < PROXY_HEADER_MAX ? 0 : -1;
+    }
+    if( end == buf || end[-1] != '\r' )
+    {
+        return -1;
+    }
+    int header_len = end - buf + 1;
+    char line[PROXY_HEADER_MAX];
+    memcpy( line, buf, header_len - 2 );
+    line[header_len - 2] = '\0';
+
+    char* save = NULL;
+    strtok_r( line, " ", &save );
+    char* proto = strtok_r( NULL, " ", &save );
+    if( !proto )
+    {
+        return -1;
+    }
+    if( strcmp( proto, "UNKNOWN" ) == 0 )
+    {
+        return header_len;
+    }
+    char* src_ip = strtok_r( NULL, " ", &save );
+    char* dst_ip = strtok_r( NULL, " ", &save );
+    char* src_port = strtok_r( NULL, " ", &save );
+    char* dst_port = strtok_r( NULL, " ", &save );
+    if( !src_ip || !dst_ip || !src_port || !dst_port )
+    {
+        return -1;
+    }
+    sockaddr_storage addr;
+    memset( &addr, 0, sizeof( addr ) );
+    if( strcmp( proto, "TCP4" ) == 0 )
+    {
+        sockaddr_in* s = ( sockaddr_in* )&addr;
+        s->sin_family = AF_INET;
+        s->sin_port = htons( atoi( src_port ) );
+        if( inet_pton( AF_INET, src_ip, &s->sin_addr ) != 1 )
+        {
+            return -1;
+        }
+    }
+    else if( strcmp( proto, "TCP6" ) == 0 )
+    {
+        sockaddr_in6* s = ( sockaddr_in6* )&addr;
+        s->sin6_family = AF_INET6;
+        s->sin6_port = htons( atoi( src_port ) );
+        if( inet_pton( AF_INET6, src_ip, &s->sin6_addr ) != 1 )
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    *src = addr;
+    return header_len;
+}
+
+static int parse_v2( const unsigned char* p, int len, sockaddr_storage* src )
+{
+    if( len < 16 )
+    {
+        return 0;
+    }
+    if( ( p[12] & 0xf0 ) != 0x20 )
+    {
+        return -1;
+    }
+    int addr_len = ( p[14] << 8 ) | p[15];
+    if( len < 16 + addr_len )
+    {
+        return 0;
+    }
+    if( ( p[12] & 0x0f ) == 0x00 )
+    {
+        return 16 + addr_len;
+    }
+    if( ( p[12] & 0x0f ) != 0x01 )
+    {
+        return -1;
+    }
+    sockaddr_storage addr;
+    memset( &addr, 0, sizeof( addr ) );
+    switch( p[13] & 0xf0 )
+    {
+        case 0x10:
+        {
+            if( addr_len < 12 )
+            {
+                return -1;
+            }
+            sockaddr_in* s = ( sockaddr_in* )&addr;
+            s->sin_family = AF_INET;
+            memcpy( &s->sin_addr, p + 16, 4 );
+            memcpy( &s->sin_port, p + 24, 2 );
+            break;
+        }
+        case 0x20:
+        {
+            if( addr_len < 36 )
+            {
+                return -1;
+            }
+            sockaddr_in6* s = ( sockaddr_in6* )&addr;
+            s->sin6_family = AF_INET6;
+            memcpy( &s->sin6_addr, p + 16, 16 );
+            memcpy( &s->sin6_port, p + 48, 2 );
+            break;
+        }
+        default:
+        {
+            /* AF_UNSPEC or AF_UNIX, nothing useful to report */
+            return 16 + addr_len;
+        }
+    }
+    *src = addr;
+    return 16 + addr_len;
+}
+
+int proxy_parse( const char* buf, int len, sockaddr_storage* src )
+{
+    int n = len < sizeof( v2_signature ) ? len : sizeof( v2_signature );
+    if( memcmp( buf, v2_signature, n ) == 0 )
+    {
+        return n < sizeof( v2_signature ) ? 0 : parse_v2( ( const unsigned char* )buf, len, src );
+    }
+    n = len < 6 ? len : 6;
+    if( memcmp( buf, "PROXY ", n ) == 0 )
+    {
+        return n < 6 ? 0 : parse_v1( buf, len, src );
+    }
+    return -1;
+}
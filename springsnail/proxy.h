@@ -0,0 +1,18 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/socket.h>
+
+/* PROXY protocol (haproxy) v1 text and v2 binary headers for TCP over IPv4/IPv6 */
+
+/* the longest v1 line is 107 bytes, a v2 header carrying IPv6 addresses is 52 */
+static const int PROXY_HEADER_MAX = 108;
+
+/* writes a header for src -> dst into buf, returns its length or -1 if it does not fit */
+int proxy_build( int version, const sockaddr_storage& src, const sockaddr_storage& dst, char* buf, int len );
+
+/* returns the length of the header at the start of buf, 0 if more bytes are needed, -1 if it is not a valid header;
+ * src is left untouched for LOCAL/UNKNOWN headers */
+int proxy_parse( const char* buf, int len, sockaddr_storage* src );
+
+#endif
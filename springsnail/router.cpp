@@ -0,0 +1,207 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "router.h"
+#include "log.h"
+
+router::router() : m_rule_count( 0 )
+{
+    m_any_root = new_node( '\0' );
+}
+
+int router::new_node( char ch )
+{
+    trie_node node;
+    node.m_ch = ch;
+    node.m_child = -1;
+    node.m_sibling = -1;
+    for( int i = 0; i < METHOD_COUNT; ++i )
+    {
+        node.m_targets[i] = -1;
+    }
+    m_nodes.push_back( node );
+    return m_nodes.size() - 1;
+}
+
+int router::method_index( const char* method, int len )
+{
+    static const char* methods[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH" };
+    for( int i = 0; i < OTHER; ++i )
+    {
+        if( strlen( methods[i] ) == len && strncmp( methods[i], method, len ) == 0 )
+        {
+            return i;
+        }
+    }
+    return OTHER;
+}
+
+unsigned int router::host_hash( const char* host, int len )
+{
+    unsigned int hash = 2166136261u;
+    for( int i = 0; i < len; ++i )
+    {
+        hash = ( hash ^ ( unsigned char )tolower( host[i] ) ) * 16777619u;
+    }
+    return hash;
+}
+
+int router::add_target( const vector<int>& workers )
+{
+    m_targets.push_back( workers );
+    return m_targets.size() - 1;
+}
+
+bool router::add_rule( const route& rule, int target )
+{
+    if( target < 0 || target >= m_targets.size() )
+    {
+        return false;
+    }
+
+    int root = m_any_root;
+    if( rule.m_host[0] != '\0' )
+    {
+        unsigned int hash = host_hash( rule.m_host, strlen( rule.m_host ) );
+        root = -1;
+        for( int i = 0; i < m_host_list.size(); ++i )
+        {
+            if( m_host_list[i].m_hash == hash && strcasecmp( m_host_list[i].m_name.c_str(), rule.m_host ) == 0 )
+            {
+                root = m_host_list[i].m_root;
+                break;
+            }
+        }
+        if( root == -1 )
+        {
+            host_slot slot;
+            slot.m_hash = hash;
+            slot.m_root = root = new_node( '\0' );
+            slot.m_name = rule.m_host;
+            m_host_list.push_back( slot );
+        }
+    }
+
+    int node = root;
+    for( const char* p = rule.m_path; *p; ++p )
+    {
+        int child = m_nodes[node].m_child;
+        while( child != -1 && m_nodes[child].m_ch != *p )
+        {
+            child = m_nodes[child].m_sibling;
+        }
+        if( child == -1 )
+        {
+            child = new_node( *p );
+            m_nodes[child].m_sibling = m_nodes[node].m_child;
+            m_nodes[node].m_child = child;
+        }
+        node = child;
+    }
+
+    /* the first rule in the file wins when two rules overlap */
+    if( rule.m_method[0] == '\0' )
+    {
+        for( int i = 0; i < METHOD_COUNT; ++i )
+        {
+            if( m_nodes[node].m_targets[i] == -1 )
+            {
+                m_nodes[node].m_targets[i] = target;
+            }
+        }
+    }
+    else
+    {
+        int method = method_index( rule.m_method, strlen( rule.m_method ) );
+        if( m_nodes[node].m_targets[method] == -1 )
+        {
+            m_nodes[node].m_targets[method] = target;
+        }
+    }
+    m_rule_count++;
+    return true;
+}
+
+void router::compile()
+{
+    /* open addressing, at most half full */
+    int size = 1;
+    while( size < m_host_list.size() * 2 )
+    {
+        size <<= 1;
+    }
+    host_slot empty;
+    empty.m_hash = 0;
+    empty.m_root = -1;
+    m_host_table.assign( size, empty );
+    for( int i = 0; i < m_host_list.size(); ++i )
+    {
+        int idx = m_host_list[i].m_hash & ( size - 1 );
+        while( m_host_table[idx].m_root != -1 )
+        {
+            idx = ( idx + 1 ) & ( size - 1 );
+        }
+        m_host_table[idx] = m_host_list[i];
+    }
+    log( LOG_INFO, __FILE__, __LINE__, "%d routing rules, %d host names, %d trie nodes", m_rule_count, ( int )m_host_list.size(), ( int )m_nodes.size() );
+}
+
+const router::host_slot* router::find_host( const char* host, int len ) const
+{
+    if( m_host_table.empty() )
+    {
+        return NULL;
+    }
+    unsigned int hash = host_hash( host, len );
+    int mask = m_host_table.size() - 1;
+    for( int idx = hash & mask; m_host_table[idx].m_root != -1; idx = ( idx + 1 ) & mask )
+    {
+        const host_slot& slot = m_host_table[idx];
+        if( slot.m_hash == hash && slot.m_name.size() == len && strncasecmp( slot.m_name.c_str(), host, len ) == 0 )
+        {
+            return &slot;
+        }
+    }
+    return NULL;
+}
+
+/* longest path prefix with a target for the method */
+int router::walk( int root, const char* path, int len, int method ) const
+{
+    int node = root;
+    int target = m_nodes[node].m_targets[method];
+    for( int i = 0; i < len; ++i )
+    {
+        int child = m_nodes[node].m_child;
+        while( child != -1 && m_nodes[child].m_ch != path[i] )
+        {
+            child = m_nodes[child].m_sibling;
+        }
+        if( child == -1 )
+        {
+            break;
+        }
+        node = child;
+        if( m_nodes[node].m_targets[method] != -1 )
+        {
+            target = m_nodes[node].m_targets[method];
+        }
+    }
+    return target;
+}
+
+int router::match( const http_head& head ) const
+{
+    int method = method_index( head.m_method, head.m_method_len );
+    int target = NO_ROUTE;
+    const host_slot* slot = head.m_host ? find_host( head.m_host, head.m_host_len ) : NULL;
+    if( slot )
+    {
+        target = walk( slot->m_root, head.m_path, head.m_path_len, method );
+    }
+    if( target == NO_ROUTE )
+    {
+        target = walk( m_any_root, head.m_path, head.m_path_len, method );
+    }
+    return target;
+}
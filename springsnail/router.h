@@ -0,0 +1,81 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include "http_head.h"
+
+using std::string;
+using std::vector;
+
+/* one <route> block of config.xml, an empty field matches anything */
+class route
+{
+public:
+    route()
+    {
+        memset( m_method, '\0', sizeof( m_method ) );
+        memset( m_host, '\0', sizeof( m_host ) );
+        memset( m_path, '\0', sizeof( m_path ) );
+        memset( m_target, '\0', sizeof( m_target ) );
+    }
+
+public:
+    char m_method[16];
+    char m_host[256];
+    char m_path[1024];
+    /* group of the logical hosts that get the matching requests */
+    char m_target[64];
+};
+
+/* picks a target for an HTTP request by Host, path prefix and method. The rules are compiled
+ * into a hash of host names, each with a path trie, and matched against the head in place */
+class router
+{
+public:
+    router();
+    /* workers serving a target group, returns the target id */
+    int add_target( const vector<int>& workers );
+    bool add_rule( const route& rule, int target );
+    void compile();
+    bool empty() const { return m_rule_count == 0; }
+    /* target id of the request, or NO_ROUTE */
+    int match( const http_head& head ) const;
+    const vector<int>& target_workers( int target ) const { return m_targets[target]; }
+
+public:
+    static const int NO_ROUTE = -1;
+
+private:
+    enum METHOD { GET = 0, HEAD, POST, PUT, DELETE, OPTIONS, PATCH, OTHER, METHOD_COUNT };
+    struct trie_node
+    {
+        char m_ch;
+        int m_child;
+        int m_sibling;
+        int m_targets[METHOD_COUNT];
+    };
+    struct host_slot
+    {
+        unsigned int m_hash;
+        int m_root;
+        string m_name;
+    };
+
+    static int method_index( const char* method, int len );
+    static unsigned int host_hash( const char* host, int len );
+    int new_node( char ch );
+    int walk( int root, const char* path, int len, int method ) const;
+    const host_slot* find_host( const char* host, int len ) const;
+
+private:
+    int m_rule_count;
+    int m_any_root;
+    vector< trie_node > m_nodes;
+    vector< host_slot > m_host_list;
+    vector< host_slot > m_host_table;
+    vector< vector<int> > m_targets;
+};
+
+#endif